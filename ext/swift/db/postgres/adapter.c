@@ -6,18 +6,34 @@
 #include <stdbool.h>
 
 #include "adapter.h"
+#include "arrow.h"
+#include "bind.h"
+#include "cache.h"
+#include "copy.h"
+#include "pipeline.h"
 #include "typecast.h"
+#include "types.h"
 #include "gvl.h"
 
+#include <ruby/io.h>
+#include <errno.h>
+#include <poll.h>
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+#include <ruby/fiber/scheduler.h>
+#endif
+
 #define BUFFER_SIZE (4096)
 #define MIN(a, b)   ((a) <= (b) ? (a) : (b))
 
 /* declaration */
 VALUE cDPA, sUser;
 VALUE db_postgres_result_each(VALUE);
-VALUE db_postgres_result_load(VALUE, PGresult *, VALUE decoder);
+VALUE db_postgres_result_load(VALUE, PGresult *, Adapter *);
+VALUE db_postgres_result_stream(VALUE, PGresult *);
 VALUE db_postgres_result_allocate(VALUE);
+VALUE db_postgres_result_copied(VALUE, size_t);
 VALUE db_postgres_statement_allocate(VALUE);
+GVL_NOLOCK_RETURN_TYPE nogvl_pq_exec_prepared(void *);
 VALUE db_postgres_statement_initialize(VALUE, VALUE, VALUE);
 
 /* definition */
@@ -36,20 +52,39 @@ Adapter* db_postgres_adapter_handle_safe(VALUE self) {
     return a;
 }
 
+void db_postgres_adapter_mark(Adapter *a) {
+    if (a) {
+        if (a->cache)
+            rb_gc_mark(a->cache);
+        if (a->deallocate)
+            rb_gc_mark(a->deallocate);
+        if (a->encoder)
+            rb_gc_mark(a->encoder);
+        if (a->decoder)
+            rb_gc_mark(a->decoder);
+        if (a->types)
+            rb_gc_mark(a->types);
+        if (a->io)
+            rb_gc_mark(a->io);
+        if (a->pool)
+            rb_gc_mark(a->pool);
+        if (a->deferred)
+            rb_gc_mark(a->deferred);
+        if (a->normalized)
+            rb_gc_mark(a->normalized);
+        if (a->bind_values)
+            rb_gc_mark(a->bind_values);
+    }
+}
+
 VALUE db_postgres_adapter_deallocate(Adapter *a) {
     if (a) {
         if (a->connection) {
             PQfinish(a->connection);
             a->connection = NULL;
         }
-        if (a->encoder) {
-            rb_gc_unregister_address(&a->encoder);
-            a->encoder = 0;
-        }
-        if (a->decoder) {
-            rb_gc_unregister_address(&a->decoder);
-            a->decoder = 0;
-        }
+        if (a->bind_arena)
+            free(a->bind_arena);
         free(a);
     }
     return Qtrue;
@@ -61,7 +96,7 @@ VALUE db_postgres_adapter_allocate(VALUE klass) {
         rb_raise(rb_eNoMemError, "adapter");
 
     memset(a, 0, sizeof(Adapter));
-    return Data_Wrap_Struct(klass, 0, db_postgres_adapter_deallocate, a);
+    return Data_Wrap_Struct(klass, db_postgres_adapter_mark, db_postgres_adapter_deallocate, a);
 }
 
 /* TODO: log messages */
@@ -82,11 +117,125 @@ static int append_ssl_option(char *buffer, int size, VALUE ssl, char *key, char
     return nchars;
 }
 
-VALUE db_postgres_adapter_initialize(VALUE self, VALUE options) {
+VALUE db_postgres_adapter_timestamp_format(VALUE self) {
+    Adapter *a = db_postgres_adapter_handle(self);
+
+    if (a->typecast & TYPECAST_TIMESTAMP_EPOCH)
+        return ID2SYM(rb_intern("epoch"));
+    if (a->typecast & TYPECAST_TIMESTAMP_TIME)
+        return ID2SYM(rb_intern("time"));
+    return ID2SYM(rb_intern("datetime"));
+}
+
+VALUE db_postgres_adapter_timestamp_format_set(VALUE self, VALUE format) {
+    ID id;
+    Adapter *a = db_postgres_adapter_handle(self);
+
+    if (TYPE(format) != T_SYMBOL)
+        rb_raise(eSwiftArgumentError, "timestamp format needs to be one of :datetime, :time or :epoch");
+
+    id = SYM2ID(format);
+    a->typecast &= ~(TYPECAST_TIMESTAMP_TIME | TYPECAST_TIMESTAMP_EPOCH);
+    if (id == rb_intern("time"))
+        a->typecast |= TYPECAST_TIMESTAMP_TIME;
+    else if (id == rb_intern("epoch"))
+        a->typecast |= TYPECAST_TIMESTAMP_EPOCH;
+    else if (id != rb_intern("datetime"))
+        rb_raise(eSwiftArgumentError, "timestamp format needs to be one of :datetime, :time or :epoch");
+
+    return format;
+}
+
+VALUE db_postgres_adapter_numeric_format(VALUE self) {
+    Adapter *a = db_postgres_adapter_handle(self);
+
+    if (a->typecast & TYPECAST_NUMERIC_AUTO)
+        return ID2SYM(rb_intern("auto"));
+    if (a->typecast & TYPECAST_NUMERIC_RATIONAL)
+        return ID2SYM(rb_intern("rational"));
+    if (a->typecast & TYPECAST_NUMERIC_FLOAT)
+        return ID2SYM(rb_intern("float"));
+    return ID2SYM(rb_intern("bigdecimal"));
+}
+
+VALUE db_postgres_adapter_numeric_format_set(VALUE self, VALUE format) {
+    ID id;
+    Adapter *a = db_postgres_adapter_handle(self);
+
+    if (TYPE(format) != T_SYMBOL)
+        rb_raise(eSwiftArgumentError, "numeric format needs to be one of :bigdecimal, :auto, :rational or :float");
+
+    id = SYM2ID(format);
+    a->typecast &= ~(TYPECAST_NUMERIC_AUTO | TYPECAST_NUMERIC_RATIONAL | TYPECAST_NUMERIC_FLOAT);
+    if (id == rb_intern("auto"))
+        a->typecast |= TYPECAST_NUMERIC_AUTO;
+    else if (id == rb_intern("rational"))
+        a->typecast |= TYPECAST_NUMERIC_RATIONAL;
+    else if (id == rb_intern("float"))
+        a->typecast |= TYPECAST_NUMERIC_FLOAT;
+    else if (id != rb_intern("bigdecimal"))
+        rb_raise(eSwiftArgumentError, "numeric format needs to be one of :bigdecimal, :auto, :rational or :float");
+
+    return format;
+}
+
+VALUE db_postgres_adapter_bytea_format(VALUE self) {
+    Adapter *a = db_postgres_adapter_handle(self);
+    return ID2SYM(rb_intern(a->typecast & TYPECAST_BYTEA_STRING ? "string" : "io"));
+}
+
+VALUE db_postgres_adapter_bytea_format_set(VALUE self, VALUE format) {
+    ID id;
+    Adapter *a = db_postgres_adapter_handle(self);
+
+    if (TYPE(format) != T_SYMBOL)
+        rb_raise(eSwiftArgumentError, "bytea format needs to be one of :io or :string");
+
+    id = SYM2ID(format);
+    if (id == rb_intern("string"))
+        a->typecast |= TYPECAST_BYTEA_STRING;
+    else if (id == rb_intern("io"))
+        a->typecast &= ~TYPECAST_BYTEA_STRING;
+    else
+        rb_raise(eSwiftArgumentError, "bytea format needs to be one of :io or :string");
+
+    return format;
+}
+
+VALUE db_postgres_adapter_json_format(VALUE self) {
+    Adapter *a = db_postgres_adapter_handle(self);
+
+    if (a->typecast & TYPECAST_JSON_SYMBOLIZE)
+        return ID2SYM(rb_intern("symbolize"));
+    if (a->typecast & TYPECAST_JSON_PARSE)
+        return ID2SYM(rb_intern("parse"));
+    return ID2SYM(rb_intern("string"));
+}
+
+VALUE db_postgres_adapter_json_format_set(VALUE self, VALUE format) {
+    ID id;
+    Adapter *a = db_postgres_adapter_handle(self);
+
+    if (TYPE(format) != T_SYMBOL)
+        rb_raise(eSwiftArgumentError, "json format needs to be one of :string, :parse or :symbolize");
+
+    id = SYM2ID(format);
+    a->typecast &= ~(TYPECAST_JSON_PARSE | TYPECAST_JSON_SYMBOLIZE);
+    if (id == rb_intern("parse"))
+        a->typecast |= TYPECAST_JSON_PARSE;
+    else if (id == rb_intern("symbolize"))
+        a->typecast |= TYPECAST_JSON_PARSE | TYPECAST_JSON_SYMBOLIZE;
+    else if (id != rb_intern("string"))
+        rb_raise(eSwiftArgumentError, "json format needs to be one of :string, :parse or :symbolize");
+
+    return format;
+}
+
+/* builds the libpq connection string, the caller frees it */
+static char* db_postgres_adapter_connection_info(VALUE options) {
     char *connection_info;
     bool use_unix_socket = false;
     VALUE db, user, pass, host, port, ssl, enc;
-    Adapter *a = db_postgres_adapter_handle(self);
 
     if (TYPE(options) != T_HASH)
         rb_raise(eSwiftArgumentError, "options needs to be a hash");
@@ -124,6 +273,10 @@ VALUE db_postgres_adapter_initialize(VALUE self, VALUE options) {
     else
         nchars = snprintf(connection_info, BUFFER_SIZE, "dbname='%s' host='%s' port='%s'", CSTRING(db), CSTRING(host), CSTRING(port));
 
+    /* sent in the startup packet, saves the round trip PQsetClientEncoding would make */
+    nchars += snprintf(connection_info + MIN(nchars, BUFFER_SIZE), BUFFER_SIZE - nchars, " client_encoding='%s'",
+        CSTRING(enc));
+
     if (!NIL_P(user)) {
         nchars += snprintf(connection_info + MIN(nchars, BUFFER_SIZE), BUFFER_SIZE - nchars, " user='%s' password='%s'",
             CSTRING(user), CSTRING(pass));
@@ -137,20 +290,210 @@ VALUE db_postgres_adapter_initialize(VALUE self, VALUE options) {
         nchars += append_ssl_option(connection_info + MIN(nchars, BUFFER_SIZE), BUFFER_SIZE - nchars, ssl, "sslcrl",       0);
     }
 
-    a->connection = PQconnectdb(connection_info);
+    return connection_info;
+}
+
+static GVL_NOLOCK_RETURN_TYPE nogvl_pq_connect_start(void *ptr) {
+    return (GVL_NOLOCK_RETURN_TYPE)PQconnectStart((const char *)ptr);
+}
+
+static GVL_NOLOCK_RETURN_TYPE nogvl_pq_connect_poll(void *ptr) {
+    return (GVL_NOLOCK_RETURN_TYPE)(intptr_t)PQconnectPoll((PGconn *)ptr);
+}
+
+/* host name lookup can block in PQconnectStart and PQconnectPoll, both run without the GVL */
+static void db_postgres_adapter_connect_start(Adapter *a, VALUE options) {
+    char *connection_info = db_postgres_adapter_connection_info(options);
+
+    a->connection = (PGconn *)GVL_NOLOCK(nogvl_pq_connect_start, connection_info, RUBY_UBF_IO, 0);
     free(connection_info);
 
     if (!a->connection)
         rb_raise(eSwiftRuntimeError, "unable to allocate database handle");
     if (PQstatus(a->connection) == CONNECTION_BAD)
         rb_raise(eSwiftConnectionError, "%s", PQerrorMessage(a->connection));
+}
 
-    PQsetNoticeProcessor(a->connection, (PQnoticeProcessor)db_postgres_adapter_notice, (void*)self);
-    if (PQsetClientEncoding(a->connection, CSTRING(enc)) != 0)
+/* advances the connection by one step, the socket may change in between so callers fetch it for every wait */
+static PostgresPollingStatusType db_postgres_adapter_connect_poll(Adapter *a) {
+    PostgresPollingStatusType status;
+
+    status = (PostgresPollingStatusType)(intptr_t)GVL_NOLOCK(nogvl_pq_connect_poll, a->connection, RUBY_UBF_IO, 0);
+    if (status == PGRES_POLLING_FAILED)
         rb_raise(eSwiftConnectionError, "%s", PQerrorMessage(a->connection));
+    return status;
+}
+
+static int db_postgres_adapter_connect_events(PostgresPollingStatusType status) {
+    return status == PGRES_POLLING_READING ? RB_WAITFD_IN : RB_WAITFD_OUT;
+}
+
+static void db_postgres_adapter_setup(VALUE self, VALUE options) {
+    VALUE binary, params, chunk, cache, timestamp, numeric, bytea, json, discover, copy_buffer, normalize, max_result;
+    Adapter *a = db_postgres_adapter_handle(self);
+
+    binary = rb_hash_aref(options, ID2SYM(rb_intern("binary")));
+    params = rb_hash_aref(options, ID2SYM(rb_intern("binary_params")));
+    chunk  = rb_hash_aref(options, ID2SYM(rb_intern("chunk_size")));
+    cache  = rb_hash_aref(options, ID2SYM(rb_intern("statement_cache")));
+    timestamp = rb_hash_aref(options, ID2SYM(rb_intern("timestamp_format")));
+    numeric   = rb_hash_aref(options, ID2SYM(rb_intern("numeric_format")));
+    bytea     = rb_hash_aref(options, ID2SYM(rb_intern("bytea_format")));
+    json      = rb_hash_aref(options, ID2SYM(rb_intern("json_format")));
+    discover  = rb_hash_aref(options, ID2SYM(rb_intern("discover_types")));
+    copy_buffer = rb_hash_aref(options, ID2SYM(rb_intern("copy_buffer_size")));
+    normalize   = rb_hash_aref(options, ID2SYM(rb_intern("normalize_cache")));
+    max_result  = rb_hash_aref(options, ID2SYM(rb_intern("max_result_size")));
+
+    PQsetNoticeProcessor(a->connection, (PQnoticeProcessor)db_postgres_adapter_notice, (void*)self);
+
+    a->binary        = RTEST(binary) ? 1 : 0;
+    a->binary_params = RTEST(params) ? 1 : 0;
+    a->chunk_size    = NIL_P(chunk) ? 1000 : NUM2INT(chunk);
+    a->cache_size    = NIL_P(cache) ? 0 : NUM2INT(cache);
+    a->copy_buffer_size = NIL_P(copy_buffer) ? COPY_BUFFER_SIZE : NUM2INT(copy_buffer);
+    a->normalize_size   = NIL_P(normalize) ? 256 : NUM2INT(normalize);
+    a->max_result_size  = NIL_P(max_result) ? 0 : NUM2SIZET(max_result);
+
+    if (a->copy_buffer_size < BUFFER_SIZE)
+        rb_raise(eSwiftArgumentError, "copy_buffer_size needs to be at least %d bytes", BUFFER_SIZE);
+
+    if (!NIL_P(timestamp))
+        db_postgres_adapter_timestamp_format_set(self, timestamp);
+    if (!NIL_P(numeric))
+        db_postgres_adapter_numeric_format_set(self, numeric);
+    if (!NIL_P(bytea))
+        db_postgres_adapter_bytea_format_set(self, bytea);
+    if (!NIL_P(json))
+        db_postgres_adapter_json_format_set(self, json);
+
+    a->types = db_postgres_types_load(a, discover != Qfalse, 0);
+}
+
+VALUE db_postgres_adapter_initialize(VALUE self, VALUE options) {
+    PostgresPollingStatusType status = PGRES_POLLING_WRITING;
+    Adapter *a = db_postgres_adapter_handle(self);
+
+    db_postgres_adapter_connect_start(a, options);
+    while (status != PGRES_POLLING_OK) {
+        db_postgres_adapter_wait(a, db_postgres_adapter_connect_events(status));
+        status = db_postgres_adapter_connect_poll(a);
+    }
+
+    db_postgres_adapter_setup(self, options);
     return self;
 }
 
+typedef struct Connect {
+    VALUE adapters;
+    PostgresPollingStatusType *status;
+    struct pollfd *fds;
+    long *index;
+    nfds_t count;
+    int error;
+} Connect;
+
+static GVL_NOLOCK_RETURN_TYPE nogvl_connect_poll(void *ptr) {
+    Connect *c = (Connect *)ptr;
+    c->error = poll(c->fds, c->count, -1) < 0 ? errno : 0;
+    return 0;
+}
+
+/* polls every pending connection that has its socket ready, a single poll without the GVL covers all of them */
+static void db_postgres_adapter_connect_all(Connect *c) {
+    long n;
+    nfds_t i;
+    Adapter *a;
+
+    while (1) {
+        for (n = 0, c->count = 0; n < RARRAY_LEN(c->adapters); n++) {
+            if (c->status[n] == PGRES_POLLING_OK)
+                continue;
+
+            a = db_postgres_adapter_handle(rb_ary_entry(c->adapters, n));
+            c->fds[c->count].fd      = PQsocket(a->connection);
+            c->fds[c->count].events  = c->status[n] == PGRES_POLLING_READING ? POLLIN : POLLOUT;
+            c->fds[c->count].revents = 0;
+            c->index[c->count++]     = n;
+        }
+
+        if (!c->count)
+            break;
+
+        GVL_NOLOCK(nogvl_connect_poll, c, RUBY_UBF_IO, 0);
+        if (c->error == EINTR) {
+            rb_thread_check_ints();
+            continue;
+        }
+        if (c->error)
+            rb_syserr_fail(c->error, "postgres socket");
+
+        for (i = 0; i < c->count; i++) {
+            if (c->fds[i].revents) {
+                a = db_postgres_adapter_handle(rb_ary_entry(c->adapters, c->index[i]));
+                c->status[c->index[i]] = db_postgres_adapter_connect_poll(a);
+            }
+        }
+    }
+}
+
+/* a fiber scheduler waits on one IO at a time, the other handshakes still make progress in the meantime */
+static void db_postgres_adapter_connect_each(Connect *c) {
+    long n, pending;
+    Adapter *a;
+
+    do {
+        for (n = 0, pending = 0; n < RARRAY_LEN(c->adapters); n++) {
+            if (c->status[n] == PGRES_POLLING_OK)
+                continue;
+
+            a = db_postgres_adapter_handle(rb_ary_entry(c->adapters, n));
+            db_postgres_adapter_wait(a, db_postgres_adapter_connect_events(c->status[n]));
+            if ((c->status[n] = db_postgres_adapter_connect_poll(a)) != PGRES_POLLING_OK)
+                pending++;
+        }
+    } while (pending);
+}
+
+/*
+ * Opens count connections with the same options, the connection handshakes run concurrently so warming up a pool
+ * costs about as much as a single connection.
+ */
+VALUE db_postgres_adapter_s_connect(VALUE klass, VALUE count, VALUE options) {
+    long n, size = NUM2LONG(count);
+    VALUE status, fds, index;
+    Connect c;
+
+    if (size < 0)
+        rb_raise(eSwiftArgumentError, "connection count needs to be positive");
+
+    /* sized by the caller so they live on the heap for large counts, the GC frees them if a connection raises */
+    c.adapters = rb_ary_new2(size);
+    c.status   = ALLOCV_N(PostgresPollingStatusType, status, size);
+    c.fds      = ALLOCV_N(struct pollfd, fds, size);
+    c.index    = ALLOCV_N(long, index, size);
+
+    for (n = 0; n < size; n++) {
+        rb_ary_push(c.adapters, rb_obj_alloc(klass));
+        db_postgres_adapter_connect_start(db_postgres_adapter_handle(rb_ary_entry(c.adapters, n)), options);
+        c.status[n] = PGRES_POLLING_WRITING;
+    }
+
+    if (NIL_P(db_postgres_adapter_scheduler()))
+        db_postgres_adapter_connect_all(&c);
+    else
+        db_postgres_adapter_connect_each(&c);
+
+    ALLOCV_END(status);
+    ALLOCV_END(fds);
+    ALLOCV_END(index);
+
+    for (n = 0; n < size; n++)
+        db_postgres_adapter_setup(rb_ary_entry(c.adapters, n), options);
+
+    return c.adapters;
+}
+
 GVL_NOLOCK_RETURN_TYPE nogvl_pq_exec(void *ptr) {
     Query *q = (Query *)ptr;
     return (GVL_NOLOCK_RETURN_TYPE)PQexec(q->connection, q->command);
@@ -158,145 +501,222 @@ GVL_NOLOCK_RETURN_TYPE nogvl_pq_exec(void *ptr) {
 
 GVL_NOLOCK_RETURN_TYPE nogvl_pq_exec_params(void *ptr) {
     Query *q = (Query *)ptr;
-    PGresult * r = PQexecParams(q->connection, q->command, q->n_args, 0, (const char * const *)q->data, q->size, q->format, 0);
+    PGresult * r = PQexecParams(q->connection, q->command, q->n_args, q->types, (const char * const *)q->data, q->size, q->format, q->result_format);
     return (GVL_NOLOCK_RETURN_TYPE)r;
 }
 
+static GVL_NOLOCK_RETURN_TYPE nogvl_pq_prepare(void *ptr) {
+    Query *q = (Query *)ptr;
+    return (GVL_NOLOCK_RETURN_TYPE)PQprepare(q->connection, q->name ? q->name : "", q->command, q->n_args, q->types);
+}
+
+static GVL_NOLOCK_RETURN_TYPE nogvl_pq_describe_prepared(void *ptr) {
+    Query *q = (Query *)ptr;
+    return (GVL_NOLOCK_RETURN_TYPE)PQdescribePrepared(q->connection, q->command);
+}
+
+static int db_postgres_adapter_normalized_first(VALUE key, VALUE value, VALUE ptr) {
+    *(VALUE *)ptr = key;
+    return ST_STOP;
+}
+
+/* statements without a ? never reach the cache, so it only holds sql that actually needed rewriting */
+VALUE db_postgres_adapter_normalized_sql(Adapter *a, VALUE sql) {
+    int standard_strings;
+    const char *setting;
+    VALUE normalized, oldest = Qnil;
+
+    if (!memchr(RSTRING_PTR(sql), '?', RSTRING_LEN(sql)))
+        return sql;
+
+    setting          = PQparameterStatus(a->connection, "standard_conforming_strings");
+    standard_strings = !setting || strcmp(setting, "off") != 0;
+
+    if (a->normalize_size < 1)
+        return db_postgres_normalized_sql(sql, standard_strings);
+
+    if (!a->normalized)
+        a->normalized = rb_hash_new();
+
+    if (a->standard_strings != standard_strings) {
+        rb_hash_clear(a->normalized);
+        a->standard_strings = standard_strings;
+    }
+
+    normalized = rb_hash_aref(a->normalized, sql);
+    if (!NIL_P(normalized))
+        return normalized;
+
+    normalized = rb_obj_freeze(db_postgres_normalized_sql(sql, standard_strings));
+    while (RHASH_SIZE(a->normalized) >= (size_t)a->normalize_size) {
+        rb_hash_foreach(a->normalized, db_postgres_adapter_normalized_first, (VALUE)&oldest);
+        rb_hash_delete(a->normalized, oldest);
+    }
+    rb_hash_aset(a->normalized, sql, normalized);
+    return normalized;
+}
+
 VALUE db_postgres_adapter_execute(int argc, VALUE *argv, VALUE self) {
-    char **bind_args_data = 0;
-    int n, *bind_args_size = 0, *bind_args_fmt = 0;
+    Bind b;
     PGresult *result;
-    VALUE sql, bind, data, typecast_bind;
+    VALUE sql, bind;
     Adapter *a = db_postgres_adapter_handle_safe(self);
 
     rb_scan_args(argc, argv, "10*", &sql, &bind);
     if (!a->native)
-        sql = db_postgres_normalized_sql(sql);
-
-    typecast_bind = rb_ary_new();
-    rb_gc_register_address(&typecast_bind);
-    rb_gc_register_address(&sql);
-    rb_gc_register_address(&bind);
-
-    if (RARRAY_LEN(bind) > 0) {
-        bind_args_size = (int *) malloc(sizeof(int) * RARRAY_LEN(bind));
-        if (!bind_args_size)
-            rb_raise(rb_eNoMemError, "bind args");
-        bind_args_fmt  = (int *) malloc(sizeof(int) * RARRAY_LEN(bind));
-        if (!bind_args_fmt) {
-            free(bind_args_size);
-            rb_raise(rb_eNoMemError, "bind args");
-        }
-        bind_args_data = (char **) malloc(sizeof(char *) * RARRAY_LEN(bind));
-        if (!bind_args_data) {
-            free(bind_args_size);
-            free(bind_args_fmt);
-            rb_raise(rb_eNoMemError, "bind args");
-        }
+        sql = db_postgres_adapter_normalized_sql(a, sql);
 
-        for (n = 0; n < RARRAY_LEN(bind); n++) {
-            data = rb_ary_entry(bind, n);
-            if (NIL_P(data)) {
-                bind_args_size[n] = 0;
-                bind_args_data[n] = 0;
-                bind_args_fmt[n]  = 0;
-            }
-            else {
-                if (rb_obj_is_kind_of(data, rb_cIO) || rb_obj_is_kind_of(data, cStringIO))
-                    bind_args_fmt[n] = 1;
-                else
-                    bind_args_fmt[n] = 0;
-
-                VALUE coerced = typecast_encode(data);
-                if (NIL_P(coerced)) {
-                    coerced = a->encoder
-                        ? rb_funcall(a->encoder, rb_intern("call"), 1, data)
-                        : typecast_to_str(data);
-                }
-
-                rb_ary_push(typecast_bind, coerced);
-                bind_args_size[n] = RSTRING_LEN(coerced);
-                bind_args_data[n] = RSTRING_PTR(coerced);
-            }
-        }
+    if (RARRAY_LEN(bind) > 0 && a->cache_size > 0)
+        result = db_postgres_cache_execute(a, sql, bind);
+    else if (RARRAY_LEN(bind) > 0) {
+        db_postgres_bind_encode(&b, a, bind, a->binary_params, 0);
 
         Query q = {
-            .connection = a->connection,
-            .command    = CSTRING(sql),
-            .n_args     = RARRAY_LEN(bind),
-            .data       = bind_args_data,
-            .size       = bind_args_size,
-            .format     = bind_args_fmt
+            .connection    = a->connection,
+            .command       = CSTRING(sql),
+            .n_args        = b.n_args,
+            .data          = b.data,
+            .size          = b.size,
+            .format        = b.format,
+            .types         = b.types,
+            .result_format = a->binary,
+            .max_size      = a->max_result_size
         };
 
-        result = (PGresult *)GVL_NOLOCK(nogvl_pq_exec_params, &q, RUBY_UBF_IO, 0);
-        free(bind_args_size);
-        free(bind_args_data);
-        free(bind_args_fmt);
+        result = db_postgres_adapter_exec(a, &q, QUERY_PARAMS);
+        RB_GC_GUARD(b.values);
+        db_postgres_bind_free(&b);
+    }
+    /* PQexec can only return text results, binary needs the extended protocol */
+    else if (a->binary) {
+        Query q = {.connection = a->connection, .command = CSTRING(sql), .result_format = 1, .max_size = a->max_result_size};
+        result = db_postgres_adapter_exec(a, &q, QUERY_PARAMS);
     }
     else {
-        Query q = {.connection = a->connection, .command = CSTRING(sql)};
-        result = (PGresult *)GVL_NOLOCK(nogvl_pq_exec, &q, RUBY_UBF_IO, 0);
+        Query q = {.connection = a->connection, .command = CSTRING(sql), .max_size = a->max_result_size};
+        result = db_postgres_adapter_exec(a, &q, QUERY_SIMPLE);
     }
 
-    rb_gc_unregister_address(&typecast_bind);
-    rb_gc_unregister_address(&sql);
-    rb_gc_unregister_address(&bind);
+    RB_GC_GUARD(sql);
+    RB_GC_GUARD(bind);
     db_postgres_check_result(result);
-    return db_postgres_result_load(db_postgres_result_allocate(cDPR), result, a->decoder);
+    return db_postgres_result_load(db_postgres_result_allocate(cDPR), result, a);
+}
+
+static void db_postgres_adapter_deferred_clear(Adapter *a) {
+    if (a->deferred)
+        rb_ary_clear(a->deferred);
+    a->t_begin = 0;
+}
+
+/* nesting as tracked by the adapter, reset when the server says the transaction ended e.g. by a commit sent as sql */
+static int db_postgres_adapter_nesting(Adapter *a) {
+    if (a->t_nesting > 0 && !a->t_begin && PQtransactionStatus(a->connection) == PQTRANS_IDLE) {
+        a->t_nesting = 0;
+        db_postgres_adapter_deferred_clear(a);
+    }
+    return a->t_nesting;
+}
+
+/* transaction control is queued and goes out with the next statement instead of taking a round trip of its own */
+static void db_postgres_adapter_defer(Adapter *a, VALUE command) {
+    if (!a->deferred)
+        a->deferred = rb_ary_new();
+    rb_ary_push(a->deferred, rb_obj_freeze(command));
+}
+
+/* a savepoint that never went out needs no release or rollback either */
+static int db_postgres_adapter_undefer(Adapter *a, VALUE command) {
+    long size = a->deferred ? RARRAY_LEN(a->deferred) : 0;
+    if (size > 0 && rb_str_equal(rb_ary_entry(a->deferred, size - 1), command) == Qtrue) {
+        rb_ary_pop(a->deferred);
+        return 1;
+    }
+    return 0;
+}
+
+/* sends queued transaction control on its own, for the paths that cannot carry it along with their statement */
+void db_postgres_adapter_deferred_flush(Adapter *a) {
+    PGresult *result;
+    if (a->deferred && RARRAY_LEN(a->deferred) > 0) {
+        result = db_postgres_adapter_exec_sql(a, "");
+        db_postgres_check_result(result);
+        PQclear(result);
+    }
+}
+
+/* queues transaction control at the head of a pipeline, the caller reads a result for each command it returns */
+long db_postgres_adapter_deferred_send(Adapter *a) {
+    long n, size = a->deferred ? RARRAY_LEN(a->deferred) : 0;
+    VALUE commands = a->deferred;
+
+    if (size == 0)
+        return 0;
+
+    a->deferred = rb_ary_new();
+    a->t_begin  = 0;
+
+    for (n = 0; n < size; n++) {
+        if (!PQsendQueryParams(a->connection, CSTRING(rb_ary_entry(commands, n)), 0, 0, 0, 0, 0, 0))
+            rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(a->connection));
+    }
+
+    RB_GC_GUARD(commands);
+    return size;
 }
 
 VALUE db_postgres_adapter_begin(int argc, VALUE *argv, VALUE self) {
-    char command[256];
     VALUE savepoint;
-    PGresult *result;
 
     Adapter *a = db_postgres_adapter_handle_safe(self);
     rb_scan_args(argc, argv, "01", &savepoint);
 
-    if (a->t_nesting == 0) {
-        result = PQexec(a->connection, "begin");
-        db_postgres_check_result(result);
-        PQclear(result);
+    if (db_postgres_adapter_nesting(a) == 0) {
+        db_postgres_adapter_defer(a, rb_str_new2("begin"));
+        a->t_begin = 1;
         a->t_nesting++;
         if (NIL_P(savepoint))
             return Qtrue;
     }
 
+    /* savepoint names only need to be unique among the open ones, the nesting level is enough */
     if (NIL_P(savepoint))
-        savepoint = rb_uuid_string();
-
-    snprintf(command, 256, "savepoint sp%s", CSTRING(savepoint));
-    result = PQexec(a->connection, command);
-    db_postgres_check_result(result);
-    PQclear(result);
+        savepoint = rb_sprintf("%d", a->t_nesting);
 
+    db_postgres_adapter_defer(a, rb_sprintf("savepoint sp%s", CSTRING(savepoint)));
     a->t_nesting++;
     return savepoint;
 }
 
+static void db_postgres_adapter_end(Adapter *a, const char *command) {
+    PGresult *result;
+
+    /* nothing was sent since begin, there is no transaction on the server to end */
+    if (a->t_begin)
+        db_postgres_adapter_deferred_clear(a);
+    else {
+        result = db_postgres_adapter_exec_sql(a, command);
+        db_postgres_check_result(result);
+        PQclear(result);
+    }
+    a->t_nesting = 0;
+}
+
 VALUE db_postgres_adapter_commit(int argc, VALUE *argv, VALUE self) {
     VALUE savepoint;
-    char command[256];
-    PGresult *result;
 
     Adapter *a = db_postgres_adapter_handle_safe(self);
     rb_scan_args(argc, argv, "01", &savepoint);
 
-    if (a->t_nesting == 0)
+    if (db_postgres_adapter_nesting(a) == 0)
         return Qfalse;
 
-    if (NIL_P(savepoint)) {
-        result = PQexec(a->connection, "commit");
-        db_postgres_check_result(result);
-        PQclear(result);
-        a->t_nesting--;
-    }
+    /* releases still queued go out in the same round trip as the commit */
+    if (NIL_P(savepoint))
+        db_postgres_adapter_end(a, "commit");
     else {
-        snprintf(command, 256, "release savepoint sp%s", CSTRING(savepoint));
-        result = PQexec(a->connection, command);
-        db_postgres_check_result(result);
-        PQclear(result);
+        if (!db_postgres_adapter_undefer(a, rb_sprintf("savepoint sp%s", CSTRING(savepoint))))
+            db_postgres_adapter_defer(a, rb_sprintf("release savepoint sp%s", CSTRING(savepoint)));
         a->t_nesting--;
     }
     return Qtrue;
@@ -304,26 +724,22 @@ VALUE db_postgres_adapter_commit(int argc, VALUE *argv, VALUE self) {
 
 VALUE db_postgres_adapter_rollback(int argc, VALUE *argv, VALUE self) {
     VALUE savepoint;
-    char command[256];
-    PGresult *result;
 
     Adapter *a = db_postgres_adapter_handle_safe(self);
     rb_scan_args(argc, argv, "01", &savepoint);
 
-    if (a->t_nesting == 0)
+    if (db_postgres_adapter_nesting(a) == 0)
         return Qfalse;
 
     if (NIL_P(savepoint)) {
-        result = PQexec(a->connection, "rollback");
-        db_postgres_check_result(result);
-        PQclear(result);
-        a->t_nesting--;
+        /* the rollback discards whatever the queued savepoints would have done */
+        if (!a->t_begin)
+            db_postgres_adapter_deferred_clear(a);
+        db_postgres_adapter_end(a, "rollback");
     }
     else {
-        snprintf(command, 256, "rollback to savepoint sp%s", CSTRING(savepoint));
-        result = PQexec(a->connection, command);
-        db_postgres_check_result(result);
-        PQclear(result);
+        if (!db_postgres_adapter_undefer(a, rb_sprintf("savepoint sp%s", CSTRING(savepoint))))
+            db_postgres_adapter_defer(a, rb_sprintf("rollback to savepoint sp%s", CSTRING(savepoint)));
         a->t_nesting--;
     }
     return Qtrue;
@@ -339,7 +755,7 @@ VALUE db_postgres_adapter_transaction(int argc, VALUE *argv, VALUE self) {
     if (NIL_P(block))
         rb_raise(eSwiftRuntimeError, "postgres transaction requires a block");
 
-    if (a->t_nesting == 0) {
+    if (db_postgres_adapter_nesting(a) == 0) {
         db_postgres_adapter_begin(1, &savepoint, self);
         block_result = rb_protect(rb_yield, self, &status);
         if (!status) {
@@ -355,9 +771,7 @@ VALUE db_postgres_adapter_transaction(int argc, VALUE *argv, VALUE self) {
         }
     }
     else {
-        if (NIL_P(savepoint))
-            savepoint = rb_uuid_string();
-        db_postgres_adapter_begin(1, &savepoint, self);
+        savepoint = db_postgres_adapter_begin(1, &savepoint, self);
         block_result = rb_protect(rb_yield, self, &status);
         if (!status)
             db_postgres_adapter_commit(1, &savepoint, self);
@@ -375,6 +789,10 @@ VALUE db_postgres_adapter_close(VALUE self) {
     if (a->connection) {
         PQfinish(a->connection);
         a->connection = 0;
+        a->t_nesting  = 0;
+        db_postgres_adapter_deferred_clear(a);
+        /* prepared statements went away with the connection */
+        db_postgres_cache_clear(a);
         return Qtrue;
     }
     return Qfalse;
@@ -412,18 +830,21 @@ VALUE db_postgres_adapter_fileno(VALUE self) {
     return INT2NUM(PQsocket(a->connection));
 }
 
+/* the first result of a #query, the rest are dropped and a copy is left for the caller to carry on with */
 VALUE db_postgres_adapter_result(VALUE self) {
+    ExecStatusType status;
     PGresult *result, *rest;
     Adapter *a = db_postgres_adapter_handle_safe(self);
-    while (1) {
-        PQconsumeInput(a->connection);
-        if (!PQisBusy(a->connection))
-            break;
+
+    result = db_postgres_adapter_next_result(a);
+    status = result ? PQresultStatus(result) : PGRES_EMPTY_QUERY;
+
+    while (status != PGRES_COPY_IN && status != PGRES_COPY_OUT && (rest = db_postgres_adapter_next_result(a))) {
+        status = PQresultStatus(rest);
+        PQclear(rest);
     }
-    result = PQgetResult(a->connection);
-    while ((rest = PQgetResult(a->connection))) PQclear(rest);
     db_postgres_check_result(result);
-    return db_postgres_result_load(db_postgres_result_allocate(cDPR), result, a->decoder);
+    return db_postgres_result_load(db_postgres_result_allocate(cDPR), result, a);
 }
 
 VALUE db_postgres_adapter_native(VALUE self) {
@@ -446,81 +867,697 @@ VALUE db_postgres_adapter_native_set(VALUE self, VALUE flag) {
     return flag;
 }
 
+VALUE db_postgres_adapter_binary(VALUE self) {
+    int status, binary;
+    VALUE result;
+    Adapter *a = db_postgres_adapter_handle_safe(self);
+
+    binary    = a->binary;
+    a->binary = 1;
+    result    = rb_protect(rb_yield, Qnil, &status);
+    a->binary = binary;
+    if (status)
+        rb_jump_tag(status);
+    return result;
+}
+
+VALUE db_postgres_adapter_binary_set(VALUE self, VALUE flag) {
+    Adapter *a = db_postgres_adapter_handle_safe(self);
+    a->binary = RTEST(flag) ? 1 : 0;
+    return flag;
+}
+
+VALUE db_postgres_adapter_binary_params_set(VALUE self, VALUE flag) {
+    Adapter *a = db_postgres_adapter_handle_safe(self);
+    a->binary_params = RTEST(flag) ? 1 : 0;
+    return flag;
+}
+
+/* nil or 0 buffers results of any size */
+VALUE db_postgres_adapter_max_result_size(VALUE self) {
+    Adapter *a = db_postgres_adapter_handle_safe(self);
+    return a->max_result_size ? SIZET2NUM(a->max_result_size) : Qnil;
+}
+
+VALUE db_postgres_adapter_max_result_size_set(VALUE self, VALUE size) {
+    Adapter *a = db_postgres_adapter_handle_safe(self);
+    a->max_result_size = NIL_P(size) ? 0 : NUM2SIZET(size);
+    return size;
+}
+
 VALUE db_postgres_adapter_query(int argc, VALUE *argv, VALUE self) {
-    VALUE sql, bind, data;
-    char **bind_args_data = 0;
-    int n, ok = 1, *bind_args_size = 0, *bind_args_fmt = 0;
+    Bind b;
+    VALUE sql, bind;
+    int ok = 1;
     Adapter *a = db_postgres_adapter_handle_safe(self);
 
     rb_scan_args(argc, argv, "10*", &sql, &bind);
     if (!a->native)
-        sql = db_postgres_normalized_sql(sql);
+        sql = db_postgres_adapter_normalized_sql(a, sql);
 
+    db_postgres_adapter_deferred_flush(a);
     if (RARRAY_LEN(bind) > 0) {
-        bind_args_size = (int *) malloc(sizeof(int) * RARRAY_LEN(bind));
-        if (!bind_args_size)
-            rb_raise(rb_eNoMemError, "bind args");
-        bind_args_fmt  = (int *) malloc(sizeof(int) * RARRAY_LEN(bind));
-        if (!bind_args_fmt) {
-            free(bind_args_size);
-            rb_raise(rb_eNoMemError, "bind args");
+        db_postgres_bind_encode(&b, a, bind, a->binary_params, 0);
+
+        ok = PQsendQueryParams(a->connection, RSTRING_PTR(sql), b.n_args, b.types,
+            (const char* const *)b.data, b.size, b.format, a->binary);
+
+        RB_GC_GUARD(b.values);
+        RB_GC_GUARD(bind);
+        db_postgres_bind_free(&b);
+    }
+    else if (a->binary)
+        ok = PQsendQueryParams(a->connection, RSTRING_PTR(sql), 0, 0, 0, 0, 0, 1);
+    else
+        ok = PQsendQuery(a->connection, RSTRING_PTR(sql));
+
+    if (!ok)
+        rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(a->connection));
+
+    if (rb_block_given_p())
+        return db_postgres_result_each(db_postgres_adapter_result(self));
+    else
+        return Qtrue;
+}
+
+/* the fiber scheduler of the current thread, nil without one or on rubies that do not have them */
+VALUE db_postgres_adapter_scheduler() {
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+    return rb_fiber_scheduler_current();
+#else
+    return Qnil;
+#endif
+}
+
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+/* the scheduler waits on IO objects, the socket changes on reset so the IO is recreated when it no longer matches */
+static VALUE db_postgres_adapter_io(Adapter *a) {
+    int fd = PQsocket(a->connection);
+
+    if (!a->io || NUM2INT(rb_funcall(a->io, rb_intern("fileno"), 0)) != fd) {
+        a->io = rb_funcall(rb_cIO, rb_intern("for_fd"), 1, INT2NUM(fd));
+        rb_funcall(a->io, rb_intern("autoclose="), 1, Qfalse);
+    }
+    return a->io;
+}
+#endif
+
+/* waits on the connection socket without holding the GVL or yields to the fiber scheduler, returns the ready events */
+int db_postgres_adapter_wait(Adapter *a, int events) {
+    int ready;
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+    VALUE scheduler = db_postgres_adapter_scheduler(), result;
+
+    if (!NIL_P(scheduler)) {
+        result = rb_fiber_scheduler_io_wait(scheduler, db_postgres_adapter_io(a), INT2NUM(events), Qnil);
+        return FIXNUM_P(result) ? FIX2INT(result) : (RTEST(result) ? events : 0);
+    }
+#endif
+
+    if ((ready = rb_wait_for_single_fd(PQsocket(a->connection), events, 0)) < 0)
+        rb_sys_fail("postgres socket");
+    return ready;
+}
+
+/* waits for the next result without holding the GVL while the server is busy */
+PGresult* db_postgres_adapter_next_result(Adapter *a) {
+    while (PQisBusy(a->connection)) {
+        db_postgres_adapter_wait(a, RB_WAITFD_IN);
+        if (!PQconsumeInput(a->connection))
+            rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(a->connection));
+    }
+    return PQgetResult(a->connection);
+}
+
+static GVL_NOLOCK_RETURN_TYPE nogvl_pq_cancel(void *ptr) {
+    char error[256];
+    PQcancel((PGcancel *)ptr, error, sizeof(error));
+    return 0;
+}
+
+static GVL_NOLOCK_RETURN_TYPE nogvl_poll_input(void *ptr) {
+    struct pollfd *pfd = (struct pollfd *)ptr;
+    poll(pfd, 1, -1);
+    return 0;
+}
+
+/*
+ * Reads more input without the GVL. Unlike db_postgres_adapter_wait this never goes through the fiber scheduler, the
+ * drain runs from ensure blocks of fibers being killed and needs the connection idle again before the kill returns.
+ */
+static void db_postgres_adapter_drain_input(Adapter *a) {
+    struct pollfd pfd = {PQsocket(a->connection), POLLIN, 0};
+
+    GVL_NOLOCK(nogvl_poll_input, &pfd, RUBY_UBF_IO, 0);
+    if (!PQconsumeInput(a->connection))
+        rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(a->connection));
+}
+
+/*
+ * Drops the remaining results of the query in progress. libpq keeps handing out the copy state until a COPY is over,
+ * so a COPY TO STDOUT is read to the end and a COPY FROM STDIN is ended with an error that makes the server throw
+ * away what it got.
+ */
+void db_postgres_adapter_drain(Adapter *a) {
+    int n;
+    char *data;
+    PGresult *result;
+    ExecStatusType status;
+
+    while (1) {
+        while (PQisBusy(a->connection))
+            db_postgres_adapter_drain_input(a);
+        if (!(result = PQgetResult(a->connection)))
+            break;
+
+        status = PQresultStatus(result);
+        PQclear(result);
+
+        if (status == PGRES_COPY_OUT) {
+            while ((n = PQgetCopyData(a->connection, &data, 1)) != -1) {
+                if (n == -2)
+                    rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(a->connection));
+                if (n > 0)
+                    PQfreemem(data);
+                else
+                    db_postgres_adapter_drain_input(a);
+            }
         }
-        bind_args_data = (char **) malloc(sizeof(char *) * RARRAY_LEN(bind));
-        if (!bind_args_data) {
-            free(bind_args_size);
-            free(bind_args_fmt);
-            rb_raise(rb_eNoMemError, "bind args");
+        else if (status == PGRES_COPY_IN) {
+            /* cleanup has put the connection back in blocking mode, the message goes out right away */
+            if (PQputCopyEnd(a->connection, "copy discarded") != 1)
+                rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(a->connection));
         }
+    }
+}
 
-        rb_gc_register_address(&bind);
-        for (n = 0; n < RARRAY_LEN(bind); n++) {
-            data = rb_ary_entry(bind, n);
-            if (NIL_P(data)) {
-                bind_args_size[n] = 0;
-                bind_args_data[n] = 0;
-                bind_args_fmt[n]  = 0;
-            }
-            else {
-                if (rb_obj_is_kind_of(data, rb_cIO) || rb_obj_is_kind_of(data, cStringIO))
-                    bind_args_fmt[n] = 1;
-                else
-                    bind_args_fmt[n] = 0;
+/*
+ * Cancels the query in progress and drops whatever is left of it. The cancel request and the wait for the server to
+ * wind down happen without the GVL, an abandoned large query does not hold up other threads until it finishes.
+ */
+void db_postgres_adapter_discard(Adapter *a) {
+    PGcancel *cancel;
 
-                VALUE coerced = typecast_encode(data);
-                if (NIL_P(coerced)) {
-                    coerced = a->encoder
-                        ? rb_funcall(a->encoder, rb_intern("call"), 1, data)
-                        : typecast_to_str(data);
-                }
+    if ((cancel = PQgetCancel(a->connection))) {
+        GVL_NOLOCK(nogvl_pq_cancel, cancel, RUBY_UBF_IO, 0);
+        PQfreeCancel(cancel);
+    }
 
-                bind_args_size[n] = RSTRING_LEN(coerced);
-                bind_args_data[n] = RSTRING_PTR(coerced);
+    db_postgres_adapter_drain(a);
+}
+
+/* flushes queued commands on a non-blocking connection, reading results as they come in to avoid a deadlock */
+void db_postgres_adapter_flush(Adapter *a) {
+    int rc;
+    while ((rc = PQflush(a->connection)) == 1) {
+        if (db_postgres_adapter_wait(a, RB_WAITFD_IN | RB_WAITFD_OUT) & RB_WAITFD_IN) {
+            if (!PQconsumeInput(a->connection))
+                rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(a->connection));
+        }
+    }
+    if (rc < 0)
+        rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(a->connection));
+}
+
+static int db_postgres_adapter_send(Query *q, int kind) {
+    switch (kind) {
+        case QUERY_PARAMS:
+            return PQsendQueryParams(q->connection, q->command, q->n_args, q->types, (const char * const *)q->data,
+                q->size, q->format, q->result_format);
+        case QUERY_PREPARED:
+            return PQsendQueryPrepared(q->connection, q->command, q->n_args, (const char * const *)q->data, q->size,
+                q->format, q->result_format);
+        case QUERY_PREPARE:
+            return PQsendPrepare(q->connection, q->name ? q->name : "", q->command, q->n_args, q->types);
+        case QUERY_DESCRIBE:
+            return PQsendDescribePrepared(q->connection, q->command);
+        default:
+            return PQsendQuery(q->connection, q->command);
+    }
+}
+
+typedef struct Exec {
+    Adapter *adapter;
+    PGresult *result;
+    int nonblocking;
+    int done;
+} Exec;
+
+/* collects results the way PQexec does, the first error or the last result, and stops at a COPY */
+static VALUE db_postgres_adapter_exec_results(VALUE ptr) {
+    PGresult *result;
+    Exec *e = (Exec *)ptr;
+
+    db_postgres_adapter_flush(e->adapter);
+    while ((result = db_postgres_adapter_next_result(e->adapter))) {
+        if (e->result && PQresultStatus(e->result) == PGRES_FATAL_ERROR) {
+            PQclear(result);
+            continue;
+        }
+        if (e->result)
+            PQclear(e->result);
+
+        e->result = result;
+        if (PQresultStatus(result) == PGRES_COPY_IN || PQresultStatus(result) == PGRES_COPY_OUT)
+            break;
+    }
+
+    e->done = 1;
+    return Qnil;
+}
+
+/* the fiber may be killed while it waits, the query is cancelled so the connection can be used again */
+static VALUE db_postgres_adapter_exec_cleanup(VALUE ptr) {
+    Exec *e = (Exec *)ptr;
+
+    PQsetnonblocking(e->adapter->connection, e->nonblocking);
+    if (e->done)
+        return Qnil;
+
+    if (e->result)
+        PQclear(e->result);
+    db_postgres_adapter_discard(e->adapter);
+    return Qnil;
+}
+
+typedef struct Bounded {
+    Adapter *adapter;
+    size_t max_size;
+    /* bytes collected so far, kept as the rows come in so the check doesn't walk the whole result each time */
+    size_t size;
+    /* rows so far and the command status of the last statement that completed */
+    PGresult *rows;
+    PGresult *command;
+    int done;
+} Bounded;
+
+/* takes ownership of result */
+static void db_postgres_adapter_bounded_append(Bounded *b, PGresult *result) {
+    int row, col, base, rows = PQntuples(result), cols = PQnfields(result);
+
+    if (!b->rows && !(b->rows = PQcopyResult(result, PG_COPYRES_ATTRS))) {
+        PQclear(result);
+        rb_raise(rb_eNoMemError, "result rows");
+    }
+
+    base = PQntuples(b->rows);
+    for (row = 0; row < rows; row++) {
+        for (col = 0; col < cols; col++) {
+            if (!PQsetvalue(b->rows, base + row, col,
+                PQgetisnull(result, row, col) ? NULL : PQgetvalue(result, row, col),
+                PQgetisnull(result, row, col) ? -1 : PQgetlength(result, row, col))) {
+                PQclear(result);
+                rb_raise(rb_eNoMemError, "result rows");
             }
+            b->size += sizeof(char *) * 2 + PQgetlength(result, row, col) + 1;
         }
+    }
+    PQclear(result);
+}
+
+/* keeps the last statement like PQexec, rows of an earlier statement in the same query string are dropped */
+static void db_postgres_adapter_bounded_reset(Bounded *b) {
+    if (b->rows)
+        PQclear(b->rows);
+    if (b->command)
+        PQclear(b->command);
+    b->rows    = 0;
+    b->command = 0;
+    b->size    = 0;
+}
+
+static VALUE db_postgres_adapter_bounded_rows(VALUE ptr) {
+    PGresult *result;
+    ExecStatusType status;
+    Bounded *b = (Bounded *)ptr;
+
+    while ((result = db_postgres_adapter_next_result(b->adapter))) {
+        status = PQresultStatus(result);
+
+        /* the first error is the result, same as PQexec */
+        if (b->command && PQresultStatus(b->command) == PGRES_FATAL_ERROR) {
+            PQclear(result);
+            continue;
+        }
+        if (b->command || status == PGRES_FATAL_ERROR)
+            db_postgres_adapter_bounded_reset(b);
+
+        switch (status) {
+            case PGRES_SINGLE_TUPLE:
+#ifdef LIBPQ_HAS_CHUNK_MODE
+            case PGRES_TUPLES_CHUNK:
+#endif
+                db_postgres_adapter_bounded_append(b, result);
+                if (b->size > b->max_size)
+                    rb_raise(eSwiftRuntimeError, "result exceeds max_result_size of %lu bytes, use #stream instead", (unsigned long)b->max_size);
+                break;
+            default:
+                b->command = result;
+        }
+
+        if (status == PGRES_COPY_IN || status == PGRES_COPY_OUT)
+            break;
+    }
+
+    b->done = 1;
+    return Qnil;
+}
+
+/* an interrupted or oversized fetch cancels the query and drops whatever was collected */
+static VALUE db_postgres_adapter_bounded_cleanup(VALUE ptr) {
+    Bounded *b = (Bounded *)ptr;
+
+    if (b->done)
+        return Qnil;
+
+    db_postgres_adapter_discard(b->adapter);
+    db_postgres_adapter_bounded_reset(b);
+    return Qnil;
+}
 
-        ok = PQsendQueryParams(a->connection, RSTRING_PTR(sql), RARRAY_LEN(bind), 0,
-            (const char* const *)bind_args_data, bind_args_size, bind_args_fmt, 0);
+/* single row mode, or chunks of chunk_size rows where libpq supports it */
+static int db_postgres_adapter_single_row_mode(Adapter *a) {
+#ifdef LIBPQ_HAS_CHUNK_MODE
+    return a->chunk_size > 1 ? PQsetChunkedRowsMode(a->connection, a->chunk_size) : PQsetSingleRowMode(a->connection);
+#else
+    return PQsetSingleRowMode(a->connection);
+#endif
+}
+
+/* the collected rows, or the command status when the statement returned none */
+static PGresult* db_postgres_adapter_bounded_result(Bounded *b) {
+    if (!b->rows)
+        return b->command;
+
+    if (b->command)
+        PQclear(b->command);
+    return b->rows;
+}
 
-        rb_gc_unregister_address(&bind);
-        free(bind_args_size);
-        free(bind_args_data);
-        free(bind_args_fmt);
+#ifdef LIBPQ_HAS_PIPELINING
+typedef struct Deferred {
+    Adapter *adapter;
+    Query *query;
+    VALUE commands;
+    PGresult *result;
+    /* rows of a statement with a max_result_size, fetched in single row mode once the commands are through */
+    Bounded *bounded;
+    int kind;
+    int nonblocking;
+    int sent;
+    int synced;
+    int fetching;
+} Deferred;
+
+/* keeps the first error, or the last result of the statement itself */
+static void db_postgres_adapter_deferred_keep(Deferred *d, PGresult *result, int statement) {
+    if (d->result && PQresultStatus(d->result) == PGRES_FATAL_ERROR)
+        PQclear(result);
+    else if (PQresultStatus(result) == PGRES_FATAL_ERROR || statement) {
+        if (d->result)
+            PQclear(d->result);
+        d->result = result;
     }
     else
-        ok = PQsendQuery(a->connection, RSTRING_PTR(sql));
+        PQclear(result);
+}
+
+static VALUE db_postgres_adapter_deferred_results(VALUE ptr) {
+    long n, index = 0;
+    PGresult *result;
+    Deferred *d = (Deferred *)ptr;
+    PGconn *connection = d->adapter->connection;
+    long size = RARRAY_LEN(d->commands);
+
+    for (n = 0; n < size; n++) {
+        if (!PQsendQueryParams(connection, CSTRING(rb_ary_entry(d->commands, n)), 0, 0, 0, 0, 0, 0))
+            rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(connection));
+    }
+    if (!db_postgres_adapter_send(d->query, d->kind) || !PQpipelineSync(connection))
+        rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(connection));
+
+    d->sent = 1;
+    db_postgres_adapter_flush(d->adapter);
+
+    /* each command is terminated by a NULL result and the whole lot by the sync */
+    while (index < size) {
+        if (!(result = db_postgres_adapter_next_result(d->adapter)))
+            index++;
+        else
+            db_postgres_adapter_deferred_keep(d, result, 0);
+    }
+
+    if (d->bounded) {
+        if (!db_postgres_adapter_single_row_mode(d->adapter))
+            rb_raise(eSwiftRuntimeError, "unable to switch to single row mode");
+
+        d->fetching = 1;
+        db_postgres_adapter_bounded_rows((VALUE)d->bounded);
+        db_postgres_adapter_deferred_keep(d, db_postgres_adapter_bounded_result(d->bounded), 1);
+    }
+    else {
+        while ((result = db_postgres_adapter_next_result(d->adapter)))
+            db_postgres_adapter_deferred_keep(d, result, 1);
+    }
+
+    if (!(result = db_postgres_adapter_next_result(d->adapter)) || PQresultStatus(result) != PGRES_PIPELINE_SYNC)
+        rb_raise(eSwiftRuntimeError, "postgres pipeline out of sync");
+
+    PQclear(result);
+    d->synced = 1;
+    return Qnil;
+}
+
+static VALUE db_postgres_adapter_deferred_close(VALUE ptr) {
+    ExecStatusType status;
+    PGresult *result;
+    Deferred *d = (Deferred *)ptr;
+    PGconn *connection = d->adapter->connection;
+
+    PQsetnonblocking(connection, 0);
+    if (d->fetching && !d->bounded->done) {
+        db_postgres_adapter_discard(d->adapter);
+        db_postgres_adapter_bounded_reset(d->bounded);
+    }
+
+    if (!d->synced && (d->sent || PQpipelineSync(connection))) {
+        while (PQstatus(connection) == CONNECTION_OK) {
+            if (!(result = PQgetResult(connection)))
+                continue;
+            status = PQresultStatus(result);
+            PQclear(result);
+            if (status == PGRES_PIPELINE_SYNC)
+                break;
+        }
+    }
+
+    PQexitPipelineMode(connection);
+    PQsetnonblocking(connection, d->nonblocking);
+    return Qnil;
+}
+#endif
+
+/*
+ * Sends queued transaction control along with the statement. Simple queries carry it in the same query string, the
+ * extended protocol sends each command in one pipeline with the statement and a single sync at the end. A bounded
+ * statement switches to single row mode once the results of the commands ahead of it are in.
+ */
+static PGresult* db_postgres_adapter_exec_deferred(Adapter *a, Query *q, int kind) {
+    PGresult *result;
+    Query deferred = *q;
+    VALUE commands = a->deferred, sql;
+#ifdef LIBPQ_HAS_PIPELINING
+    Bounded b  = {a, q->max_size, 0, 0, 0, 0};
+    Deferred d = {a, q, commands, 0, q->max_size ? &b : 0, kind, PQisnonblocking(a->connection), 0, 0, 0};
+#endif
+
+    a->deferred = rb_ary_new();
+    a->t_begin  = 0;
+
+    if (kind == QUERY_SIMPLE) {
+        sql = rb_ary_join(commands, rb_str_new2(";"));
+        rb_str_cat2(sql, ";");
+        rb_str_cat2(sql, q->command);
+
+        deferred.command = RSTRING_PTR(sql);
+        result = db_postgres_adapter_exec(a, &deferred, QUERY_SIMPLE);
+        RB_GC_GUARD(sql);
+        return result;
+    }
+
+#ifdef LIBPQ_HAS_PIPELINING
+    if (!PQenterPipelineMode(a->connection) || PQsetnonblocking(a->connection, 1) != 0) {
+        PQexitPipelineMode(a->connection);
+        rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(a->connection));
+    }
+
+    rb_ensure(db_postgres_adapter_deferred_results, (VALUE)&d, db_postgres_adapter_deferred_close, (VALUE)&d);
+    RB_GC_GUARD(commands);
+    return d.result;
+#else
+    sql    = rb_ary_join(commands, rb_str_new2(";"));
+    result = db_postgres_adapter_exec_sql(a, RSTRING_PTR(sql));
+    db_postgres_check_result(result);
+    PQclear(result);
+    RB_GC_GUARD(sql);
+    return db_postgres_adapter_exec(a, q, kind);
+#endif
+}
+
+/*
+ * Fetches a query in single row (or chunked) mode and collects the rows into one result, raising as soon as it grows
+ * past q->max_size instead of letting libpq buffer all of it first.
+ */
+static PGresult* db_postgres_adapter_exec_bounded(Adapter *a, Query *q, int kind) {
+    Bounded b = {a, q->max_size, 0, 0, 0, 0};
+
+    if (!db_postgres_adapter_send(q, kind))
+        rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(a->connection));
+
+    if (!db_postgres_adapter_single_row_mode(a)) {
+        while ((b.command = db_postgres_adapter_next_result(a)))
+            PQclear(b.command);
+        rb_raise(eSwiftRuntimeError, "unable to switch to single row mode");
+    }
+
+    rb_ensure(db_postgres_adapter_bounded_rows, (VALUE)&b, db_postgres_adapter_bounded_cleanup, (VALUE)&b);
+    return db_postgres_adapter_bounded_result(&b);
+}
+
+/*
+ * Runs a query like PQexec. Without a fiber scheduler the blocking libpq call runs without the GVL, with one the
+ * query goes out on the non-blocking connection and the fiber yields to the scheduler while it waits on the socket.
+ */
+PGresult* db_postgres_adapter_exec(Adapter *a, Query *q, int kind) {
+    Exec e;
+
+    if (a->deferred && RARRAY_LEN(a->deferred) > 0)
+        return db_postgres_adapter_exec_deferred(a, q, kind);
+
+    if (q->max_size)
+        return db_postgres_adapter_exec_bounded(a, q, kind);
+
+    if (NIL_P(db_postgres_adapter_scheduler())) {
+        switch (kind) {
+            case QUERY_PARAMS:   return (PGresult *)GVL_NOLOCK(nogvl_pq_exec_params,   q, RUBY_UBF_IO, 0);
+            case QUERY_PREPARED: return (PGresult *)GVL_NOLOCK(nogvl_pq_exec_prepared, q, RUBY_UBF_IO, 0);
+            case QUERY_PREPARE:  return (PGresult *)GVL_NOLOCK(nogvl_pq_prepare,          q, RUBY_UBF_IO, 0);
+            case QUERY_DESCRIBE: return (PGresult *)GVL_NOLOCK(nogvl_pq_describe_prepared, q, RUBY_UBF_IO, 0);
+            default:             return (PGresult *)GVL_NOLOCK(nogvl_pq_exec,          q, RUBY_UBF_IO, 0);
+        }
+    }
+
+    e.adapter     = a;
+    e.result      = 0;
+    e.done        = 0;
+    e.nonblocking = PQisnonblocking(a->connection);
+
+    if (PQsetnonblocking(a->connection, 1) != 0 || !db_postgres_adapter_send(q, kind)) {
+        PQsetnonblocking(a->connection, e.nonblocking);
+        rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(a->connection));
+    }
+
+    rb_ensure(db_postgres_adapter_exec_results, (VALUE)&e, db_postgres_adapter_exec_cleanup, (VALUE)&e);
+    return e.result;
+}
+
+PGresult* db_postgres_adapter_exec_sql(Adapter *a, const char *sql) {
+    Query q = {.connection = a->connection, .command = (char *)sql};
+    return db_postgres_adapter_exec(a, &q, QUERY_SIMPLE);
+}
+
+typedef struct Stream {
+    Adapter *adapter;
+    VALUE result;
+    int done;
+} Stream;
+
+static VALUE db_postgres_adapter_stream_rows(VALUE ptr) {
+    PGresult *result;
+    Stream *s = (Stream *)ptr;
+
+    while ((result = db_postgres_adapter_next_result(s->adapter))) {
+        switch (PQresultStatus(result)) {
+            case PGRES_SINGLE_TUPLE:
+#ifdef LIBPQ_HAS_CHUNK_MODE
+            case PGRES_TUPLES_CHUNK:
+#endif
+                break;
+            /* final result with the command status, or an error */
+            default:
+                db_postgres_check_result(result);
+        }
+
+        if (NIL_P(s->result))
+            s->result = db_postgres_result_load(db_postgres_result_allocate(cDPR), result, s->adapter);
+        else
+            db_postgres_result_stream(s->result, result);
+
+        db_postgres_result_each(s->result);
+    }
+
+    s->done = 1;
+    return s->result;
+}
+
+/* the block may break out or raise half way through, the rest of the stream needs to be discarded. */
+static VALUE db_postgres_adapter_stream_cleanup(VALUE ptr) {
+    Stream *s = (Stream *)ptr;
+    if (!s->done)
+        db_postgres_adapter_discard(s->adapter);
+    return Qnil;
+}
+
+VALUE db_postgres_adapter_stream(int argc, VALUE *argv, VALUE self) {
+    Bind b;
+    int ok;
+    VALUE sql, bind;
+    Stream s;
+    Adapter *a = db_postgres_adapter_handle_safe(self);
+
+    rb_scan_args(argc, argv, "10*", &sql, &bind);
+    if (!rb_block_given_p())
+        rb_raise(eSwiftArgumentError, "#stream requires a block");
+
+    if (!a->native)
+        sql = db_postgres_adapter_normalized_sql(a, sql);
+
+    db_postgres_adapter_deferred_flush(a);
+    db_postgres_bind_encode(&b, a, bind, a->binary_params, 0);
+
+    ok = PQsendQueryParams(a->connection, RSTRING_PTR(sql), b.n_args, b.types,
+        (const char* const *)b.data, b.size, b.format, a->binary);
+
+    RB_GC_GUARD(b.values);
+    RB_GC_GUARD(bind);
+    db_postgres_bind_free(&b);
 
     if (!ok)
         rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(a->connection));
 
-    if (rb_block_given_p()) {
-        rb_thread_wait_fd(PQsocket(a->connection));
-        return db_postgres_result_each(db_postgres_adapter_result(self));
+    if (!db_postgres_adapter_single_row_mode(a)) {
+        db_postgres_adapter_drain(a);
+        rb_raise(eSwiftRuntimeError, "unable to switch to single row mode");
     }
-    else
-        return Qtrue;
+
+    s.adapter = a;
+    s.result  = Qnil;
+    s.done    = 0;
+    return rb_ensure(db_postgres_adapter_stream_rows, (VALUE)&s, db_postgres_adapter_stream_cleanup, (VALUE)&s);
+}
+
+VALUE db_postgres_adapter_copy_to_arrow(VALUE self, VALUE sql, VALUE io) {
+    Adapter *a = db_postgres_adapter_handle_safe(self);
+
+    if (!rb_respond_to(io, rb_intern("write")))
+        rb_raise(eSwiftArgumentError, "#copy_to_arrow needs an IO object that responds to #write");
+
+    return SIZET2NUM(db_postgres_arrow_write_copy(a, sql, io));
 }
 
 VALUE db_postgres_adapter_write(int argc, VALUE *argv, VALUE self) {
+    int fd;
+    size_t bytes = 0;
     char *sql;
     VALUE table, fields, io, data;
     PGresult *result;
@@ -558,42 +1595,45 @@ VALUE db_postgres_adapter_write(int argc, VALUE *argv, VALUE self) {
         else
             snprintf(sql, BUFFER_SIZE, "copy %s(%s) from stdin", CSTRING(table), CSTRING(rb_ary_join(fields, rb_str_new2(", "))));
 
-        result = PQexec(a->connection, sql);
+        result = db_postgres_adapter_exec_sql(a, sql);
         free(sql);
 
         db_postgres_check_result(result);
         PQclear(result);
     }
 
-    if (rb_respond_to(io, rb_intern("read"))) {
-        while (!NIL_P((data = rb_funcall(io, rb_intern("read"), 1, INT2NUM(BUFFER_SIZE))))) {
+    /* files, pipes and sockets are read straight from the descriptor without the GVL, fibers go through #read */
+    if (NIL_P(db_postgres_adapter_scheduler()) && (fd = db_postgres_copy_io_fd(io, 0)) >= 0) {
+        bytes = db_postgres_copy_write_fd(a, fd);
+    }
+    else if (rb_respond_to(io, rb_intern("read"))) {
+        while (!NIL_P((data = rb_funcall(io, rb_intern("read"), 1, INT2NUM(a->copy_buffer_size))))) {
             data = TO_S(data);
-            if (PQputCopyData(a->connection, RSTRING_PTR(data), RSTRING_LEN(data)) != 1)
-                rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(a->connection));
+            db_postgres_copy_put(a, RSTRING_PTR(data), RSTRING_LEN(data));
+            bytes += RSTRING_LEN(data);
         }
-        if (PQputCopyEnd(a->connection, 0) != 1)
-            rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(a->connection));
     }
     else {
         io = TO_S(io);
-        if (PQputCopyData(a->connection, RSTRING_PTR(io), RSTRING_LEN(io)) != 1)
-            rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(a->connection));
-        if (PQputCopyEnd(a->connection, 0) != 1)
-            rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(a->connection));
+        db_postgres_copy_put(a, RSTRING_PTR(io), RSTRING_LEN(io));
+        bytes = RSTRING_LEN(io);
     }
 
-    result = PQgetResult(a->connection);
+    db_postgres_copy_end(a);
+
+    result = db_postgres_adapter_next_result(a);
     db_postgres_check_result(result);
     if (!result)
         rb_raise(eSwiftRuntimeError, "invalid result at the end of COPY command");
-    return db_postgres_result_load(db_postgres_result_allocate(cDPR), result, a->decoder);
+    return db_postgres_result_copied(db_postgres_result_load(db_postgres_result_allocate(cDPR), result, a), bytes);
 }
 
 VALUE db_postgres_adapter_read(int argc, VALUE *argv, VALUE self) {
-    int n, done = 0;
+    int n, fd = -1, done = 0;
+    size_t bytes = 0;
     char *sql, *data;
     PGresult *result;
-    VALUE table, fields, io;
+    VALUE table, fields, io, chunk;
     Adapter *a = db_postgres_adapter_handle_safe(self);
 
     if (argc > 3)
@@ -639,65 +1679,124 @@ VALUE db_postgres_adapter_read(int argc, VALUE *argv, VALUE self) {
         else
             snprintf(sql, BUFFER_SIZE, "copy %s(%s) to stdout", CSTRING(table), CSTRING(rb_ary_join(fields, rb_str_new2(", "))));
 
-        result = PQexec(a->connection, sql);
+        result = db_postgres_adapter_exec_sql(a, sql);
         free(sql);
 
         db_postgres_check_result(result);
         PQclear(result);
     }
 
-    while (!done) {
-        switch ((n = PQgetCopyData(a->connection, &data, 0))) {
+    /* files, pipes and sockets get the copy data written straight to the descriptor without the GVL */
+    if (!NIL_P(io) && NIL_P(db_postgres_adapter_scheduler()) && (fd = db_postgres_copy_io_fd(io, 1)) >= 0)
+        bytes = db_postgres_copy_read_fd(a, fd);
+
+    while (fd < 0 && !done) {
+        switch ((n = PQgetCopyData(a->connection, &data, 1))) {
             case -1: done = 1; break;
             case -2: rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(a->connection));
+            case 0:
+                db_postgres_adapter_wait(a, RB_WAITFD_IN);
+                if (!PQconsumeInput(a->connection))
+                    rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(a->connection));
+                break;
             default:
-                if (n > 0) {
-                    if (NIL_P(io))
-                        rb_yield(rb_str_new(data, n));
-                    else
-                        rb_funcall(io, rb_intern("write"), 1, rb_str_new(data, n));
-                    PQfreemem(data);
-                }
+                chunk = rb_str_new(data, n);
+                PQfreemem(data);
+                bytes += n;
+                if (NIL_P(io))
+                    rb_yield(chunk);
+                else
+                    rb_funcall(io, rb_intern("write"), 1, chunk);
         }
     }
 
-    result = PQgetResult(a->connection);
+    result = db_postgres_adapter_next_result(a);
     db_postgres_check_result(result);
     if (!result)
         rb_raise(eSwiftRuntimeError, "invalid result at the end of COPY command");
-    return db_postgres_result_load(db_postgres_result_allocate(cDPR), result, a->decoder);
+    return db_postgres_result_copied(db_postgres_result_load(db_postgres_result_allocate(cDPR), result, a), bytes);
 }
 
-VALUE db_postgres_adapter_encoder_set(VALUE self, VALUE encoder) {
+VALUE db_postgres_adapter_write_rows(int argc, VALUE *argv, VALUE self) {
+    VALUE table, fields, rows, format;
     Adapter *a = db_postgres_adapter_handle_safe(self);
-    if (NIL_P(encoder)) {
-        if (a->encoder)
-            rb_gc_unregister_address(&a->encoder);
-        a->encoder = 0;
-    }
-    else {
-        a->encoder = encoder;
-        rb_gc_register_address(&encoder);
+
+    rb_scan_args(argc, argv, "31", &table, &fields, &rows, &format);
+
+    if (NIL_P(format) || format == ID2SYM(rb_intern("text")))
+        return db_postgres_copy_write_rows(a, table, fields, rows, 0);
+    if (format == ID2SYM(rb_intern("binary")))
+        return db_postgres_copy_write_rows(a, table, fields, rows, 1);
+
+    rb_raise(eSwiftArgumentError, "invalid copy format, expected :text or :binary");
+}
+
+VALUE db_postgres_adapter_read_rows(int argc, VALUE *argv, VALUE self) {
+    VALUE source, fields, options, format = Qnil, batch = Qnil;
+    Adapter *a = db_postgres_adapter_handle_safe(self);
+
+    RETURN_ENUMERATOR(self, argc, argv);
+    rb_scan_args(argc, argv, "11:", &source, &fields, &options);
+
+    if (!NIL_P(options)) {
+        format = rb_hash_aref(options, ID2SYM(rb_intern("format")));
+        batch  = rb_hash_aref(options, ID2SYM(rb_intern("batch")));
     }
+
+    if (!NIL_P(format) && format != ID2SYM(rb_intern("text")) && format != ID2SYM(rb_intern("binary")))
+        rb_raise(eSwiftArgumentError, "invalid copy format, expected :text or :binary");
+    if (!NIL_P(batch) && NUM2LONG(batch) < 1)
+        rb_raise(eSwiftArgumentError, "batch size needs to be a positive integer");
+
+    return db_postgres_copy_read_rows(a, source, fields, format == ID2SYM(rb_intern("binary")), NIL_P(batch) ? 0 : NUM2LONG(batch));
+}
+
+VALUE db_postgres_adapter_statement_cache_set(VALUE self, VALUE size) {
+    Adapter *a = db_postgres_adapter_handle_safe(self);
+    a->cache_size = NIL_P(size) ? 0 : NUM2INT(size);
+
+    /* evict everything when disabled, otherwise shrink on the next miss */
+    if (a->cache_size < 1)
+        db_postgres_cache_clear(a);
+    return size;
+}
+
+VALUE db_postgres_adapter_statement_cache_stats(VALUE self) {
+    Adapter *a = db_postgres_adapter_handle(self);
+    return db_postgres_cache_stats(a);
+}
+
+VALUE db_postgres_adapter_pipeline(VALUE self) {
+    return db_postgres_pipeline_run(self);
+}
+
+VALUE db_postgres_adapter_encoder_set(VALUE self, VALUE encoder) {
+    Adapter *a = db_postgres_adapter_handle_safe(self);
+    a->encoder = NIL_P(encoder) ? 0 : encoder;
     return Qtrue;
 }
 
 VALUE db_postgres_adapter_decoder_set(VALUE self, VALUE decoder) {
     Adapter *a = db_postgres_adapter_handle_safe(self);
-    if (NIL_P(decoder)) {
-        if (a->decoder)
-            rb_gc_unregister_address(&a->decoder);
-        a->decoder = 0;
-    }
-    else {
-        a->decoder = decoder;
-        rb_gc_register_address(&decoder);
-    }
+    a->decoder = NIL_P(decoder) ? 0 : decoder;
     return Qtrue;
 }
 
 VALUE db_postgres_adapter_typemap(VALUE self) {
-    return typecast_typemap();
+    Adapter *a = db_postgres_adapter_handle_safe(self);
+    return db_postgres_types_typemap(a->types);
+}
+
+VALUE db_postgres_adapter_register_type(VALUE self, VALUE type, VALUE decoder) {
+    Adapter *a = db_postgres_adapter_handle_safe(self);
+    db_postgres_types_register(a->types, type, decoder);
+    return self;
+}
+
+VALUE db_postgres_adapter_reload_types(VALUE self) {
+    Adapter *a = db_postgres_adapter_handle_safe(self);
+    a->types = db_postgres_types_load(a, 1, 1);
+    return self;
 }
 
 void init_swift_db_postgres_adapter() {
@@ -707,6 +1806,8 @@ void init_swift_db_postgres_adapter() {
 
     rb_define_alloc_func(cDPA, db_postgres_adapter_allocate);
 
+    rb_define_singleton_method(cDPA, "connect", db_postgres_adapter_s_connect, 2);
+
     rb_define_method(cDPA, "initialize",  db_postgres_adapter_initialize,   1);
     rb_define_method(cDPA, "execute",     db_postgres_adapter_execute,     -1);
     rb_define_method(cDPA, "prepare",     db_postgres_adapter_prepare,      1);
@@ -721,15 +1822,39 @@ void init_swift_db_postgres_adapter() {
     rb_define_method(cDPA, "fileno",      db_postgres_adapter_fileno,       0);
     rb_define_method(cDPA, "query",       db_postgres_adapter_query,       -1);
     rb_define_method(cDPA, "result",      db_postgres_adapter_result,       0);
+    rb_define_method(cDPA, "stream",      db_postgres_adapter_stream,      -1);
+    rb_define_method(cDPA, "pipeline",    db_postgres_adapter_pipeline,     0);
     rb_define_method(cDPA, "write",       db_postgres_adapter_write,       -1);
     rb_define_method(cDPA, "read",        db_postgres_adapter_read,        -1);
+    rb_define_method(cDPA, "write_rows",  db_postgres_adapter_write_rows,  -1);
+    rb_define_method(cDPA, "read_rows",   db_postgres_adapter_read_rows,   -1);
+
+    rb_define_method(cDPA, "copy_to_arrow", db_postgres_adapter_copy_to_arrow, 2);
 
     rb_define_method(cDPA, "encoder=",    db_postgres_adapter_encoder_set,  1);
     rb_define_method(cDPA, "decoder=",    db_postgres_adapter_decoder_set,  1);
-    rb_define_method(cDPA, "typemap",     db_postgres_adapter_typemap,      0);
+    rb_define_method(cDPA, "typemap",       db_postgres_adapter_typemap,       0);
+    rb_define_method(cDPA, "register_type", db_postgres_adapter_register_type, 2);
+    rb_define_method(cDPA, "reload_types",  db_postgres_adapter_reload_types,  0);
+
+    rb_define_method(cDPA, "statement_cache=",      db_postgres_adapter_statement_cache_set,   1);
+    rb_define_method(cDPA, "statement_cache_stats", db_postgres_adapter_statement_cache_stats, 0);
 
     rb_define_method(cDPA, "native_bind_format",  db_postgres_adapter_native,     0);
     rb_define_method(cDPA, "native_bind_format=", db_postgres_adapter_native_set, 1);
+    rb_define_method(cDPA, "binary_format",       db_postgres_adapter_binary,     0);
+    rb_define_method(cDPA, "binary_format=",      db_postgres_adapter_binary_set, 1);
+    rb_define_method(cDPA, "binary_params=",      db_postgres_adapter_binary_params_set, 1);
+    rb_define_method(cDPA, "timestamp_format",    db_postgres_adapter_timestamp_format,     0);
+    rb_define_method(cDPA, "timestamp_format=",   db_postgres_adapter_timestamp_format_set, 1);
+    rb_define_method(cDPA, "numeric_format",      db_postgres_adapter_numeric_format,       0);
+    rb_define_method(cDPA, "numeric_format=",     db_postgres_adapter_numeric_format_set,   1);
+    rb_define_method(cDPA, "bytea_format",        db_postgres_adapter_bytea_format,         0);
+    rb_define_method(cDPA, "bytea_format=",       db_postgres_adapter_bytea_format_set,     1);
+    rb_define_method(cDPA, "json_format",         db_postgres_adapter_json_format,          0);
+    rb_define_method(cDPA, "json_format=",        db_postgres_adapter_json_format_set,      1);
+    rb_define_method(cDPA, "max_result_size",     db_postgres_adapter_max_result_size,      0);
+    rb_define_method(cDPA, "max_result_size=",    db_postgres_adapter_max_result_size_set,  1);
 
 
     rb_global_variable(&sUser);
@@ -10,8 +10,51 @@ typedef struct Adapter {
     PGconn *connection;
     int t_nesting;
     int native;
+    int binary;
+    int binary_params;
+    int chunk_size;
+    int cache_size;
+    int copy_buffer_size;
+    size_t max_result_size;
+    int typecast;
+    size_t cache_hits, cache_misses, cache_evictions, cache_sequence;
+    VALUE cache;
+    /* names of evicted statements waiting for the connection to go idle before they are deallocated */
+    VALUE deallocate;
     VALUE encoder;
     VALUE decoder;
+    VALUE types;
+    /* IO wrapping the connection socket for the fiber scheduler */
+    VALUE io;
+    /* transaction control waiting for the next statement, t_begin is set while the BEGIN itself is queued */
+    VALUE deferred;
+    int t_begin;
+    /* pool the connection belongs to, if any */
+    VALUE pool;
+    int checked_out;
+    /* normalized sql keyed by source, oldest first, built under the standard_strings setting */
+    VALUE normalized;
+    int normalize_size;
+    int standard_strings;
+    /* bind parameter arena reused across queries and the coerced values it points into */
+    char *bind_arena;
+    size_t bind_arena_size;
+    int bind_encoding;
+    VALUE bind_values;
 } Adapter;
 
 void init_swift_db_postgres_adapter();
+
+DLL_PRIVATE Adapter*  db_postgres_adapter_handle(VALUE);
+DLL_PRIVATE Adapter*  db_postgres_adapter_handle_safe(VALUE);
+DLL_PRIVATE int       db_postgres_adapter_wait(Adapter *, int);
+DLL_PRIVATE VALUE     db_postgres_adapter_scheduler();
+DLL_PRIVATE PGresult* db_postgres_adapter_exec(Adapter *, Query *, int kind);
+DLL_PRIVATE PGresult* db_postgres_adapter_exec_sql(Adapter *, const char *);
+DLL_PRIVATE void      db_postgres_adapter_flush(Adapter *);
+DLL_PRIVATE void      db_postgres_adapter_deferred_flush(Adapter *);
+DLL_PRIVATE long      db_postgres_adapter_deferred_send(Adapter *);
+DLL_PRIVATE PGresult* db_postgres_adapter_next_result(Adapter *);
+DLL_PRIVATE void      db_postgres_adapter_drain(Adapter *);
+DLL_PRIVATE void      db_postgres_adapter_discard(Adapter *);
+DLL_PRIVATE VALUE     db_postgres_adapter_normalized_sql(Adapter *, VALUE);
@@ -0,0 +1,869 @@
+// vim:ts=4:sts=4:sw=4:expandtab
+
+// (c) Bharanee Rathna 2012
+
+#include "arrow.h"
+#include "bytea.h"
+#include "datetime.h"
+#include "typecast.h"
+
+#include <ruby/io.h>
+
+/*
+ * Arrow IPC stream writer, see https://arrow.apache.org/docs/format/Columnar.html#ipc-streaming-format
+ *
+ * Each message is a flatbuffer (Message.fbs, Schema.fbs) followed by the record batch body. The flatbuffers are
+ * written front to back, vtables precede their tables and objects always follow the offsets that refer to them.
+ */
+
+#define ARROW_BATCH_ROWS   (65536)
+#define ARROW_CONTINUATION (0xFFFFFFFF)
+#define ARROW_METADATA_V5  (4)
+
+/* Message.header union */
+#define ARROW_HEADER_SCHEMA       (1)
+#define ARROW_HEADER_RECORD_BATCH (3)
+
+/* Field.type union */
+#define ARROW_TYPE_INT       (2)
+#define ARROW_TYPE_FLOAT     (3)
+#define ARROW_TYPE_BINARY    (4)
+#define ARROW_TYPE_UTF8      (5)
+#define ARROW_TYPE_BOOL      (6)
+#define ARROW_TYPE_DATE      (8)
+#define ARROW_TYPE_TIMESTAMP (10)
+
+#define ARROW_BIT_SET(bits, n) ((bits)[(n) >> 3] |= (1 << ((n) & 7)))
+#define MIN(a, b) ((a) <= (b) ? (a) : (b))
+
+enum {
+    COLUMN_BOOL,
+    COLUMN_INT16,
+    COLUMN_INT32,
+    COLUMN_INT64,
+    COLUMN_FLOAT32,
+    COLUMN_FLOAT64,
+    COLUMN_DATE,
+    COLUMN_TIMESTAMP,
+    COLUMN_TIMESTAMPTZ,
+    COLUMN_BYTEA,
+    COLUMN_RAW,
+    COLUMN_TEXT,
+    COLUMN_NUMERIC,
+    COLUMN_UUID,
+    COLUMN_JSONB
+};
+
+typedef struct ArrowBuffer {
+    char *data;
+    size_t size;
+    size_t capacity;
+} ArrowBuffer;
+
+typedef struct ArrowColumn {
+    const char *name;
+    int kind;
+    int binary;
+} ArrowColumn;
+
+typedef struct ArrowWriter {
+    VALUE io;
+    int cols;
+    ArrowColumn *columns;
+    ArrowBuffer meta;
+    ArrowBuffer body;
+    int64_t *nodes;
+    int64_t *buffers;
+    int n_buffers;
+    size_t rows;
+} ArrowWriter;
+
+typedef struct FlatField {
+    int size;
+    uint64_t value;
+    size_t slot;
+} FlatField;
+
+/* returns NULL for a null value */
+typedef const char* (*arrow_cell)(void *, int row, int col, int *size);
+
+/* definition */
+
+static void put_le16(char *data, uint16_t value) {
+    unsigned char *p = (unsigned char *)data;
+    p[0] = value;
+    p[1] = value >> 8;
+}
+
+static void put_le32(char *data, uint32_t value) {
+    unsigned char *p = (unsigned char *)data;
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static void put_le64(char *data, uint64_t value) {
+    put_le32(data, (uint32_t)value);
+    put_le32(data + 4, (uint32_t)(value >> 32));
+}
+
+/* appends size zeroed bytes and returns their offset */
+static size_t buffer_reserve(ArrowBuffer *b, size_t size) {
+    char *data;
+    size_t offset = b->size, capacity = b->capacity ? b->capacity : 4096;
+
+    if (offset + size > b->capacity) {
+        while (capacity < offset + size)
+            capacity *= 2;
+        if (!(data = (char *)realloc(b->data, capacity)))
+            rb_raise(rb_eNoMemError, "arrow buffer");
+        b->data     = data;
+        b->capacity = capacity;
+    }
+
+    memset(b->data + offset, 0, size);
+    b->size += size;
+    return offset;
+}
+
+static size_t buffer_put(ArrowBuffer *b, const void *data, size_t size) {
+    size_t offset = buffer_reserve(b, size);
+    memcpy(b->data + offset, data, size);
+    return offset;
+}
+
+static void buffer_align(ArrowBuffer *b, size_t align) {
+    if (b->size % align)
+        buffer_reserve(b, align - b->size % align);
+}
+
+/* uoffset from slot to target, flatbuffer offsets always point forward */
+static void flat_patch(ArrowBuffer *b, size_t slot, size_t target) {
+    put_le32(b->data + slot, (uint32_t)(target - slot));
+}
+
+/* vtable followed by the table, FlatField#slot is set to the position of each field so offsets can be patched */
+static size_t flat_table(ArrowBuffer *b, FlatField *fields, int n) {
+    int i;
+    uint16_t offset[8];
+    size_t vtable, table, align = 4, cursor = 4;
+
+    for (i = 0; i < n; i++) {
+        if (fields[i].size > (int)align)
+            align = fields[i].size;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (!fields[i].size) {
+            offset[i] = 0;
+            continue;
+        }
+        cursor    = (cursor + fields[i].size - 1) / fields[i].size * fields[i].size;
+        offset[i] = cursor;
+        cursor   += fields[i].size;
+    }
+
+    buffer_align(b, 2);
+    vtable = buffer_reserve(b, 4 + 2 * n);
+    buffer_align(b, align);
+    table  = buffer_reserve(b, cursor);
+
+    put_le16(b->data + vtable,     4 + 2 * n);
+    put_le16(b->data + vtable + 2, cursor);
+    put_le32(b->data + table, (uint32_t)(table - vtable));
+
+    for (i = 0; i < n; i++) {
+        put_le16(b->data + vtable + 4 + 2 * i, offset[i]);
+        if (!fields[i].size)
+            continue;
+
+        fields[i].slot = table + offset[i];
+        switch (fields[i].size) {
+            case 1: b->data[fields[i].slot] = (char)fields[i].value; break;
+            case 2: put_le16(b->data + fields[i].slot, fields[i].value); break;
+            case 4: put_le32(b->data + fields[i].slot, fields[i].value); break;
+            case 8: put_le64(b->data + fields[i].slot, fields[i].value); break;
+        }
+    }
+
+    return table;
+}
+
+/* returns the position of the first element, the length prefix sits right before it */
+static size_t flat_vector(ArrowBuffer *b, size_t count, size_t width, size_t align) {
+    size_t length;
+
+    while ((b->size + 4) % align)
+        buffer_reserve(b, 1);
+
+    length = buffer_reserve(b, 4 + count * width);
+    put_le32(b->data + length, count);
+    return length + 4;
+}
+
+static size_t flat_string(ArrowBuffer *b, const char *data, size_t size) {
+    size_t length;
+
+    buffer_align(b, 4);
+    length = buffer_reserve(b, 4 + size + 1);
+    put_le32(b->data + length, size);
+    memcpy(b->data + length + 4, data, size);
+    return length;
+}
+
+static int arrow_column_kind(Oid oid, int binary) {
+    switch (oid) {
+        case 16:   return COLUMN_BOOL;
+        case 17:   return COLUMN_BYTEA;
+        case 20:   return COLUMN_INT64;
+        case 21:   return COLUMN_INT16;
+        case 23:   return COLUMN_INT32;
+        case 700:  return COLUMN_FLOAT32;
+        case 701:  return COLUMN_FLOAT64;
+        case 1082: return COLUMN_DATE;
+        case 1114: return COLUMN_TIMESTAMP;
+        case 1184: return COLUMN_TIMESTAMPTZ;
+    }
+
+    if (!binary)
+        return COLUMN_TEXT;
+
+    switch (oid) {
+        /* char, name, text, json, xml, unknown, bpchar and varchar are sent as plain text */
+        case 18: case 19: case 25: case 114: case 142: case 705: case 1042: case 1043:
+            return COLUMN_TEXT;
+        case 1700: return COLUMN_NUMERIC;
+        case 2950: return COLUMN_UUID;
+        case 3802: return COLUMN_JSONB;
+    }
+
+    /* anything else is passed through as the postgres wire format */
+    return COLUMN_RAW;
+}
+
+static int arrow_column_width(int kind) {
+    switch (kind) {
+        case COLUMN_INT16:       return 2;
+        case COLUMN_INT32:       return 4;
+        case COLUMN_FLOAT32:     return 4;
+        case COLUMN_DATE:        return 4;
+        case COLUMN_INT64:       return 8;
+        case COLUMN_FLOAT64:     return 8;
+        case COLUMN_TIMESTAMP:   return 8;
+        case COLUMN_TIMESTAMPTZ: return 8;
+        default:                 return 0;
+    }
+}
+
+static int arrow_type_tag(int kind) {
+    switch (kind) {
+        case COLUMN_BOOL:        return ARROW_TYPE_BOOL;
+        case COLUMN_INT16:
+        case COLUMN_INT32:
+        case COLUMN_INT64:       return ARROW_TYPE_INT;
+        case COLUMN_FLOAT32:
+        case COLUMN_FLOAT64:     return ARROW_TYPE_FLOAT;
+        case COLUMN_DATE:        return ARROW_TYPE_DATE;
+        case COLUMN_TIMESTAMP:
+        case COLUMN_TIMESTAMPTZ: return ARROW_TYPE_TIMESTAMP;
+        case COLUMN_BYTEA:
+        case COLUMN_RAW:         return ARROW_TYPE_BINARY;
+        default:                 return ARROW_TYPE_UTF8;
+    }
+}
+
+static size_t arrow_type_table(ArrowBuffer *b, int kind) {
+    size_t table;
+    FlatField type[2] = {{0, 0, 0}, {0, 0, 0}};
+
+    switch (kind) {
+        /* Int { bitWidth: int, is_signed: bool } */
+        case COLUMN_INT16:
+        case COLUMN_INT32:
+        case COLUMN_INT64:
+            type[0].size  = 4;
+            type[0].value = arrow_column_width(kind) * 8;
+            type[1].size  = 1;
+            type[1].value = 1;
+            return flat_table(b, type, 2);
+        /* FloatingPoint { precision: SINGLE = 1, DOUBLE = 2 } */
+        case COLUMN_FLOAT32:
+        case COLUMN_FLOAT64:
+            type[0].size  = 2;
+            type[0].value = kind == COLUMN_FLOAT32 ? 1 : 2;
+            return flat_table(b, type, 1);
+        /* Date { unit: DAY = 0 } */
+        case COLUMN_DATE:
+            type[0].size  = 2;
+            type[0].value = 0;
+            return flat_table(b, type, 1);
+        /* Timestamp { unit: MICROSECOND = 2, timezone: string } */
+        case COLUMN_TIMESTAMP:
+        case COLUMN_TIMESTAMPTZ:
+            type[0].size  = 2;
+            type[0].value = 2;
+            type[1].size  = kind == COLUMN_TIMESTAMPTZ ? 4 : 0;
+            table = flat_table(b, type, 2);
+            if (kind == COLUMN_TIMESTAMPTZ)
+                flat_patch(b, type[1].slot, flat_string(b, "UTC", 3));
+            return table;
+        /* Bool, Binary and Utf8 have no fields */
+        default:
+            return flat_table(b, type, 0);
+    }
+}
+
+static void arrow_emit(ArrowWriter *w) {
+    VALUE data;
+    char prefix[8];
+
+    buffer_align(&w->meta, 8);
+    put_le32(prefix, ARROW_CONTINUATION);
+    put_le32(prefix + 4, w->meta.size);
+
+    data = rb_str_buf_new(sizeof(prefix) + w->meta.size + w->body.size);
+    rb_str_cat(data, prefix, sizeof(prefix));
+    rb_str_cat(data, w->meta.data, w->meta.size);
+    if (w->body.size)
+        rb_str_cat(data, w->body.data, w->body.size);
+
+    rb_funcall(w->io, rb_intern("write"), 1, data);
+}
+
+static void arrow_write_eos(ArrowWriter *w) {
+    char eos[8];
+    put_le32(eos, ARROW_CONTINUATION);
+    put_le32(eos + 4, 0);
+    rb_funcall(w->io, rb_intern("write"), 1, rb_str_new(eos, sizeof(eos)));
+}
+
+/* Message { version, header: Schema { endianness, fields: [Field { name, nullable, type, children }] } } */
+static void arrow_write_schema(ArrowWriter *w) {
+    int col;
+    size_t root, fields;
+    ArrowBuffer *b = &w->meta;
+    FlatField message[4] = {{2, ARROW_METADATA_V5, 0}, {1, ARROW_HEADER_SCHEMA, 0}, {4, 0, 0}, {8, 0, 0}};
+    FlatField schema[2]  = {{2, 0, 0}, {4, 0, 0}};
+
+    b->size = 0;
+    root    = buffer_reserve(b, 4);
+    flat_patch(b, root, flat_table(b, message, 4));
+    flat_patch(b, message[2].slot, flat_table(b, schema, 2));
+
+    fields = flat_vector(b, w->cols, 4, 4);
+    flat_patch(b, schema[1].slot, fields - 4);
+
+    for (col = 0; col < w->cols; col++) {
+        ArrowColumn *c = w->columns + col;
+        FlatField field[6] = {{4, 0, 0}, {1, 1, 0}, {1, arrow_type_tag(c->kind), 0}, {4, 0, 0}, {0, 0, 0}, {4, 0, 0}};
+
+        flat_patch(b, fields + col * 4, flat_table(b, field, 6));
+        flat_patch(b, field[0].slot, flat_string(b, c->name, strlen(c->name)));
+        flat_patch(b, field[3].slot, arrow_type_table(b, c->kind));
+        flat_patch(b, field[5].slot, flat_vector(b, 0, 4, 4) - 4);
+    }
+
+    w->body.size = 0;
+    arrow_emit(w);
+}
+
+/* Message { version, header: RecordBatch { length, nodes: [FieldNode], buffers: [Buffer] }, bodyLength } */
+static void arrow_write_record_batch(ArrowWriter *w, int rows) {
+    int n;
+    size_t root, vector;
+    ArrowBuffer *b = &w->meta;
+    FlatField message[4] = {{2, ARROW_METADATA_V5, 0}, {1, ARROW_HEADER_RECORD_BATCH, 0}, {4, 0, 0}, {8, w->body.size, 0}};
+    FlatField batch[3]   = {{8, rows, 0}, {4, 0, 0}, {4, 0, 0}};
+
+    b->size = 0;
+    root    = buffer_reserve(b, 4);
+    flat_patch(b, root, flat_table(b, message, 4));
+    flat_patch(b, message[2].slot, flat_table(b, batch, 3));
+
+    vector = flat_vector(b, w->cols, 16, 8);
+    flat_patch(b, batch[1].slot, vector - 4);
+    for (n = 0; n < w->cols * 2; n++)
+        put_le64(b->data + vector + n * 8, w->nodes[n]);
+
+    vector = flat_vector(b, w->n_buffers, 16, 8);
+    flat_patch(b, batch[2].slot, vector - 4);
+    for (n = 0; n < w->n_buffers * 2; n++)
+        put_le64(b->data + vector + n * 8, w->buffers[n]);
+
+    arrow_emit(w);
+}
+
+/* body buffers start on 8 byte boundaries */
+static size_t arrow_body_buffer(ArrowWriter *w, size_t size) {
+    size_t offset = buffer_reserve(&w->body, size);
+
+    w->buffers[w->n_buffers * 2]     = offset;
+    w->buffers[w->n_buffers * 2 + 1] = size;
+    w->n_buffers++;
+
+    buffer_align(&w->body, 8);
+    return offset;
+}
+
+static int arrow_fixed_value(ArrowColumn *c, const char *data, int size, char *value) {
+    char *end;
+    int64_t number;
+    union { float f; uint32_t i; } f4;
+    union { double f; uint64_t i; } f8;
+
+    if (c->binary) {
+        if (size != arrow_column_width(c->kind))
+            return 0;
+
+        switch (c->kind) {
+            case COLUMN_INT16:
+                put_le16(value, read_uint16(data));
+                return 1;
+            case COLUMN_INT32:
+            case COLUMN_FLOAT32:
+                put_le32(value, read_uint32(data));
+                return 1;
+            case COLUMN_INT64:
+            case COLUMN_FLOAT64:
+                put_le64(value, read_uint64(data));
+                return 1;
+            case COLUMN_DATE:
+                number = (int32_t)read_uint32(data);
+                if (number == INT32_MAX || number == INT32_MIN || number + POSTGRES_EPOCH_DAYS > INT32_MAX)
+                    return 0;
+                put_le32(value, (uint32_t)(number + POSTGRES_EPOCH_DAYS));
+                return 1;
+            case COLUMN_TIMESTAMP:
+            case COLUMN_TIMESTAMPTZ:
+                number = (int64_t)read_uint64(data);
+                if (number == INT64_MAX || number == INT64_MIN)
+                    return 0;
+                put_le64(value, (uint64_t)(number + POSTGRES_EPOCH_USEC));
+                return 1;
+        }
+        return 0;
+    }
+
+    switch (c->kind) {
+        case COLUMN_INT16:
+        case COLUMN_INT32:
+        case COLUMN_INT64:
+            number = strtoll(data, &end, 10);
+            if (end == data)
+                return 0;
+            if (c->kind == COLUMN_INT16)
+                put_le16(value, (uint16_t)number);
+            else if (c->kind == COLUMN_INT32)
+                put_le32(value, (uint32_t)number);
+            else
+                put_le64(value, (uint64_t)number);
+            return 1;
+        case COLUMN_FLOAT32:
+            f4.f = strtof(data, &end);
+            put_le32(value, f4.i);
+            return end != data;
+        case COLUMN_FLOAT64:
+            f8.f = strtod(data, &end);
+            put_le64(value, f8.i);
+            return end != data;
+        case COLUMN_DATE:
+            if (!datetime_parse_usec(data, size, &number, 0))
+                return 0;
+            put_le32(value, (uint32_t)(number / DAY_USEC - (number % DAY_USEC < 0)));
+            return 1;
+        case COLUMN_TIMESTAMP:
+        case COLUMN_TIMESTAMPTZ:
+            if (!datetime_parse_usec(data, size, &number, 0))
+                return 0;
+            put_le64(value, (uint64_t)number);
+            return 1;
+    }
+    return 0;
+}
+
+/* appends a variable width value to the body, returns 0 if it should be null instead */
+static int arrow_variable_value(ArrowWriter *w, ArrowColumn *c, const char *data, int size) {
+    size_t offset, length;
+    unsigned char *bytea;
+    ArrowBuffer *b = &w->body;
+
+    switch (c->kind) {
+        case COLUMN_BYTEA:
+            if (c->binary)
+                break;
+            if (size >= 2 && data[0] == '\\' && data[1] == 'x') {
+                offset = buffer_reserve(b, (size - 2) / 2);
+                if (bytea_hex_decode(data + 2, size - 2, b->data + offset))
+                    return 1;
+                b->size = offset;
+                return 0;
+            }
+            /* legacy escape format */
+            if (!(bytea = PQunescapeBytea((const unsigned char *)data, &length)))
+                return 0;
+            buffer_put(b, bytea, length);
+            PQfreemem(bytea);
+            return 1;
+        case COLUMN_NUMERIC:
+            if (!(length = typecast_binary_numeric_size(data, size)))
+                return 0;
+            offset  = buffer_reserve(b, length);
+            b->size = offset + typecast_binary_numeric_text(data, size, b->data + offset);
+            return 1;
+        case COLUMN_UUID:
+            if (size != 16)
+                return 0;
+            offset = buffer_reserve(b, 36);
+            typecast_binary_uuid_text(data, b->data + offset);
+            return 1;
+        case COLUMN_JSONB:
+            /* version byte followed by the json text */
+            if (size < 1 || data[0] != 1)
+                return 0;
+            data++;
+            size--;
+            break;
+    }
+
+    buffer_put(b, data, size);
+    return 1;
+}
+
+static void arrow_write_column(ArrowWriter *w, int col, arrow_cell cell, void *source, int rows) {
+    const char *data;
+    int row, size, width, nulls = 0;
+    size_t validity, values, offsets, start;
+    ArrowColumn *c = w->columns + col;
+    ArrowBuffer *b = &w->body;
+
+    validity = arrow_body_buffer(w, (rows + 7) / 8);
+
+    if (c->kind == COLUMN_BOOL) {
+        values = arrow_body_buffer(w, (rows + 7) / 8);
+        for (row = 0; row < rows; row++) {
+            if (!(data = cell(source, row, col, &size))) {
+                nulls++;
+                continue;
+            }
+            ARROW_BIT_SET((unsigned char *)b->data + validity, row);
+            if (size > 0 && (c->binary ? data[0] != 0 : data[0] == 't'))
+                ARROW_BIT_SET((unsigned char *)b->data + values, row);
+        }
+    }
+    else if ((width = arrow_column_width(c->kind))) {
+        values = arrow_body_buffer(w, (size_t)rows * width);
+        for (row = 0; row < rows; row++) {
+            if (!(data = cell(source, row, col, &size)) || !arrow_fixed_value(c, data, size, b->data + values + (size_t)row * width)) {
+                nulls++;
+                continue;
+            }
+            ARROW_BIT_SET((unsigned char *)b->data + validity, row);
+        }
+    }
+    else {
+        /* offsets followed by the data buffer which grows as values are appended */
+        offsets = arrow_body_buffer(w, (size_t)(rows + 1) * 4);
+        start   = b->size;
+        for (row = 0; row < rows; row++) {
+            if ((data = cell(source, row, col, &size)) && arrow_variable_value(w, c, data, size))
+                ARROW_BIT_SET((unsigned char *)b->data + validity, row);
+            else
+                nulls++;
+
+            if (b->size - start > INT32_MAX)
+                rb_raise(eSwiftRuntimeError, "arrow column %s exceeds 2GB in a single batch", c->name);
+            put_le32(b->data + offsets + (size_t)(row + 1) * 4, (uint32_t)(b->size - start));
+        }
+
+        w->buffers[w->n_buffers * 2]     = start;
+        w->buffers[w->n_buffers * 2 + 1] = b->size - start;
+        w->n_buffers++;
+        buffer_align(b, 8);
+    }
+
+    w->nodes[col * 2]     = rows;
+    w->nodes[col * 2 + 1] = nulls;
+}
+
+static void arrow_write_batch(ArrowWriter *w, arrow_cell cell, void *source, int rows) {
+    int col;
+
+    w->body.size = 0;
+    w->n_buffers = 0;
+    for (col = 0; col < w->cols; col++)
+        arrow_write_column(w, col, cell, source, rows);
+
+    arrow_write_record_batch(w, rows);
+    w->rows += rows;
+}
+
+static void arrow_writer_alloc(ArrowWriter *w, int cols) {
+    w->cols    = cols;
+    w->columns = (ArrowColumn *)calloc(cols + 1, sizeof(ArrowColumn));
+    w->nodes   = (int64_t *)calloc(cols * 2 + 1, sizeof(int64_t));
+    w->buffers = (int64_t *)calloc(cols * 6 + 1, sizeof(int64_t));
+
+    if (!w->columns || !w->nodes || !w->buffers)
+        rb_raise(rb_eNoMemError, "arrow writer");
+}
+
+static void arrow_writer_free(ArrowWriter *w) {
+    free(w->columns);
+    free(w->nodes);
+    free(w->buffers);
+    free(w->meta.data);
+    free(w->body.data);
+}
+
+/* Result#to_arrow */
+
+typedef struct ArrowResult {
+    ArrowWriter writer;
+    PGresult *result;
+    int offset;
+} ArrowResult;
+
+static const char* arrow_result_cell(void *source, int row, int col, int *size) {
+    ArrowResult *r = (ArrowResult *)source;
+
+    row += r->offset;
+    if (PQgetisnull(r->result, row, col))
+        return NULL;
+
+    *size = PQgetlength(r->result, row, col);
+    return PQgetvalue(r->result, row, col);
+}
+
+static VALUE arrow_result_write(VALUE ptr) {
+    int col, rows;
+    ArrowResult *r = (ArrowResult *)ptr;
+    ArrowWriter *w = &r->writer;
+
+    arrow_writer_alloc(w, PQnfields(r->result));
+    for (col = 0; col < w->cols; col++) {
+        w->columns[col].name   = PQfname(r->result, col);
+        w->columns[col].binary = PQfformat(r->result, col);
+        w->columns[col].kind   = arrow_column_kind(PQftype(r->result, col), w->columns[col].binary);
+    }
+
+    arrow_write_schema(w);
+
+    rows = PQntuples(r->result);
+    for (r->offset = 0; r->offset < rows; r->offset += ARROW_BATCH_ROWS)
+        arrow_write_batch(w, arrow_result_cell, r, MIN(ARROW_BATCH_ROWS, rows - r->offset));
+
+    arrow_write_eos(w);
+    return Qnil;
+}
+
+static VALUE arrow_result_cleanup(VALUE ptr) {
+    arrow_writer_free(&((ArrowResult *)ptr)->writer);
+    return Qnil;
+}
+
+size_t db_postgres_arrow_write_result(PGresult *result, VALUE io) {
+    ArrowResult r;
+
+    memset(&r, 0, sizeof(r));
+    r.writer.io = io;
+    r.result    = result;
+
+    rb_ensure(arrow_result_write, (VALUE)&r, arrow_result_cleanup, (VALUE)&r);
+    return r.writer.rows;
+}
+
+/* Adapter#copy_to_arrow */
+
+typedef struct ArrowCell {
+    const char *data;
+    int size;
+} ArrowCell;
+
+typedef struct ArrowCopy {
+    ArrowWriter writer;
+    Adapter *adapter;
+    VALUE sql;
+    PGresult *describe;
+    char **messages;
+    ArrowCell *cells;
+    int n_messages;
+    int rows;
+    int limit;
+    int header;
+    int copying;
+} ArrowCopy;
+
+static const char* arrow_copy_cell(void *source, int row, int col, int *size) {
+    ArrowCopy *c   = (ArrowCopy *)source;
+    ArrowCell *rec = c->cells + (size_t)row * c->writer.cols + col;
+
+    *size = rec->size;
+    return rec->data;
+}
+
+static void arrow_copy_flush(ArrowCopy *c) {
+    if (c->rows)
+        arrow_write_batch(&c->writer, arrow_copy_cell, c, c->rows);
+
+    while (c->n_messages > 0)
+        PQfreemem(c->messages[--c->n_messages]);
+    c->rows = 0;
+}
+
+/* the server sends one tuple per message, the file header is sent along with the first one */
+static void arrow_copy_message(ArrowCopy *c, const char *data, int size) {
+    int col;
+    int32_t length;
+    const char *ptr = data, *end = data + size;
+    ArrowCell *cells = c->cells + (size_t)c->rows * c->writer.cols;
+
+    if (!c->header) {
+        if (size < 19 || memcmp(ptr, "PGCOPY\n\377\r\n\0", 11) != 0)
+            rb_raise(eSwiftRuntimeError, "invalid binary copy header");
+        ptr += 19 + read_uint32(ptr + 15);
+        c->header = 1;
+        if (ptr >= end)
+            return;
+    }
+
+    if (end - ptr < 2)
+        rb_raise(eSwiftRuntimeError, "truncated binary copy tuple");
+
+    /* -1 marks the trailer */
+    if ((int16_t)read_uint16(ptr) == -1)
+        return;
+    if ((int16_t)read_uint16(ptr) != c->writer.cols)
+        rb_raise(eSwiftRuntimeError, "binary copy tuple has %d fields, expected %d", (int16_t)read_uint16(ptr), c->writer.cols);
+
+    for (ptr += 2, col = 0; col < c->writer.cols; col++) {
+        if (end - ptr < 4)
+            rb_raise(eSwiftRuntimeError, "truncated binary copy tuple");
+        length = (int32_t)read_uint32(ptr);
+        ptr   += 4;
+
+        if (length < 0) {
+            cells[col].data = NULL;
+            cells[col].size = 0;
+            continue;
+        }
+        if (end - ptr < length)
+            rb_raise(eSwiftRuntimeError, "truncated binary copy tuple");
+
+        cells[col].data = ptr;
+        cells[col].size = length;
+        ptr += length;
+    }
+
+    if (++c->rows == c->limit)
+        arrow_copy_flush(c);
+}
+
+static VALUE arrow_copy_write(VALUE ptr) {
+    int col, n;
+    char *data;
+    VALUE sql, error = Qnil;
+    PGresult *result;
+    ArrowCopy *c   = (ArrowCopy *)ptr;
+    ArrowWriter *w = &c->writer;
+    PGconn *connection = c->adapter->connection;
+
+    Query q = {.connection = connection, .command = CSTRING(c->sql), .name = ""};
+
+    /* the unnamed statement gives us field names and types without running the query */
+    result = db_postgres_adapter_exec(c->adapter, &q, QUERY_PREPARE);
+    db_postgres_check_result(result);
+    PQclear(result);
+
+    q.command = "";
+    result    = db_postgres_adapter_exec(c->adapter, &q, QUERY_DESCRIBE);
+    db_postgres_check_result(result);
+    c->describe = result;
+
+    arrow_writer_alloc(w, PQnfields(c->describe));
+    for (col = 0; col < w->cols; col++) {
+        w->columns[col].name   = PQfname(c->describe, col);
+        w->columns[col].binary = 1;
+        w->columns[col].kind   = arrow_column_kind(PQftype(c->describe, col), 1);
+    }
+
+    c->limit    = c->adapter->chunk_size > 0 ? c->adapter->chunk_size : 1000;
+    c->messages = (char **)malloc(sizeof(char *) * (c->limit + 1));
+    c->cells    = (ArrowCell *)malloc(sizeof(ArrowCell) * ((size_t)c->limit * w->cols + 1));
+    if (!c->messages || !c->cells)
+        rb_raise(rb_eNoMemError, "arrow copy");
+
+    sql = rb_str_new2("copy (");
+    rb_str_append(sql, TO_S(c->sql));
+    rb_str_cat2(sql, ") to stdout with (format binary)");
+
+    result = db_postgres_adapter_exec_sql(c->adapter, RSTRING_PTR(sql));
+    db_postgres_check_result(result);
+    PQclear(result);
+
+    c->copying = 1;
+    arrow_write_schema(w);
+
+    while (c->copying) {
+        switch ((n = PQgetCopyData(connection, &data, 1))) {
+            case -1:
+                c->copying = 0;
+                break;
+            case -2:
+                rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(connection));
+            case 0:
+                db_postgres_adapter_wait(c->adapter, RB_WAITFD_IN);
+                if (!PQconsumeInput(connection))
+                    rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(connection));
+                break;
+            default:
+                c->messages[c->n_messages++] = data;
+                arrow_copy_message(c, data, n);
+        }
+    }
+
+    arrow_copy_flush(c);
+
+    while ((result = db_postgres_adapter_next_result(c->adapter))) {
+        if (NIL_P(error))
+            error = db_postgres_result_error(result);
+        PQclear(result);
+    }
+
+    if (!NIL_P(error))
+        rb_exc_raise(error);
+
+    arrow_write_eos(w);
+    return Qnil;
+}
+
+/* io#write may raise half way through, the rest of the copy needs to be discarded. */
+static VALUE arrow_copy_cleanup(VALUE ptr) {
+    ArrowCopy *c = (ArrowCopy *)ptr;
+
+    if (c->copying)
+        db_postgres_adapter_discard(c->adapter);
+
+    while (c->n_messages > 0)
+        PQfreemem(c->messages[--c->n_messages]);
+
+    if (c->describe)
+        PQclear(c->describe);
+
+    free(c->messages);
+    free(c->cells);
+    arrow_writer_free(&c->writer);
+    return Qnil;
+}
+
+size_t db_postgres_arrow_write_copy(Adapter *a, VALUE sql, VALUE io) {
+    ArrowCopy c;
+
+    memset(&c, 0, sizeof(c));
+    c.writer.io = io;
+    c.adapter   = a;
+    c.sql       = sql;
+
+    rb_ensure(arrow_copy_write, (VALUE)&c, arrow_copy_cleanup, (VALUE)&c);
+    return c.writer.rows;
+}
@@ -0,0 +1,11 @@
+// vim:ts=4:sts=4:sw=4:expandtab
+
+// (c) Bharanee Rathna 2012
+
+#pragma once
+
+#include "common.h"
+#include "adapter.h"
+
+DLL_PRIVATE size_t db_postgres_arrow_write_result(PGresult *, VALUE io);
+DLL_PRIVATE size_t db_postgres_arrow_write_copy(Adapter *, VALUE sql, VALUE io);
@@ -0,0 +1,148 @@
+// vim:ts=4:sts=4:sw=4:expandtab
+
+// (c) Bharanee Rathna 2012
+
+#include "bind.h"
+#include "typecast.h"
+
+#define BIND_ARG_SIZE (sizeof(char *) + sizeof(int) * 2 + sizeof(Oid) + TYPECAST_SCALAR_SIZE)
+
+typedef struct BindEncode {
+    Bind *bind;
+    Adapter *adapter;
+    VALUE bind_values;
+    int binary;
+    const Oid *targets;
+} BindEncode;
+
+/*
+ * The connection keeps one growable arena for the parameter arrays and native scalars and reuses it for every query.
+ * It only has to live until the query is sent and a connection sends one query at a time, so it is never freed
+ * between queries. An encoder proc that runs a query of its own while the arena is being filled gets a scratch buffer.
+ */
+static char* db_postgres_bind_reserve(Adapter *a, Bind *b, int nested) {
+    char *arena;
+    VALUE scratch;
+    size_t size = BIND_ARG_SIZE * b->n_args;
+
+    /* wrapped so the GC frees it with the values even if the query raises */
+    if (nested) {
+        if (!(arena = (char *)malloc(size)))
+            rb_raise(rb_eNoMemError, "bind args");
+        scratch = Data_Wrap_Struct(rb_cObject, 0, free, arena);
+        rb_ary_push(b->values, scratch);
+        return arena;
+    }
+
+    if (a->bind_arena_size < size) {
+        if (size < a->bind_arena_size * 2)
+            size = a->bind_arena_size * 2;
+        if (!(arena = (char *)realloc(a->bind_arena, size)))
+            rb_raise(rb_eNoMemError, "bind args");
+
+        a->bind_arena      = arena;
+        a->bind_arena_size = size;
+    }
+
+    return a->bind_arena;
+}
+
+static VALUE db_postgres_bind_encode_values(VALUE ptr) {
+    int n, length;
+    char *scalar;
+    VALUE data, coerced;
+    BindEncode *e = (BindEncode *)ptr;
+    Bind *b = e->bind;
+    Adapter *a = e->adapter;
+
+    for (n = 0; n < b->n_args; n++) {
+        data   = rb_ary_entry(e->bind_values, n);
+        scalar = b->scalars + n * TYPECAST_SCALAR_SIZE;
+
+        b->size[n]   = 0;
+        b->data[n]   = 0;
+        b->format[n] = 0;
+        b->types[n]  = 0;
+
+        if (NIL_P(data))
+            continue;
+
+        if (e->binary) {
+            Oid oid = e->targets ? e->targets[n] : typecast_encode_oid(data);
+            if (oid && (length = typecast_encode_binary(data, oid, scalar)) >= 0) {
+                b->size[n]   = length;
+                b->data[n]   = scalar;
+                b->format[n] = 1;
+                b->types[n]  = oid;
+                continue;
+            }
+        }
+
+        if ((length = typecast_encode_text(data, scalar)) >= 0) {
+            b->size[n] = length;
+            b->data[n] = scalar;
+            continue;
+        }
+
+        if (rb_obj_is_kind_of(data, rb_cIO) || rb_obj_is_kind_of(data, cStringIO))
+            b->format[n] = 1;
+
+        coerced = typecast_encode(data);
+        if (NIL_P(coerced) && a->encoder)
+            coerced = rb_funcall(a->encoder, rb_intern("call"), 1, data);
+        if (NIL_P(coerced))
+            coerced = typecast_to_str(data);
+
+        rb_ary_push(b->values, coerced);
+        b->size[n] = RSTRING_LEN(coerced);
+        b->data[n] = RSTRING_PTR(coerced);
+    }
+
+    return Qnil;
+}
+
+/*
+ * Encodes bind values for PQexecParams and friends. Native scalars are written straight into the connection arena,
+ * everything else is coerced into a String that is held in b->values until the query is sent.
+ *
+ * With binary enabled, values are sent in binary format when the target type is known (prepared statements)
+ * or implied by the value class, and in text format otherwise.
+ */
+void db_postgres_bind_encode(Bind *b, Adapter *a, VALUE bind, int binary, const Oid *targets) {
+    int state = 0, nested = a->bind_encoding > 0;
+    BindEncode e = {b, a, bind, binary, targets};
+
+    memset(b, 0, sizeof(Bind));
+    b->n_args = RARRAY_LEN(bind);
+
+    if (!a->bind_values)
+        a->bind_values = rb_ary_new();
+
+    b->values = nested ? rb_ary_new() : a->bind_values;
+    rb_ary_clear(b->values);
+
+    if (b->n_args < 1)
+        return;
+
+    b->data    = (char **)db_postgres_bind_reserve(a, b, nested);
+    b->size    = (int *)(b->data + b->n_args);
+    b->format  = b->size + b->n_args;
+    b->types   = (Oid *)(b->format + b->n_args);
+    b->scalars = (char *)(b->types + b->n_args);
+
+    a->bind_encoding++;
+    rb_protect(db_postgres_bind_encode_values, (VALUE)&e, &state);
+    a->bind_encoding--;
+
+    if (state) {
+        db_postgres_bind_free(b);
+        rb_jump_tag(state);
+    }
+}
+
+/* resets rather than frees, the arena stays with the connection */
+void db_postgres_bind_free(Bind *b) {
+    if (b->values)
+        rb_ary_clear(b->values);
+    b->data = 0;
+}
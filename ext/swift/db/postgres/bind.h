@@ -0,0 +1,20 @@
+// vim:ts=4:sts=4:sw=4:expandtab
+
+// (c) Bharanee Rathna 2012
+
+#pragma once
+
+#include "common.h"
+#include "adapter.h"
+
+typedef struct Bind {
+    int n_args;
+    char **data;
+    int *size, *format;
+    Oid *types;
+    char *scalars;
+    VALUE values;
+} Bind;
+
+DLL_PRIVATE void db_postgres_bind_encode(Bind *, Adapter *, VALUE, int, const Oid *);
+DLL_PRIVATE void db_postgres_bind_free(Bind *);
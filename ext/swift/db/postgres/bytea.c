@@ -0,0 +1,132 @@
+// vim:ts=4:sts=4:sw=4:expandtab
+
+// (c) Bharanee Rathna 2012
+
+#include "bytea.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define BYTEA_SSE2 1
+#include <emmintrin.h>
+#if defined(__clang__) || __GNUC__ >= 5
+#define BYTEA_AVX2 1
+#include <immintrin.h>
+#endif
+#endif
+
+/*
+ * bytea_output = hex sends two hex digits per byte. The vector paths map each digit to its nibble, checking that
+ * every lane was a digit or a-f/A-F, and then fold 16 bit lanes of (high, low) nibbles into bytes. Anything left
+ * over or invalid goes through the scalar loop.
+ */
+
+static const signed char bytea_nibbles[256] = {
+    ['0'] = 1,  ['1'] = 2,  ['2'] = 3,  ['3'] = 4,  ['4'] = 5,  ['5'] = 6,  ['6'] = 7,  ['7'] = 8,
+    ['8'] = 9,  ['9'] = 10, ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16
+};
+
+static int bytea_hex_decode_scalar(const unsigned char *hex, size_t size, char *bytes) {
+    int hi, lo;
+    size_t n;
+
+    /* table entries are offset by one so zero marks an invalid digit */
+    for (n = 0; n < size; n += 2) {
+        if (!(hi = bytea_nibbles[hex[n]]) || !(lo = bytea_nibbles[hex[n + 1]]))
+            return 0;
+        *bytes++ = (char)((hi - 1) << 4 | (lo - 1));
+    }
+    return 1;
+}
+
+#ifdef BYTEA_SSE2
+static inline int bytea_nibbles_sse2(__m128i hex, __m128i *nibbles) {
+    __m128i lower  = _mm_or_si128(hex, _mm_set1_epi8(0x20));
+    __m128i digit  = _mm_and_si128(_mm_cmpgt_epi8(hex, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(hex, _mm_set1_epi8('9' + 1)));
+    __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+
+    *nibbles = _mm_or_si128(
+        _mm_and_si128(digit,  _mm_sub_epi8(hex,   _mm_set1_epi8('0'))),
+        _mm_and_si128(letter, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10)))
+    );
+    return _mm_movemask_epi8(_mm_or_si128(digit, letter)) == 0xffff;
+}
+
+static inline __m128i bytea_fold_sse2(__m128i nibbles) {
+    __m128i hi = _mm_and_si128(nibbles, _mm_set1_epi16(0x00ff));
+    __m128i lo = _mm_srli_epi16(nibbles, 8);
+    return _mm_or_si128(_mm_slli_epi16(hi, 4), lo);
+}
+
+static size_t bytea_hex_decode_sse2(const char *hex, size_t size, char *bytes) {
+    size_t n;
+    __m128i a, b;
+
+    for (n = 0; n + 32 <= size; n += 32) {
+        if (!bytea_nibbles_sse2(_mm_loadu_si128((const __m128i *)(hex + n)), &a) ||
+            !bytea_nibbles_sse2(_mm_loadu_si128((const __m128i *)(hex + n + 16)), &b))
+            break;
+        _mm_storeu_si128((__m128i *)(bytes + n / 2), _mm_packus_epi16(bytea_fold_sse2(a), bytea_fold_sse2(b)));
+    }
+    return n;
+}
+#endif
+
+#ifdef BYTEA_AVX2
+__attribute__((target("avx2")))
+static inline int bytea_nibbles_avx2(__m256i hex, __m256i *nibbles) {
+    __m256i lower  = _mm256_or_si256(hex, _mm256_set1_epi8(0x20));
+    __m256i digit  = _mm256_and_si256(_mm256_cmpgt_epi8(hex, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), hex));
+    __m256i letter = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lower));
+
+    *nibbles = _mm256_or_si256(
+        _mm256_and_si256(digit,  _mm256_sub_epi8(hex,   _mm256_set1_epi8('0'))),
+        _mm256_and_si256(letter, _mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10)))
+    );
+    return _mm256_movemask_epi8(_mm256_or_si256(digit, letter)) == -1;
+}
+
+__attribute__((target("avx2")))
+static inline __m256i bytea_fold_avx2(__m256i nibbles) {
+    __m256i hi = _mm256_and_si256(nibbles, _mm256_set1_epi16(0x00ff));
+    __m256i lo = _mm256_srli_epi16(nibbles, 8);
+    return _mm256_or_si256(_mm256_slli_epi16(hi, 4), lo);
+}
+
+__attribute__((target("avx2")))
+static size_t bytea_hex_decode_avx2(const char *hex, size_t size, char *bytes) {
+    size_t n;
+    __m256i a, b;
+
+    for (n = 0; n + 64 <= size; n += 64) {
+        if (!bytea_nibbles_avx2(_mm256_loadu_si256((const __m256i *)(hex + n)), &a) ||
+            !bytea_nibbles_avx2(_mm256_loadu_si256((const __m256i *)(hex + n + 32)), &b))
+            break;
+        /* packus works per 128 bit lane, put the quadwords back in order */
+        _mm256_storeu_si256((__m256i *)(bytes + n / 2),
+            _mm256_permute4x64_epi64(_mm256_packus_epi16(bytea_fold_avx2(a), bytea_fold_avx2(b)), 0xd8));
+    }
+    return n;
+}
+#endif
+
+int bytea_hex_decode(const char *hex, size_t size, char *bytes) {
+    size_t n = 0;
+#ifdef BYTEA_AVX2
+    static int avx2 = -1;
+    if (avx2 < 0)
+        avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+#endif
+
+    if (size % 2)
+        return 0;
+
+#ifdef BYTEA_AVX2
+    if (avx2)
+        n = bytea_hex_decode_avx2(hex, size, bytes);
+#endif
+#ifdef BYTEA_SSE2
+    n += bytea_hex_decode_sse2(hex + n, size - n, bytes + n / 2);
+#endif
+
+    return bytea_hex_decode_scalar((const unsigned char *)hex + n, size - n, bytes + n / 2);
+}
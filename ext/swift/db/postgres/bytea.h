@@ -0,0 +1,10 @@
+// vim:ts=4:sts=4:sw=4:expandtab
+
+// (c) Bharanee Rathna 2012
+
+#pragma once
+
+#include "common.h"
+
+/* decodes size hex digits into size / 2 bytes, returns 0 on an odd length or a non hex digit */
+DLL_PRIVATE int bytea_hex_decode(const char *hex, size_t size, char *bytes);
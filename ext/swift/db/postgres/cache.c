@@ -0,0 +1,262 @@
+// vim:ts=4:sts=4:sw=4:expandtab
+
+// (c) Bharanee Rathna 2012
+
+#include "cache.h"
+#include "bind.h"
+
+/*
+ * Per connection LRU cache of prepared statements keyed by normalized sql. Ruby hashes keep insertion order,
+ * so a hit is moved to the end and the first entry is the least recently used one.
+ *
+ * Entries are [frozen sql, statement name, packed param types or nil, packed column types or nil], the types are
+ * filled in by describing the statement once binary params or results need them.
+ */
+
+#define ENTRY_SQL     0
+#define ENTRY_NAME    1
+#define ENTRY_TYPES   2
+#define ENTRY_COLUMNS 3
+
+int db_postgres_result_binary_type(Adapter*, Oid);
+
+#define STALE_MISSING 1
+#define STALE_PLAN    2
+
+static int db_postgres_cache_first(VALUE key, VALUE value, VALUE ptr) {
+    *(VALUE *)ptr = value;
+    return ST_STOP;
+}
+
+/* the server throws away or invalidates plans on schema changes, DISCARD ALL etc. */
+static int db_postgres_cache_stale(PGresult *result) {
+    const char *state;
+
+    if (PQresultStatus(result) != PGRES_FATAL_ERROR || !(state = PQresultErrorField(result, PG_DIAG_SQLSTATE)))
+        return 0;
+
+    /* invalid_sql_statement_name: prepared statement does not exist */
+    if (strcmp(state, "26000") == 0)
+        return STALE_MISSING;
+
+    /* feature_not_supported: cached plan must not change result type */
+    if (strcmp(state, "0A000") == 0 && strstr(PQresultErrorMessage(result), "cached plan"))
+        return STALE_PLAN;
+
+    return 0;
+}
+
+/*
+ * Deallocates queued statements once the connection is idle and no transaction control is waiting to go out. An
+ * aborted transaction refuses the DEALLOCATE and a failed one would abort the caller's transaction. Best effort,
+ * the statements die with the session anyway, so a failure just leaves the rest queued for the next try.
+ */
+static void db_postgres_cache_flush(Adapter *a) {
+    char command[256];
+    PGresult *result;
+    int ok;
+
+    while (a->deallocate && RARRAY_LEN(a->deallocate) > 0) {
+        if (PQstatus(a->connection) != CONNECTION_OK || PQtransactionStatus(a->connection) != PQTRANS_IDLE)
+            return;
+        if (a->deferred && RARRAY_LEN(a->deferred) > 0)
+            return;
+
+        snprintf(command, 256, "deallocate %s", CSTRING(rb_ary_entry(a->deallocate, 0)));
+        result = db_postgres_adapter_exec_sql(a, command);
+        /* already gone after a DISCARD ALL or similar */
+        ok = PQresultStatus(result) == PGRES_COMMAND_OK || db_postgres_cache_stale(result);
+        PQclear(result);
+
+        if (!ok)
+            return;
+        rb_ary_shift(a->deallocate);
+    }
+}
+
+static void db_postgres_cache_queue(Adapter *a, VALUE entry) {
+    if (!a->deallocate)
+        a->deallocate = rb_ary_new();
+    rb_ary_push(a->deallocate, rb_ary_entry(entry, ENTRY_NAME));
+}
+
+static void db_postgres_cache_deallocate(Adapter *a, VALUE entry) {
+    db_postgres_cache_queue(a, entry);
+    db_postgres_cache_flush(a);
+}
+
+static void db_postgres_cache_evict(Adapter *a) {
+    VALUE entry = Qnil;
+
+    while (RHASH_SIZE(a->cache) > (size_t)a->cache_size) {
+        rb_hash_foreach(a->cache, db_postgres_cache_first, (VALUE)&entry);
+        rb_hash_delete(a->cache, rb_ary_entry(entry, ENTRY_SQL));
+        a->cache_evictions++;
+        db_postgres_cache_deallocate(a, entry);
+    }
+}
+
+static VALUE db_postgres_cache_prepare(Adapter *a, VALUE sql) {
+    char name[64];
+    PGresult *result;
+    VALUE entry;
+    Query q = {.connection = a->connection, .command = RSTRING_PTR(sql), .name = name};
+
+    snprintf(name, 64, "c%lu", (unsigned long)++a->cache_sequence);
+    result = db_postgres_adapter_exec(a, &q, QUERY_PREPARE);
+    db_postgres_check_result(result);
+    PQclear(result);
+
+    entry = rb_ary_new3(4, rb_str_new_frozen(sql), rb_str_new2(name), Qnil, Qnil);
+    rb_hash_aset(a->cache, rb_ary_entry(entry, ENTRY_SQL), entry);
+    a->cache_misses++;
+
+    db_postgres_cache_evict(a);
+    return entry;
+}
+
+static VALUE db_postgres_cache_lookup(Adapter *a, VALUE sql) {
+    VALUE entry = rb_hash_lookup(a->cache, sql);
+    if (NIL_P(entry))
+        return db_postgres_cache_prepare(a, sql);
+
+    a->cache_hits++;
+    rb_hash_delete(a->cache, sql);
+    rb_hash_aset(a->cache, rb_ary_entry(entry, ENTRY_SQL), entry);
+    return entry;
+}
+
+/*
+ * Binary params need to match the server inferred parameter types exactly, binary results need the column types.
+ * Returns the failed describe, which may be stale like any other use of the statement.
+ */
+static PGresult* db_postgres_cache_describe(Adapter *a, VALUE entry) {
+    int n;
+    PGresult *result;
+    VALUE types, columns;
+    Query q = {.connection = a->connection, .command = RSTRING_PTR(rb_ary_entry(entry, ENTRY_NAME))};
+
+    if (!(a->binary_params || a->binary) || !NIL_P(rb_ary_entry(entry, ENTRY_COLUMNS)))
+        return 0;
+
+    result = db_postgres_adapter_exec(a, &q, QUERY_DESCRIBE);
+    if (PQresultStatus(result) != PGRES_COMMAND_OK)
+        return result;
+
+    types   = rb_str_new(0, sizeof(Oid) * PQnparams(result));
+    columns = rb_str_new(0, sizeof(Oid) * PQnfields(result));
+    for (n = 0; n < PQnparams(result); n++)
+        ((Oid *)RSTRING_PTR(types))[n] = PQparamtype(result, n);
+    for (n = 0; n < PQnfields(result); n++)
+        ((Oid *)RSTRING_PTR(columns))[n] = PQftype(result, n);
+    PQclear(result);
+
+    rb_ary_store(entry, ENTRY_TYPES,   types);
+    rb_ary_store(entry, ENTRY_COLUMNS, columns);
+    return 0;
+}
+
+/* binary results only when every column decodes the same as it would from text, text otherwise */
+static int db_postgres_cache_result_format(Adapter *a, VALUE entry) {
+    size_t n;
+    VALUE columns = rb_ary_entry(entry, ENTRY_COLUMNS);
+
+    if (!a->binary || NIL_P(columns))
+        return 0;
+
+    for (n = 0; n < RSTRING_LEN(columns) / sizeof(Oid); n++) {
+        if (!db_postgres_result_binary_type(a, ((Oid *)RSTRING_PTR(columns))[n]))
+            return 0;
+    }
+    return 1;
+}
+
+static PGresult* db_postgres_cache_run(Adapter *a, VALUE entry, VALUE bind) {
+    Bind b;
+    PGresult *result;
+    VALUE types = rb_ary_entry(entry, ENTRY_TYPES);
+
+    if (a->binary_params && !NIL_P(types) && RSTRING_LEN(types) / sizeof(Oid) == (size_t)RARRAY_LEN(bind))
+        db_postgres_bind_encode(&b, a, bind, 1, (Oid *)RSTRING_PTR(types));
+    else
+        db_postgres_bind_encode(&b, a, bind, 0, 0);
+
+    Query q = {
+        .connection    = a->connection,
+        .command       = RSTRING_PTR(rb_ary_entry(entry, ENTRY_NAME)),
+        .n_args        = b.n_args,
+        .data          = b.data,
+        .size          = b.size,
+        .format        = b.format,
+        .result_format = db_postgres_cache_result_format(a, entry),
+        .max_size      = a->max_result_size
+    };
+
+    result = db_postgres_adapter_exec(a, &q, QUERY_PREPARED);
+    RB_GC_GUARD(b.values);
+    db_postgres_bind_free(&b);
+    return result;
+}
+
+PGresult* db_postgres_cache_execute(Adapter *a, VALUE sql, VALUE bind) {
+    int retry, stale;
+    VALUE entry;
+    PGresult *result;
+
+    if (!a->cache)
+        a->cache = rb_hash_new();
+
+    db_postgres_cache_flush(a);
+    for (retry = 1; ; retry--) {
+        entry = db_postgres_cache_lookup(a, sql);
+        if (!(result = db_postgres_cache_describe(a, entry)))
+            result = db_postgres_cache_run(a, entry, bind);
+
+        if (!(stale = db_postgres_cache_stale(result)))
+            break;
+
+        rb_hash_delete(a->cache, sql);
+        if (stale == STALE_PLAN)
+            db_postgres_cache_deallocate(a, entry);
+
+        /* an aborted transaction can't be retried */
+        if (!retry || PQtransactionStatus(a->connection) != PQTRANS_IDLE)
+            break;
+
+        PQclear(result);
+    }
+    RB_GC_GUARD(bind);
+
+    return result;
+}
+
+static int db_postgres_cache_release(VALUE key, VALUE entry, VALUE ptr) {
+    db_postgres_cache_queue((Adapter *)ptr, entry);
+    return ST_CONTINUE;
+}
+
+void db_postgres_cache_clear(Adapter *a) {
+    /* nothing left to deallocate on a closed connection */
+    if (!a->connection && a->deallocate)
+        rb_ary_clear(a->deallocate);
+
+    if (!a->cache)
+        return;
+
+    if (a->connection)
+        rb_hash_foreach(a->cache, db_postgres_cache_release, (VALUE)a);
+    rb_hash_clear(a->cache);
+
+    if (a->connection)
+        db_postgres_cache_flush(a);
+}
+
+VALUE db_postgres_cache_stats(Adapter *a) {
+    VALUE stats = rb_hash_new();
+    rb_hash_aset(stats, ID2SYM(rb_intern("hits")),      SIZET2NUM(a->cache_hits));
+    rb_hash_aset(stats, ID2SYM(rb_intern("misses")),    SIZET2NUM(a->cache_misses));
+    rb_hash_aset(stats, ID2SYM(rb_intern("evictions")), SIZET2NUM(a->cache_evictions));
+    rb_hash_aset(stats, ID2SYM(rb_intern("size")),      SIZET2NUM(a->cache ? RHASH_SIZE(a->cache) : 0));
+    rb_hash_aset(stats, ID2SYM(rb_intern("capacity")),  INT2NUM(a->cache_size));
+    return stats;
+}
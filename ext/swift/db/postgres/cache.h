@@ -0,0 +1,12 @@
+// vim:ts=4:sts=4:sw=4:expandtab
+
+// (c) Bharanee Rathna 2012
+
+#pragma once
+
+#include "common.h"
+#include "adapter.h"
+
+DLL_PRIVATE PGresult* db_postgres_cache_execute(Adapter *, VALUE, VALUE);
+DLL_PRIVATE void      db_postgres_cache_clear(Adapter *);
+DLL_PRIVATE VALUE     db_postgres_cache_stats(Adapter *);
@@ -3,7 +3,6 @@
 // (c) Bharanee Rathna 2012
 
 #include "common.h"
-#include <math.h>
 #include <uuid/uuid.h>
 
 VALUE rb_uuid_string() {
@@ -20,34 +19,199 @@ VALUE rb_uuid_string() {
     return rb_str_new(uuid_hex, sizeof(uuid_t) * 2);
 }
 
-/* NOTE: very naive, no regex etc. */
-VALUE db_postgres_normalized_sql(VALUE sql) {
-    VALUE result;
-    int i = 0, j = 0, n = 1, size = RSTRING_LEN(sql) * 2, digits;
-    char *ptr = RSTRING_PTR(sql), *normalized = malloc(size);
-    if (!normalized)
-        rb_raise(rb_eNoMemError, "normalize sql");
-
-    while (i < RSTRING_LEN(sql)) {
-        if (*ptr == '?')
-            j += sprintf(normalized + j, "$%d", n++);
+#define SQL_OTHER   0
+#define SQL_OPERAND 1
+#define SQL_WORD    2
+
+/* words after which a ? is a value rather than the jsonb / hstore ? operator */
+static const char *sql_value_keywords[] = {
+    "all", "and", "any", "array", "between", "by", "case", "default", "distinct", "else", "elsif", "escape",
+    "exists", "fetch", "first", "from", "having", "if", "ilike", "in", "interval", "is", "like", "limit", "not",
+    "offset", "on", "or", "return", "returning", "select", "set", "similar", "some", "then", "to", "using",
+    "values", "when", "where", "with", "zone", 0
+};
+
+static int sql_ident_start(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c >= 0x80;
+}
+
+static int sql_ident_char(unsigned char c) {
+    return sql_ident_start(c) || (c >= '0' && c <= '9') || c == '$';
+}
+
+static int sql_digit(unsigned char c) {
+    return c >= '0' && c <= '9';
+}
+
+static int sql_value_keyword(const char *word, long size) {
+    long n;
+    const char **keyword;
+
+    for (keyword = sql_value_keywords; *keyword; keyword++) {
+        for (n = 0; n < size && (*keyword)[n] && ((*keyword)[n] == (word[n] | 0x20)); n++)
+            ;
+        if (n == size && !(*keyword)[n])
+            return 1;
+    }
+    return 0;
+}
+
+/* end of a quoted string or identifier, doubled quotes and backslash escapes stay inside */
+static const char* sql_skip_quoted(const char *ptr, const char *end, char quote, int escapes) {
+    for (ptr++; ptr < end; ptr++) {
+        if (escapes && *ptr == '\\')
+            ptr++;
+        else if (*ptr == quote) {
+            if (ptr + 1 < end && ptr[1] == quote)
+                ptr++;
+            else
+                return ptr + 1;
+        }
+    }
+    return end;
+}
+
+/* block comments nest in postgres */
+static const char* sql_skip_comment(const char *ptr, const char *end) {
+    int depth = 0;
+    while (ptr + 1 < end) {
+        if (ptr[0] == '/' && ptr[1] == '*')
+            depth++, ptr += 2;
+        else if (ptr[0] == '*' && ptr[1] == '/') {
+            ptr += 2;
+            if (--depth == 0)
+                return ptr;
+        }
         else
-            normalized[j++] = *ptr;
+            ptr++;
+    }
+    return end;
+}
+
+/* $tag$ ... $tag$ bodies, 0 when ptr does not start a dollar quote */
+static const char* sql_skip_dollar_quoted(const char *ptr, const char *end) {
+    long size;
+    const char *tag = ptr + 1;
 
-        digits = (int)floor(log10(n)) + 2;
-        if (j + digits >= size)
-            normalized = realloc(normalized, size += 4096);
+    if (tag < end && !sql_ident_start(*tag) && *tag != '$')
+        return 0;
+    while (tag < end && *tag != '$') {
+        if (!sql_ident_char(*tag))
+            return 0;
+        tag++;
+    }
+    if (tag >= end)
+        return 0;
+
+    size = tag - ptr + 1;
+    for (tag++; tag + size <= end; tag++) {
+        if (*tag == '$' && memcmp(tag, ptr, size) == 0)
+            return tag + size;
+    }
+    return end;
+}
+
+/*
+ * Rewrites ? bind placeholders to $n in a single pass that follows the postgres lexical rules, ? inside string
+ * literals, quoted identifiers, comments and dollar quoted bodies is left alone. A ? that follows an operand is the
+ * jsonb / hstore operator and not a placeholder, i.e. tags ? ? binds only the second one. Returns sql itself when
+ * there is nothing to rewrite.
+ */
+VALUE db_postgres_normalized_sql(VALUE sql, int standard_strings) {
+    char placeholder[16];
+    int state = SQL_OTHER, escapes = 0;
+    long n = 0, word_size = 0;
+    const char *ptr = RSTRING_PTR(sql), *end = ptr + RSTRING_LEN(sql), *copied = ptr, *word = 0, *next;
+    VALUE normalized;
+
+    if (!memchr(ptr, '?', RSTRING_LEN(sql)))
+        return sql;
+
+    normalized = rb_str_buf_new(RSTRING_LEN(sql) + 16);
+    while (ptr < end) {
+        unsigned char c = *ptr;
+
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f') {
+            ptr++;
+            continue;
+        }
+
+        if (c == '-' && ptr + 1 < end && ptr[1] == '-') {
+            next = memchr(ptr, '\n', end - ptr);
+            ptr  = next ? next : end;
+            continue;
+        }
 
-        ptr++;
-        i++;
+        if (c == '/' && ptr + 1 < end && ptr[1] == '*') {
+            ptr = sql_skip_comment(ptr, end);
+            continue;
+        }
+
+        if (c == '\'') {
+            ptr     = sql_skip_quoted(ptr, end, '\'', escapes || !standard_strings);
+            escapes = 0;
+            state   = SQL_OPERAND;
+            continue;
+        }
+
+        escapes = 0;
+        if (c == '"') {
+            ptr   = sql_skip_quoted(ptr, end, '"', 0);
+            state = SQL_OPERAND;
+        }
+        else if (sql_ident_start(c)) {
+            for (word = ptr++; ptr < end && sql_ident_char(*ptr); ptr++)
+                ;
+            word_size = ptr - word;
+            /* E'...' strings take backslash escapes */
+            escapes = word_size == 1 && (*word | 0x20) == 'e' && ptr < end && *ptr == '\'';
+            state   = SQL_WORD;
+        }
+        else if (sql_digit(c) || (c == '.' && ptr + 1 < end && sql_digit(ptr[1]))) {
+            for (ptr++; ptr < end && (sql_ident_char(*ptr) || *ptr == '.' ||
+                ((*ptr == '+' || *ptr == '-') && (ptr[-1] | 0x20) == 'e')); ptr++)
+                ;
+            state = SQL_OPERAND;
+        }
+        else if (c == '$' && ptr + 1 < end && sql_digit(ptr[1])) {
+            for (ptr++; ptr < end && sql_digit(*ptr); ptr++)
+                ;
+            state = SQL_OPERAND;
+        }
+        else if (c == '$' && (next = sql_skip_dollar_quoted(ptr, end))) {
+            ptr   = next;
+            state = SQL_OPERAND;
+        }
+        else if (c == '?') {
+            if (state == SQL_WORD)
+                state = sql_value_keyword(word, word_size) ? SQL_OTHER : SQL_OPERAND;
+
+            /* @? is the jsonpath operator */
+            if (state == SQL_OPERAND || (ptr > RSTRING_PTR(sql) && ptr[-1] == '@'))
+                state = SQL_OTHER;
+            else {
+                rb_str_cat(normalized, copied, ptr - copied);
+                rb_str_cat(normalized, placeholder, snprintf(placeholder, sizeof(placeholder), "$%ld", ++n));
+                copied = ptr + 1;
+                state  = SQL_OPERAND;
+            }
+            ptr++;
+        }
+        else {
+            state = c == ')' || c == ']' ? SQL_OPERAND : SQL_OTHER;
+            ptr++;
+        }
     }
 
-    result = rb_str_new(normalized, j);
-    free(normalized);
-    return result;
+    if (n == 0)
+        return sql;
+
+    rb_str_cat(normalized, copied, end - copied);
+    return normalized;
 }
 
-void db_postgres_check_result(PGresult *result) {
+/* exception for a failed result, nil otherwise. */
+VALUE db_postgres_result_error(PGresult *result) {
     VALUE error;
     switch (PQresultStatus(result)) {
         case PGRES_TUPLES_OK:
@@ -55,16 +219,21 @@ void db_postgres_check_result(PGresult *result) {
         case PGRES_COPY_IN:
         case PGRES_EMPTY_QUERY:
         case PGRES_COMMAND_OK:
-            break;
+            return Qnil;
         case PGRES_BAD_RESPONSE:
         case PGRES_FATAL_ERROR:
         case PGRES_NONFATAL_ERROR:
             error = rb_str_new2(PQresultErrorMessage(result));
-            PQclear(result);
-            rb_raise(strstr(CSTRING(error), "bind message") ? eSwiftArgumentError : eSwiftRuntimeError, "%s", CSTRING(error));
-            break;
+            return rb_exc_new_str(strstr(CSTRING(error), "bind message") ? eSwiftArgumentError : eSwiftRuntimeError, error);
         default:
-            PQclear(result);
-            rb_raise(eSwiftRuntimeError, "unknown error, check logs");
+            return rb_exc_new2(eSwiftRuntimeError, "unknown error, check logs");
+    }
+}
+
+void db_postgres_check_result(PGresult *result) {
+    VALUE error = db_postgres_result_error(result);
+    if (!NIL_P(error)) {
+        PQclear(result);
+        rb_exc_raise(error);
     }
 }
@@ -23,13 +23,28 @@ extern VALUE eSwiftError, eSwiftArgumentError, eSwiftRuntimeError, eSwiftConnect
 extern VALUE cStringIO;
 
 DLL_PRIVATE VALUE rb_uuid_string();
-DLL_PRIVATE VALUE db_postgres_normalized_sql(VALUE);
+DLL_PRIVATE VALUE db_postgres_normalized_sql(VALUE, int standard_strings);
+DLL_PRIVATE VALUE db_postgres_result_error(PGresult *);
 DLL_PRIVATE void  db_postgres_check_result(PGresult *);
 
 typedef struct Query {
     PGconn *connection;
     char *command;
+    /* statement name for QUERY_PREPARE, NULL or "" is the unnamed statement */
+    char *name;
     int n_args;
     char **data;
     int *size, *format;
+    Oid *types;
+    int result_format;
+    /* fetch row by row and give up once the result grows past this many bytes, 0 buffers it all */
+    size_t max_size;
 } Query;
+
+/* how a Query is sent, plain sql, sql with bind values or a prepared statement */
+#define QUERY_SIMPLE   0
+#define QUERY_PARAMS   1
+#define QUERY_PREPARED 2
+/* prepares or describes the statement without running it */
+#define QUERY_PREPARE  3
+#define QUERY_DESCRIBE 4
@@ -0,0 +1,1031 @@
+// vim:ts=4:sts=4:sw=4:expandtab
+
+// (c) Bharanee Rathna 2012
+
+#include "copy.h"
+#include "typecast.h"
+#include "types.h"
+#include "gvl.h"
+
+#include <ruby/io.h>
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <strings.h>
+#include <unistd.h>
+
+/*
+ * COPY FROM STDIN row encoder, rows of Ruby values are written into a single buffer in COPY text or binary format
+ * and sent to the server once it fills up. Text format follows the same coercion rules as bind values, binary
+ * format needs the column types and only takes values that encode exactly into them.
+ *
+ * File descriptor pump for COPY FROM STDIN, reads the descriptor and feeds libpq without the GVL in buffers of
+ * copy_buffer_size bytes. The connection is non-blocking while it runs so a full socket waits in poll. COPY TO
+ * STDOUT runs the other way round, rows are coalesced into the buffer and written out once it fills up.
+ *
+ * COPY TO STDOUT row parser, each copy message is split into fields in place and decoded with the same column
+ * decoders a result would use, the columns come from describing the equivalent select.
+ */
+
+/* declaration */
+
+typedef struct Result Result;
+
+Result* db_postgres_result_handle(VALUE);
+VALUE db_postgres_result_allocate(VALUE);
+VALUE db_postgres_result_load(VALUE, PGresult*, Adapter*);
+VALUE db_postgres_result_copied(VALUE, size_t);
+VALUE db_postgres_result_format(VALUE, int, Adapter*);
+int   db_postgres_result_binary_type(Adapter*, Oid);
+VALUE db_postgres_result_decode_value(Result*, int, const char*, size_t);
+
+typedef struct CopyWriter {
+    Adapter *adapter;
+    VALUE table;
+    VALUE fields;
+    VALUE rows;
+    VALUE buffer;
+    Oid *types;
+    size_t bytes;
+    int binary;
+    int columns;
+    int copying;
+} CopyWriter;
+
+typedef struct CopyReader {
+    Adapter *adapter;
+    VALUE source;
+    VALUE fields;
+    VALUE describe;
+    VALUE batch;
+    Result *result;
+    char *message;
+    size_t bytes;
+    long batch_size;
+    int binary;
+    int header;
+    int columns;
+    int copying;
+} CopyReader;
+
+typedef struct CopyPump {
+    Adapter *adapter;
+    PGconn *connection;
+    char *buffer;
+    size_t size;
+    size_t pending;
+    size_t bytes;
+    /* copy message from libpq that is not written out yet */
+    char *message;
+    size_t length;
+    int fd;
+    int nonblocking;
+    int eof;
+    int done;
+    /* errno of a failed syscall, -1 for a libpq error */
+    int error;
+} CopyPump;
+
+typedef struct CopyData {
+    Adapter *adapter;
+    const char *data;
+    int size;
+    /* PQputCopyEnd instead of PQputCopyData, with the error message when aborting */
+    int end;
+    const char *error;
+    int nonblocking;
+    int rc;
+} CopyData;
+
+/* definition */
+
+static GVL_NOLOCK_RETURN_TYPE nogvl_pq_put_copy_data(void *ptr) {
+    CopyData *d = (CopyData *)ptr;
+    return (GVL_NOLOCK_RETURN_TYPE)(intptr_t)PQputCopyData(d->adapter->connection, d->data, d->size);
+}
+
+static VALUE copy_put_nonblocking(VALUE ptr) {
+    CopyData *d = (CopyData *)ptr;
+    PGconn *connection = d->adapter->connection;
+
+    while ((d->rc = d->end ? PQputCopyEnd(connection, d->error) : PQputCopyData(connection, d->data, d->size)) == 0)
+        db_postgres_adapter_flush(d->adapter);
+    if (d->rc == 1)
+        db_postgres_adapter_flush(d->adapter);
+    return Qnil;
+}
+
+static VALUE copy_put_cleanup(VALUE ptr) {
+    CopyData *d = (CopyData *)ptr;
+    PQsetnonblocking(d->adapter->connection, d->nonblocking);
+    return Qnil;
+}
+
+/*
+ * Without a fiber scheduler libpq blocks on a full socket, which happens without the GVL. With one the data is
+ * queued on the non-blocking connection and flushed while the fiber waits in the scheduler.
+ */
+static void copy_put(CopyData *d) {
+    PGconn *connection = d->adapter->connection;
+
+    if (NIL_P(db_postgres_adapter_scheduler())) {
+        if (d->end)
+            d->rc = PQputCopyEnd(connection, d->error);
+        else
+            d->rc = (int)(intptr_t)GVL_NOLOCK(nogvl_pq_put_copy_data, d, RUBY_UBF_IO, 0);
+    }
+    else {
+        d->nonblocking = PQisnonblocking(connection);
+        PQsetnonblocking(connection, 1);
+        rb_ensure(copy_put_nonblocking, (VALUE)d, copy_put_cleanup, (VALUE)d);
+    }
+
+    if (d->rc != 1)
+        rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(connection));
+}
+
+void db_postgres_copy_put(Adapter *a, const char *data, size_t size) {
+    CopyData d = {a, data, (int)size, 0, 0, 0, 0};
+    if (size > INT_MAX)
+        rb_raise(eSwiftArgumentError, "copy data too large");
+    copy_put(&d);
+}
+
+void db_postgres_copy_end(Adapter *a) {
+    CopyData d = {a, 0, 0, 1, 0, 0, 0};
+    copy_put(&d);
+}
+
+/* ends a COPY FROM STDIN with an error so the server discards everything sent so far */
+static void copy_abort(Adapter *a, const char *message) {
+    PQputCopyEnd(a->connection, message);
+    db_postgres_adapter_drain(a);
+}
+
+static void copy_flush(CopyWriter *c) {
+    if (RSTRING_LEN(c->buffer) > 0)
+        db_postgres_copy_put(c->adapter, RSTRING_PTR(c->buffer), RSTRING_LEN(c->buffer));
+    c->bytes += RSTRING_LEN(c->buffer);
+    rb_str_set_len(c->buffer, 0);
+}
+
+/* the buffer is a String so nothing leaks when an encoder raises half way through a row */
+static inline char* copy_reserve(CopyWriter *c, size_t size) {
+    rb_str_modify_expand(c->buffer, size);
+    return RSTRING_PTR(c->buffer) + RSTRING_LEN(c->buffer);
+}
+
+static inline void copy_commit(CopyWriter *c, const char *end) {
+    rb_str_set_len(c->buffer, end - RSTRING_PTR(c->buffer));
+}
+
+static void copy_append(CopyWriter *c, const char *data, size_t size) {
+    char *ptr = copy_reserve(c, size);
+    memcpy(ptr, data, size);
+    copy_commit(c, ptr + size);
+}
+
+/* values that are not native scalars go through the same coercion as bind values */
+static VALUE copy_coerce(CopyWriter *c, VALUE value) {
+    VALUE coerced = typecast_encode(value);
+
+    if (NIL_P(coerced) && c->adapter->encoder)
+        coerced = rb_funcall(c->adapter->encoder, rb_intern("call"), 1, value);
+    if (NIL_P(coerced))
+        coerced = typecast_to_str(value);
+    return TO_S(coerced);
+}
+
+static void copy_text_escaped(CopyWriter *c, const char *data, long size) {
+    const char *end = data + size, *run = data;
+    char *ptr = copy_reserve(c, size * 2), escape;
+
+    for (; data < end; data++) {
+        switch (*data) {
+            case '\\': escape = '\\'; break;
+            case '\n': escape = 'n';  break;
+            case '\r': escape = 'r';  break;
+            case '\t': escape = 't';  break;
+            default: continue;
+        }
+        memcpy(ptr, run, data - run);
+        ptr   += data - run;
+        *ptr++ = '\\';
+        *ptr++ = escape;
+        run    = data + 1;
+    }
+
+    memcpy(ptr, run, end - run);
+    copy_commit(c, ptr + (end - run));
+}
+
+/* IO values are bytea, sent as \\x followed by hex digits */
+static void copy_text_bytea(CopyWriter *c, VALUE data) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *bytes = (const unsigned char *)RSTRING_PTR(data);
+    long n, size = RSTRING_LEN(data);
+    char *ptr = copy_reserve(c, size * 2 + 3);
+
+    *ptr++ = '\\';
+    *ptr++ = '\\';
+    *ptr++ = 'x';
+    for (n = 0; n < size; n++) {
+        *ptr++ = hex[bytes[n] >> 4];
+        *ptr++ = hex[bytes[n] & 0x0f];
+    }
+    copy_commit(c, ptr);
+}
+
+static void copy_text_value(CopyWriter *c, VALUE value) {
+    int length;
+    char *ptr;
+    VALUE data;
+
+    if (NIL_P(value)) {
+        copy_append(c, "\\N", 2);
+        return;
+    }
+
+    ptr = copy_reserve(c, TYPECAST_SCALAR_SIZE);
+    if ((length = typecast_encode_text(value, ptr)) >= 0) {
+        copy_commit(c, ptr + length);
+        return;
+    }
+
+    if (rb_obj_is_kind_of(value, rb_cIO) || rb_obj_is_kind_of(value, cStringIO)) {
+        data = rb_funcall(value, rb_intern("read"), 0);
+        copy_text_bytea(c, NIL_P(data) ? rb_str_new(0, 0) : TO_S(data));
+        return;
+    }
+
+    data = copy_coerce(c, value);
+    copy_text_escaped(c, RSTRING_PTR(data), RSTRING_LEN(data));
+}
+
+static void copy_binary_data(CopyWriter *c, const char *prefix, int prefix_size, VALUE data) {
+    long size = RSTRING_LEN(data) + prefix_size;
+    char *ptr = copy_reserve(c, size + 4);
+
+    if (size > INT32_MAX)
+        rb_raise(eSwiftArgumentError, "value too large for binary copy");
+
+    write_uint32(ptr, (uint32_t)size);
+    memcpy(ptr + 4, prefix, prefix_size);
+    memcpy(ptr + 4 + prefix_size, RSTRING_PTR(data), RSTRING_LEN(data));
+    copy_commit(c, ptr + 4 + size);
+}
+
+static void copy_binary_value(CopyWriter *c, VALUE value, int col) {
+    int length;
+    char *ptr, scalar[TYPECAST_SCALAR_SIZE];
+    VALUE data;
+    Oid oid = c->types[col];
+
+    if (NIL_P(value)) {
+        ptr = copy_reserve(c, 4);
+        write_uint32(ptr, (uint32_t)-1);
+        copy_commit(c, ptr + 4);
+        return;
+    }
+
+    switch (oid) {
+        case 17:
+            if (rb_obj_is_kind_of(value, rb_cIO) || rb_obj_is_kind_of(value, cStringIO))
+                data = rb_funcall(value, rb_intern("read"), 0);
+            else
+                data = copy_coerce(c, value);
+            copy_binary_data(c, 0, 0, NIL_P(data) ? rb_str_new(0, 0) : TO_S(data));
+            return;
+        case 18:
+        case 19:
+        case 25:
+        case 114:
+        case 1042:
+        case 1043:
+            copy_binary_data(c, 0, 0, copy_coerce(c, value));
+            return;
+        case 3802:
+            copy_binary_data(c, "\1", 1, copy_coerce(c, value));
+            return;
+        case 1700:
+            if ((length = typecast_encode_text(value, scalar)) >= 0)
+                data = rb_str_new(scalar, length);
+            else
+                data = copy_coerce(c, value);
+            ptr = copy_reserve(c, RSTRING_LEN(data) + 20);
+            if (!(length = (int)typecast_binary_numeric_from_text(RSTRING_PTR(data), RSTRING_LEN(data), ptr + 4)))
+                break;
+            write_uint32(ptr, (uint32_t)length);
+            copy_commit(c, ptr + 4 + length);
+            return;
+        case 2950:
+            data = copy_coerce(c, value);
+            ptr  = copy_reserve(c, 20);
+            if (!typecast_binary_uuid_from_text(RSTRING_PTR(data), RSTRING_LEN(data), ptr + 4))
+                break;
+            write_uint32(ptr, 16);
+            copy_commit(c, ptr + 20);
+            return;
+        default:
+            ptr = copy_reserve(c, TYPECAST_SCALAR_SIZE + 4);
+            if ((length = typecast_encode_binary(value, oid, ptr + 4)) < 0)
+                break;
+            write_uint32(ptr, (uint32_t)length);
+            copy_commit(c, ptr + 4 + length);
+            return;
+    }
+
+    rb_raise(eSwiftArgumentError, "cannot write %s into column %d with binary copy",
+        RSTRING_PTR(rb_inspect(value)), col + 1);
+}
+
+static void copy_row(CopyWriter *c, VALUE row) {
+    int col;
+    char *ptr;
+
+    if (TYPE(row) != T_ARRAY)
+        rb_raise(eSwiftArgumentError, "rows need to be arrays");
+    if (c->columns < 0)
+        c->columns = (int)RARRAY_LEN(row);
+    if (RARRAY_LEN(row) != c->columns)
+        rb_raise(eSwiftArgumentError, "row has %ld values, expected %d", RARRAY_LEN(row), c->columns);
+
+    if (c->binary) {
+        ptr = copy_reserve(c, 2);
+        write_uint16(ptr, (uint16_t)c->columns);
+        copy_commit(c, ptr + 2);
+        for (col = 0; col < c->columns; col++)
+            copy_binary_value(c, RARRAY_AREF(row, col), col);
+    }
+    else {
+        for (col = 0; col < c->columns; col++) {
+            if (col > 0)
+                copy_append(c, "\t", 1);
+            copy_text_value(c, RARRAY_AREF(row, col));
+        }
+        copy_append(c, "\n", 1);
+    }
+
+    if (RSTRING_LEN(c->buffer) >= c->adapter->copy_buffer_size)
+        copy_flush(c);
+}
+
+static VALUE copy_row_yield(RB_BLOCK_CALL_FUNC_ARGLIST(row, ptr)) {
+    copy_row((CopyWriter *)ptr, row);
+    return Qnil;
+}
+
+static VALUE copy_sql(const char *prefix, VALUE table, VALUE fields, const char *suffix) {
+    VALUE sql = rb_str_new2(prefix);
+
+    rb_str_append(sql, TO_S(table));
+    if (!NIL_P(fields)) {
+        rb_str_cat2(sql, "(");
+        rb_str_append(sql, TO_S(rb_ary_join(fields, rb_str_new2(", "))));
+        rb_str_cat2(sql, ")");
+    }
+    return rb_str_cat2(sql, suffix);
+}
+
+/* binary format needs the exact column types, domains and enums resolve through the adapter type map */
+static void copy_describe(CopyWriter *c) {
+    int col;
+    Oid oid;
+    TypeEntry *entry;
+    PGresult *result;
+    VALUE sql = rb_str_new2("select ");
+
+    rb_str_append(sql, NIL_P(c->fields) ? rb_str_new2("*") : TO_S(rb_ary_join(c->fields, rb_str_new2(", "))));
+    rb_str_cat2(sql, " from ");
+    rb_str_append(sql, TO_S(c->table));
+    rb_str_cat2(sql, " limit 0");
+
+    result = db_postgres_adapter_exec_sql(c->adapter, RSTRING_PTR(sql));
+    db_postgres_check_result(result);
+
+    c->columns = PQnfields(result);
+    if (!(c->types = (Oid *)malloc(sizeof(Oid) * (c->columns + 1)))) {
+        PQclear(result);
+        rb_raise(rb_eNoMemError, "copy types");
+    }
+
+    for (col = 0; col < c->columns; col++) {
+        oid   = PQftype(result, col);
+        entry = c->adapter->types ? db_postgres_types_lookup(c->adapter->types, oid) : 0;
+        c->types[col] = entry && entry->base && !entry->text ? entry->base : oid;
+    }
+    PQclear(result);
+}
+
+static VALUE copy_write_rows(VALUE ptr) {
+    long n;
+    VALUE sql;
+    PGresult *result;
+    CopyWriter *c = (CopyWriter *)ptr;
+
+    if (c->binary)
+        copy_describe(c);
+
+    sql = copy_sql("copy ", c->table, c->fields, c->binary ? " from stdin with (format binary)" : " from stdin");
+    result = db_postgres_adapter_exec_sql(c->adapter, RSTRING_PTR(sql));
+    db_postgres_check_result(result);
+    PQclear(result);
+    c->copying = 1;
+
+    if (c->binary)
+        copy_append(c, "PGCOPY\n\377\r\n\0\0\0\0\0\0\0\0\0", 19);
+
+    if (TYPE(c->rows) == T_ARRAY) {
+        for (n = 0; n < RARRAY_LEN(c->rows); n++)
+            copy_row(c, RARRAY_AREF(c->rows, n));
+    }
+    else
+        rb_block_call(c->rows, rb_intern("each"), 0, 0, copy_row_yield, (VALUE)c);
+
+    if (c->binary)
+        copy_append(c, "\377\377", 2);
+    copy_flush(c);
+
+    c->copying = 0;
+    db_postgres_copy_end(c->adapter);
+
+    result = db_postgres_adapter_next_result(c->adapter);
+    db_postgres_check_result(result);
+    if (!result)
+        rb_raise(eSwiftRuntimeError, "invalid result at the end of COPY command");
+    return db_postgres_result_copied(db_postgres_result_load(db_postgres_result_allocate(cDPR), result, c->adapter), c->bytes);
+}
+
+/* an encoder or the enumerable may raise half way through, the server discards everything sent so far */
+static VALUE copy_write_rows_cleanup(VALUE ptr) {
+    CopyWriter *c = (CopyWriter *)ptr;
+
+    if (c->copying)
+        copy_abort(c->adapter, "write_rows aborted");
+
+    free(c->types);
+    return Qnil;
+}
+
+VALUE db_postgres_copy_write_rows(Adapter *a, VALUE table, VALUE fields, VALUE rows, int binary) {
+    CopyWriter c;
+
+    if (!NIL_P(fields) && TYPE(fields) != T_ARRAY)
+        rb_raise(eSwiftArgumentError, "fields needs to be an array");
+    if (!NIL_P(fields) && RARRAY_LEN(fields) < 1)
+        fields = Qnil;
+    if (TYPE(rows) != T_ARRAY && !rb_respond_to(rows, rb_intern("each")))
+        rb_raise(eSwiftArgumentError, "rows need to be an array or respond to #each");
+
+    memset(&c, 0, sizeof(c));
+    c.adapter = a;
+    c.table   = table;
+    c.fields  = fields;
+    c.rows    = rows;
+    c.binary  = binary;
+    c.columns = NIL_P(fields) ? -1 : (int)RARRAY_LEN(fields);
+    c.buffer  = rb_str_buf_new(a->copy_buffer_size + TYPECAST_SCALAR_SIZE);
+
+    return rb_ensure(copy_write_rows, (VALUE)&c, copy_write_rows_cleanup, (VALUE)&c);
+}
+
+#ifndef HAVE_RB_IO_DESCRIPTOR
+#define rb_io_descriptor(io) NUM2INT(rb_funcall(io, rb_intern("fileno"), 0))
+#endif
+
+/*
+ * IO objects go straight to the descriptor once Ruby has nothing buffered for it. Writes are flushed first, reads
+ * that already pulled data into the IO buffers (a #gets on a pipe or socket, a partial read of a file) go through
+ * #read instead so the buffered bytes are not skipped.
+ */
+int db_postgres_copy_io_fd(VALUE io, int writable) {
+    int fd;
+    rb_io_t *fptr;
+
+    if (TYPE(io) != T_FILE)
+        return -1;
+
+    fd = rb_io_descriptor(io);
+    if (writable) {
+        rb_io_flush(io);
+        return fd;
+    }
+
+    GetOpenFile(io, fptr);
+    if (rb_io_read_pending(fptr))
+        return -1;
+    return fd;
+}
+
+/* returns the ready events or -1, an interrupted poll leaves the error unset so the caller can check interrupts */
+static int copy_pump_poll(CopyPump *p, int fd, short events) {
+    struct pollfd pfd = {fd, events, 0};
+
+    if (poll(&pfd, 1, -1) < 0) {
+        if (errno != EINTR)
+            p->error = errno;
+        return -1;
+    }
+    return pfd.revents;
+}
+
+static int copy_pump_flush(CopyPump *p) {
+    int rc;
+
+    while ((rc = PQflush(p->connection)) == 1) {
+        if ((rc = copy_pump_poll(p, PQsocket(p->connection), POLLIN | POLLOUT)) < 0)
+            return -1;
+        /* the server may send notices or an error while we write, read them to avoid a deadlock */
+        if ((rc & POLLIN) && !PQconsumeInput(p->connection)) {
+            p->error = -1;
+            return -1;
+        }
+    }
+
+    if (rc < 0)
+        p->error = -1;
+    return rc;
+}
+
+/* returns when the descriptor hits EOF, on an error or when a signal interrupts a syscall */
+static GVL_NOLOCK_RETURN_TYPE nogvl_copy_pump(void *ptr) {
+    ssize_t n;
+    int rc;
+    CopyPump *p = (CopyPump *)ptr;
+
+    while (1) {
+        /* data read before an interrupt is still pending on the way back in */
+        if (!p->pending) {
+            if ((n = read(p->fd, p->buffer, p->size)) < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    if (copy_pump_poll(p, p->fd, POLLIN) < 0)
+                        return 0;
+                    continue;
+                }
+                if (errno != EINTR)
+                    p->error = errno;
+                return 0;
+            }
+            if (n == 0)
+                break;
+            p->pending = (size_t)n;
+        }
+
+        while ((rc = PQputCopyData(p->connection, p->buffer, (int)p->pending)) == 0) {
+            if (copy_pump_flush(p) < 0)
+                return 0;
+        }
+        if (rc < 0) {
+            p->error = -1;
+            return 0;
+        }
+
+        p->bytes  += p->pending;
+        p->pending = 0;
+        if (copy_pump_flush(p) < 0)
+            return 0;
+    }
+
+    p->done = 1;
+    return 0;
+}
+
+static VALUE copy_write_fd(VALUE ptr) {
+    CopyPump *p = (CopyPump *)ptr;
+
+    if (PQsetnonblocking(p->connection, 1) != 0)
+        rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(p->connection));
+
+    while (!p->done) {
+        GVL_NOLOCK(nogvl_copy_pump, p, RUBY_UBF_IO, 0);
+        if (p->error > 0)
+            rb_syserr_fail(p->error, "copy source");
+        if (p->error < 0)
+            rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(p->connection));
+        if (!p->done)
+            rb_thread_check_ints();
+    }
+
+    return Qnil;
+}
+
+/* an error or a thread interrupt aborts the COPY so the server discards what it got */
+static VALUE copy_write_fd_cleanup(VALUE ptr) {
+    CopyPump *p = (CopyPump *)ptr;
+
+    PQsetnonblocking(p->connection, p->nonblocking);
+    if (!p->done)
+        copy_abort(p->adapter, "copy source failed");
+
+    free(p->buffer);
+    return Qnil;
+}
+
+size_t db_postgres_copy_write_fd(Adapter *a, int fd) {
+    CopyPump p;
+
+    memset(&p, 0, sizeof(p));
+    p.adapter     = a;
+    p.connection  = a->connection;
+    p.fd          = fd;
+    p.size        = (size_t)a->copy_buffer_size;
+    p.nonblocking = PQisnonblocking(a->connection);
+
+    if (!(p.buffer = (char *)malloc(p.size)))
+        rb_raise(rb_eNoMemError, "copy buffer");
+
+    rb_ensure(copy_write_fd, (VALUE)&p, copy_write_fd_cleanup, (VALUE)&p);
+    return p.bytes;
+}
+
+/* writes out *length bytes of data, anything left after an interrupt is moved to the front */
+static int copy_pump_write(CopyPump *p, char *data, size_t *length) {
+    ssize_t n;
+
+    while (*length > 0) {
+        if ((n = write(p->fd, data, *length)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (copy_pump_poll(p, p->fd, POLLOUT) < 0)
+                    return -1;
+                continue;
+            }
+            if (errno != EINTR)
+                p->error = errno;
+            return -1;
+        }
+
+        p->bytes += (size_t)n;
+        *length  -= (size_t)n;
+        if (*length > 0)
+            memmove(data, data + n, *length);
+    }
+
+    return 0;
+}
+
+/* returns at the end of the copy, on an error or when a signal interrupts a syscall */
+static GVL_NOLOCK_RETURN_TYPE nogvl_copy_drain(void *ptr) {
+    int n;
+    CopyPump *p = (CopyPump *)ptr;
+
+    while (!p->eof) {
+        if (!p->message) {
+            switch ((n = PQgetCopyData(p->connection, &p->message, 1))) {
+                case -1:
+                    p->message = 0;
+                    p->eof     = 1;
+                    continue;
+                case -2:
+                    p->message = 0;
+                    p->error   = -1;
+                    return 0;
+                case 0:
+                    p->message = 0;
+                    if (copy_pump_poll(p, PQsocket(p->connection), POLLIN) < 0)
+                        return 0;
+                    if (!PQconsumeInput(p->connection)) {
+                        p->error = -1;
+                        return 0;
+                    }
+                    continue;
+            }
+            p->length = (size_t)n;
+        }
+
+        /* rows are one message each, coalesce them and write anything larger than the buffer on its own */
+        if (p->pending + p->length > p->size && copy_pump_write(p, p->buffer, &p->pending) < 0)
+            return 0;
+        if (p->length > p->size) {
+            if (copy_pump_write(p, p->message, &p->length) < 0)
+                return 0;
+        }
+        else {
+            memcpy(p->buffer + p->pending, p->message, p->length);
+            p->pending += p->length;
+        }
+
+        PQfreemem(p->message);
+        p->message = 0;
+    }
+
+    if (copy_pump_write(p, p->buffer, &p->pending) == 0)
+        p->done = 1;
+    return 0;
+}
+
+static VALUE copy_read_fd(VALUE ptr) {
+    CopyPump *p = (CopyPump *)ptr;
+
+    while (!p->done) {
+        GVL_NOLOCK(nogvl_copy_drain, p, RUBY_UBF_IO, 0);
+        if (p->error > 0)
+            rb_syserr_fail(p->error, "copy target");
+        if (p->error < 0)
+            rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(p->connection));
+        if (!p->done)
+            rb_thread_check_ints();
+    }
+
+    return Qnil;
+}
+
+/* a failed write or a thread interrupt cancels the query, the rest of the copy needs to be discarded */
+static VALUE copy_read_fd_cleanup(VALUE ptr) {
+    CopyPump *p = (CopyPump *)ptr;
+
+    if (p->message)
+        PQfreemem(p->message);
+
+    if (!p->done)
+        db_postgres_adapter_discard(p->adapter);
+
+    free(p->buffer);
+    return Qnil;
+}
+
+size_t db_postgres_copy_read_fd(Adapter *a, int fd) {
+    CopyPump p;
+
+    memset(&p, 0, sizeof(p));
+    p.adapter    = a;
+    p.connection = a->connection;
+    p.fd         = fd;
+    p.size       = (size_t)a->copy_buffer_size;
+
+    if (!(p.buffer = (char *)malloc(p.size)))
+        rb_raise(rb_eNoMemError, "copy buffer");
+
+    rb_ensure(copy_read_fd, (VALUE)&p, copy_read_fd_cleanup, (VALUE)&p);
+    return p.bytes;
+}
+
+static void copy_yield(CopyReader *c, VALUE row) {
+    if (!c->batch_size) {
+        rb_yield(row);
+        return;
+    }
+
+    rb_ary_push(c->batch, row);
+    if (RARRAY_LEN(c->batch) >= c->batch_size) {
+        row      = c->batch;
+        c->batch = rb_ary_new_capa(c->batch_size);
+        rb_yield(row);
+    }
+}
+
+/*
+ * Fields are unescaped and NUL terminated in place, the unescaped text is never longer than the escaped one and
+ * the separator after each field is free to overwrite. COPY TO only ever escapes with the letters below.
+ */
+static void copy_text_row(CopyReader *c, char *data, int size) {
+    int col;
+    char *ptr = data, *end = data + size, *out, *field;
+    VALUE row = rb_ary_new_capa(c->columns);
+
+    if (ptr < end && end[-1] == '\n')
+        end--;
+
+    for (col = 0; col < c->columns; col++) {
+        if (ptr > end)
+            rb_raise(eSwiftRuntimeError, "copy row has fewer than %d fields", c->columns);
+
+        if (end - ptr >= 2 && ptr[0] == '\\' && ptr[1] == 'N' && (ptr + 2 == end || ptr[2] == '\t')) {
+            rb_ary_push(row, Qnil);
+            ptr += 3;
+            continue;
+        }
+
+        for (field = out = ptr; ptr < end && *ptr != '\t'; ptr++) {
+            if (*ptr != '\\' || ptr + 1 == end) {
+                *out++ = *ptr;
+                continue;
+            }
+            switch (*++ptr) {
+                case 'b': *out++ = '\b'; break;
+                case 'f': *out++ = '\f'; break;
+                case 'n': *out++ = '\n'; break;
+                case 'r': *out++ = '\r'; break;
+                case 't': *out++ = '\t'; break;
+                case 'v': *out++ = '\v'; break;
+                default:  *out++ = *ptr;
+            }
+        }
+
+        *out = 0;
+        ptr++;
+        rb_ary_push(row, db_postgres_result_decode_value(c->result, col, field, out - field));
+    }
+
+    if (ptr <= end)
+        rb_raise(eSwiftRuntimeError, "copy row has more than %d fields", c->columns);
+    copy_yield(c, row);
+}
+
+/* binary fields are NUL terminated for the decoders by borrowing the first byte after them, libpq NUL terminates
+   the message so the last field has one too */
+static void copy_binary_row(CopyReader *c, char *data, int size) {
+    int col;
+    char saved;
+    int32_t length;
+    char *ptr = data, *end = data + size;
+    VALUE row, value;
+
+    if (!c->header) {
+        if (size < 19 || memcmp(ptr, "PGCOPY\n\377\r\n\0", 11) != 0)
+            rb_raise(eSwiftRuntimeError, "invalid binary copy header");
+        ptr += 19 + read_uint32(ptr + 15);
+        c->header = 1;
+        if (ptr >= end)
+            return;
+    }
+
+    if (end - ptr < 2)
+        rb_raise(eSwiftRuntimeError, "truncated binary copy tuple");
+
+    /* -1 marks the trailer */
+    if ((int16_t)read_uint16(ptr) == -1)
+        return;
+    if ((int16_t)read_uint16(ptr) != c->columns)
+        rb_raise(eSwiftRuntimeError, "binary copy tuple has %d fields, expected %d", (int16_t)read_uint16(ptr), c->columns);
+
+    row = rb_ary_new_capa(c->columns);
+    for (ptr += 2, col = 0; col < c->columns; col++) {
+        if (end - ptr < 4)
+            rb_raise(eSwiftRuntimeError, "truncated binary copy tuple");
+        length = (int32_t)read_uint32(ptr);
+        ptr   += 4;
+
+        if (length < 0) {
+            rb_ary_push(row, Qnil);
+            continue;
+        }
+        if (end - ptr < length)
+            rb_raise(eSwiftRuntimeError, "truncated binary copy tuple");
+
+        saved       = ptr[length];
+        ptr[length] = 0;
+        value       = db_postgres_result_decode_value(c->result, col, ptr, length);
+        ptr[length] = saved;
+
+        rb_ary_push(row, value);
+        ptr += length;
+    }
+
+    copy_yield(c, row);
+}
+
+/*
+ * The source is a query if it starts with select, with, values, table or an opening parenthesis. Anything else is
+ * a table name, which can be schema qualified or quoted and contain spaces, "order items" is a table.
+ */
+static int copy_source_query(const char *source) {
+    static const char *keywords[] = {"select", "with", "values", "table", 0};
+    size_t n, length;
+
+    while (isspace((unsigned char)*source))
+        source++;
+    if (*source == '(')
+        return 1;
+
+    for (n = 0; keywords[n]; n++) {
+        length = strlen(keywords[n]);
+        if (strncasecmp(source, keywords[n], length) == 0 && !isalnum((unsigned char)source[length]) &&
+            source[length] != '_' && source[length] != '$')
+            return 1;
+    }
+    return 0;
+}
+
+static VALUE copy_read_rows(VALUE ptr) {
+    int n, query;
+    char *data;
+    VALUE sql, error = Qnil;
+    PGresult *result, *status = 0;
+    CopyReader *c = (CopyReader *)ptr;
+    PGconn *connection = c->adapter->connection;
+
+    query = copy_source_query(CSTRING(c->source));
+
+    if (query && !NIL_P(c->fields))
+        rb_raise(eSwiftArgumentError, "fields can only be given with a table");
+
+    if (query) {
+        sql = TO_S(c->source);
+    }
+    else {
+        sql = rb_str_new2("select ");
+        rb_str_append(sql, NIL_P(c->fields) ? rb_str_new2("*") : TO_S(rb_ary_join(c->fields, rb_str_new2(", "))));
+        rb_str_cat2(sql, " from ");
+        rb_str_append(sql, TO_S(c->source));
+    }
+
+    /* the unnamed statement gives us field names and types without running the query */
+    Query q = {.connection = connection, .command = RSTRING_PTR(sql), .name = ""};
+    result  = db_postgres_adapter_exec(c->adapter, &q, QUERY_PREPARE);
+    db_postgres_check_result(result);
+    PQclear(result);
+
+    q.command = "";
+    result    = db_postgres_adapter_exec(c->adapter, &q, QUERY_DESCRIBE);
+    db_postgres_check_result(result);
+    RB_GC_GUARD(sql);
+
+    /* binary copy only when every column decodes the same as it would from text */
+    c->columns = PQnfields(result);
+    for (n = 0; c->binary && n < c->columns; n++) {
+        if (!db_postgres_result_binary_type(c->adapter, PQftype(result, n)))
+            c->binary = 0;
+    }
+
+    c->describe = db_postgres_result_load(db_postgres_result_allocate(cDPR), result, c->adapter);
+    c->result   = db_postgres_result_handle(db_postgres_result_format(c->describe, c->binary, c->adapter));
+
+    if (query)
+        sql = copy_sql("copy (", sql, Qnil, c->binary ? ") to stdout with (format binary)" : ") to stdout");
+    else
+        sql = copy_sql("copy ", c->source, c->fields, c->binary ? " to stdout with (format binary)" : " to stdout");
+
+    result = db_postgres_adapter_exec_sql(c->adapter, RSTRING_PTR(sql));
+    db_postgres_check_result(result);
+    PQclear(result);
+    c->copying = 1;
+
+    while (c->copying) {
+        switch ((n = PQgetCopyData(connection, &data, 1))) {
+            case -1:
+                c->copying = 0;
+                break;
+            case -2:
+                rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(connection));
+            case 0:
+                db_postgres_adapter_wait(c->adapter, RB_WAITFD_IN);
+                if (!PQconsumeInput(connection))
+                    rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(connection));
+                break;
+            default:
+                c->message = data;
+                c->bytes  += n;
+                if (c->binary)
+                    copy_binary_row(c, data, n);
+                else
+                    copy_text_row(c, data, n);
+                c->message = 0;
+                PQfreemem(data);
+        }
+    }
+
+    while ((result = db_postgres_adapter_next_result(c->adapter))) {
+        if (NIL_P(error))
+            error = db_postgres_result_error(result);
+        if (status || !NIL_P(error))
+            PQclear(result);
+        else
+            status = result;
+    }
+
+    if (!NIL_P(error)) {
+        if (status)
+            PQclear(status);
+        rb_exc_raise(error);
+    }
+
+    if (c->batch_size && RARRAY_LEN(c->batch) > 0)
+        rb_yield(c->batch);
+
+    if (!status)
+        rb_raise(eSwiftRuntimeError, "invalid result at the end of COPY command");
+    return db_postgres_result_copied(db_postgres_result_load(db_postgres_result_allocate(cDPR), status, c->adapter), c->bytes);
+}
+
+/* the block may break out or raise half way through, the rest of the copy needs to be discarded. */
+static VALUE copy_read_rows_cleanup(VALUE ptr) {
+    CopyReader *c = (CopyReader *)ptr;
+
+    if (c->message)
+        PQfreemem(c->message);
+
+    if (c->copying)
+        db_postgres_adapter_discard(c->adapter);
+
+    return Qnil;
+}
+
+VALUE db_postgres_copy_read_rows(Adapter *a, VALUE source, VALUE fields, int binary, long batch) {
+    CopyReader c;
+
+    if (!NIL_P(fields) && TYPE(fields) != T_ARRAY)
+        rb_raise(eSwiftArgumentError, "fields needs to be an array");
+    if (!NIL_P(fields) && RARRAY_LEN(fields) < 1)
+        fields = Qnil;
+
+    memset(&c, 0, sizeof(c));
+    c.adapter    = a;
+    c.source     = source;
+    c.fields     = fields;
+    c.binary     = binary;
+    c.batch_size = batch;
+    c.batch      = batch ? rb_ary_new_capa(batch) : Qnil;
+    c.describe   = Qnil;
+
+    return rb_ensure(copy_read_rows, (VALUE)&c, copy_read_rows_cleanup, (VALUE)&c);
+}
@@ -0,0 +1,19 @@
+// vim:ts=4:sts=4:sw=4:expandtab
+
+// (c) Bharanee Rathna 2012
+
+#pragma once
+
+#include "common.h"
+#include "adapter.h"
+
+/* default for the copy_buffer_size option */
+#define COPY_BUFFER_SIZE (1024 * 1024)
+
+DLL_PRIVATE VALUE  db_postgres_copy_write_rows(Adapter *, VALUE table, VALUE fields, VALUE rows, int binary);
+DLL_PRIVATE VALUE  db_postgres_copy_read_rows(Adapter *, VALUE source, VALUE fields, int binary, long batch);
+DLL_PRIVATE void   db_postgres_copy_put(Adapter *, const char *data, size_t size);
+DLL_PRIVATE void   db_postgres_copy_end(Adapter *);
+DLL_PRIVATE int    db_postgres_copy_io_fd(VALUE io, int writable);
+DLL_PRIVATE size_t db_postgres_copy_write_fd(Adapter *, int fd);
+DLL_PRIVATE size_t db_postgres_copy_read_fd(Adapter *, int fd);
@@ -1,6 +1,7 @@
 #include "datetime.h"
 #include <time.h>
 #include <ctype.h>
+#include <limits.h>
 
 #define CONST_GET(scope, constant) rb_funcall(scope, rb_intern("const_get"), 1, rb_str_new2(constant))
 #define TO_S(v)                    rb_funcall(v, rb_intern("to_s"), 0)
@@ -9,6 +10,7 @@
 extern VALUE dtformat;
 
 VALUE cSwiftDateTime, day_seconds;
+static VALUE cRubyDate, day_offset;
 ID fcivil, fparse, fstrptime;
 
 // NOTE: only parses '%F %T.%N %z' format and falls back to the built-in DateTime#parse
@@ -68,13 +70,159 @@ VALUE datetime_parse(VALUE klass, const char *data, size_t size) {
       : (time_t)tzhour * -3600 + (time_t)tzmin * -60;
   }
 
+  return datetime_civil(klass, tm.tm_year, tm.tm_mon, tm.tm_mday, tm.tm_hour, tm.tm_min, seconds, offset);
+}
+
+// rows from a session mostly share a single zone offset, keep the last Rational around.
+static VALUE datetime_offset(int offset) {
+  static int last = 0;
+  if (offset != last || NIL_P(day_offset)) {
+    day_offset = rb_Rational(INT2FIX(offset), day_seconds);
+    last       = offset;
+  }
+  return day_offset;
+}
+
+VALUE datetime_civil(VALUE klass, int year, int month, int day, int hour, int min, double seconds, int offset) {
   return rb_funcall(klass, fcivil, 7,
-    INT2FIX(tm.tm_year), INT2FIX(tm.tm_mon), INT2FIX(tm.tm_mday),
-    INT2FIX(tm.tm_hour), INT2FIX(tm.tm_min), DBL2NUM(seconds),
-    offset == 0 ? INT2FIX(0) : rb_Rational(INT2FIX(offset), day_seconds)
+    INT2FIX(year), INT2FIX(month), INT2FIX(day),
+    INT2FIX(hour), INT2FIX(min), DBL2NUM(seconds),
+    offset == 0 ? INT2FIX(0) : datetime_offset(offset)
   );
 }
 
+// days since 1970-01-01 to proleptic gregorian y-m-d, see http://howardhinnant.github.io/date_algorithms.html
+void datetime_civil_from_days(int64_t days, int *year, int *month, int *day) {
+  int64_t era, doe, yoe, doy, mp;
+
+  days += 719468;
+  era   = (days >= 0 ? days : days - 146096) / 146097;
+  doe   = days - era * 146097;
+  yoe   = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  doy   = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  mp    = (5 * doy + 2) / 153;
+
+  *day   = (int)(doy - (153 * mp + 2) / 5 + 1);
+  *month = (int)(mp < 10 ? mp + 3 : mp - 9);
+  *year  = (int)(yoe + era * 400 + (*month <= 2));
+}
+
+// inverse of the above, proleptic gregorian y-m-d to days since 1970-01-01
+int64_t datetime_days_from_civil(int64_t year, int month, int day) {
+  int64_t era, yoe, doy, doe;
+
+  year -= month <= 2;
+  era   = (year >= 0 ? year : year - 399) / 400;
+  yoe   = year - era * 400;
+  doy   = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  doe   = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+static const char* datetime_digits(const char *ptr, const char *end, int max, int64_t *value) {
+  const char *start = ptr;
+  for (*value = 0; ptr < end && ptr - start < max && isdigit((unsigned char)*ptr); ptr++)
+    *value = *value * 10 + *ptr - '0';
+  return ptr > start ? ptr : NULL;
+}
+
+// parses the ISO output of date, timestamp and timestamptz without allocating, '%F[ %T[.%N][%z]][ BC]'.
+// usec is relative to 1970-01-01 00:00:00 UTC, or the wall clock when there is no zone. offset is in
+// seconds east of UTC. returns 2 if there was a zone, 1 if not and 0 for anything else including
+// infinity and non-ISO DateStyle output so callers can fall back.
+int datetime_parse_usec(const char *data, size_t size, int64_t *usec, int *offset) {
+  int64_t year, month, day, hour = 0, min = 0, sec = 0, fraction = 0, tzhour = 0, tzmin = 0, tzsec = 0, zone;
+  int n, tzsign = 0;
+  const char *ptr = data, *end = data + size;
+
+  if (!(ptr = datetime_digits(ptr, end, 9, &year)) || ptr >= end || *ptr++ != '-')
+    return 0;
+  if (!(ptr = datetime_digits(ptr, end, 2, &month)) || ptr >= end || *ptr++ != '-')
+    return 0;
+  if (!(ptr = datetime_digits(ptr, end, 2, &day)))
+    return 0;
+
+  if (ptr + 1 < end && (*ptr == ' ' || *ptr == 'T') && isdigit((unsigned char)ptr[1])) {
+    ptr++;
+    if (!(ptr = datetime_digits(ptr, end, 2, &hour)) || ptr >= end || *ptr++ != ':')
+      return 0;
+    if (!(ptr = datetime_digits(ptr, end, 2, &min)) || ptr >= end || *ptr++ != ':')
+      return 0;
+    if (!(ptr = datetime_digits(ptr, end, 2, &sec)))
+      return 0;
+
+    // microsecond resolution, anything finer is truncated.
+    if (ptr < end && *ptr == '.') {
+      for (n = 0, ptr++; ptr < end && isdigit((unsigned char)*ptr); ptr++, n++) {
+        if (n < 6)
+          fraction = fraction * 10 + *ptr - '0';
+      }
+      for (; n < 6; n++)
+        fraction *= 10;
+    }
+
+    // +HH, +HH:MM or +HH:MM:SS
+    if (ptr < end && (*ptr == '+' || *ptr == '-')) {
+      tzsign = *ptr++ == '+' ? 1 : -1;
+      if (!(ptr = datetime_digits(ptr, end, 2, &tzhour)))
+        return 0;
+      if (ptr < end && *ptr == ':' && (ptr = datetime_digits(ptr + 1, end, 2, &tzmin)) && ptr < end && *ptr == ':')
+        ptr = datetime_digits(ptr + 1, end, 2, &tzsec);
+      if (!ptr)
+        return 0;
+    }
+  }
+
+  if (ptr + 3 <= end && memcmp(ptr, " BC", 3) == 0) {
+    year = 1 - year;
+    ptr += 3;
+  }
+
+  if (ptr != end || month < 1 || month > 12 || day < 1 || day > 31 || hour > 24 || min > 59 || sec > 60)
+    return 0;
+
+  zone = tzsign * (tzhour * 3600 + tzmin * 60 + tzsec);
+  if (offset)
+    *offset = (int)zone;
+
+  *usec = ((datetime_days_from_civil(year, (int)month, (int)day) * 86400 + hour * 3600 + min * 60 + sec - zone) * 1000000) + fraction;
+  return tzsign ? 2 : 1;
+}
+
+static int64_t datetime_floor_div(int64_t value, int64_t divisor) {
+  return value / divisor - (value % divisor < 0);
+}
+
+// microseconds since 1970-01-01 00:00:00 UTC, shown at offset seconds east of UTC.
+VALUE datetime_from_epoch_usec(VALUE klass, int64_t usec, int offset) {
+  int year, month, day;
+  int64_t days, seconds;
+
+  usec   += (int64_t)offset * 1000000;
+  seconds = datetime_floor_div(usec, 1000000);
+  usec   -= seconds * 1000000;
+  days    = datetime_floor_div(seconds, 86400);
+  seconds -= days * 86400;
+
+  datetime_civil_from_days(days, &year, &month, &day);
+  return datetime_civil(klass, year, month, day,
+    (int)(seconds / 3600), (int)(seconds % 3600 / 60), (double)(seconds % 60) + (double)usec / 1000000, offset);
+}
+
+// Time at offset seconds east of UTC, or a UTC Time when utc is set.
+VALUE datetime_time_from_epoch_usec(int64_t usec, int offset, int utc) {
+  struct timespec ts;
+  ts.tv_sec  = (time_t)datetime_floor_div(usec, 1000000);
+  ts.tv_nsec = (long)(usec - (int64_t)ts.tv_sec * 1000000) * 1000;
+  return rb_time_timespec_new(&ts, utc ? INT_MAX - 1 : offset);
+}
+
+VALUE datetime_date_from_days(int64_t days) {
+  int year, month, day;
+  datetime_civil_from_days(days, &year, &month, &day);
+  return rb_funcall(cRubyDate, fcivil, 3, INT2FIX(year), INT2FIX(month), INT2FIX(day));
+}
+
 VALUE rb_datetime_parse(VALUE self, VALUE string) {
   VALUE datetime;
   const char *data = CSTRING(string);
@@ -94,11 +242,15 @@ void init_swift_datetime() {
   mSwift          = rb_define_module("Swift");
   cDateTime       = CONST_GET(rb_mKernel, "DateTime");
   cSwiftDateTime  = rb_define_class_under(mSwift, "DateTime", cDateTime);
+  cRubyDate       = CONST_GET(rb_mKernel, "Date");
   fcivil          = rb_intern("civil");
   fparse          = rb_intern("parse");
   fstrptime       = rb_intern("strptime");
   day_seconds     = INT2FIX(86400);
+  day_offset      = Qnil;
 
   rb_global_variable(&day_seconds);
+  rb_global_variable(&day_offset);
+  rb_global_variable(&cRubyDate);
   rb_define_singleton_method(cSwiftDateTime, "parse", RUBY_METHOD_FUNC(rb_datetime_parse), 1);
 }
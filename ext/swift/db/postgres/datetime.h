@@ -9,3 +9,10 @@
 extern VALUE cSwiftDateTime;
 void init_swift_datetime();
 VALUE datetime_parse(VALUE klass, const char *data, size_t size);
+VALUE datetime_civil(VALUE klass, int year, int month, int day, int hour, int min, double seconds, int offset);
+VALUE datetime_from_epoch_usec(VALUE klass, int64_t usec, int offset);
+VALUE datetime_time_from_epoch_usec(int64_t usec, int offset, int utc);
+VALUE datetime_date_from_days(int64_t days);
+void  datetime_civil_from_days(int64_t days, int *year, int *month, int *day);
+int64_t datetime_days_from_civil(int64_t year, int month, int day);
+int   datetime_parse_usec(const char *data, size_t size, int64_t *usec, int *offset);
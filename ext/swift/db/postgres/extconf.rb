@@ -35,4 +35,12 @@ find_header 'libpq-fe.h',  *inc_paths.dup.unshift(libpq_inc).compact
 find_library 'uuid', 'main', *lib_paths.dup.unshift(uuid_lib).compact
 find_library 'pq',   'main', *lib_paths.dup.unshift(libpq_lib).compact
 
+have_func 'rb_hash_new_capa'
+have_func 'rb_hash_bulk_insert'
+have_func 'rb_enc_interned_str',        'ruby/encoding.h'
+have_func 'rb_io_descriptor',           'ruby/io.h'
+have_func 'rb_fiber_scheduler_current', 'ruby/fiber/scheduler.h'
+have_func 'rb_gc_adjust_memory_usage'
+have_func 'PQresultMemorySize',         'libpq-fe.h'
+
 create_makefile('swift_db_postgres_ext')
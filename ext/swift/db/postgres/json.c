@@ -0,0 +1,308 @@
+// vim:ts=4:sts=4:sw=4:expandtab
+
+// (c) Bharanee Rathna 2012
+
+#include "json.h"
+#include <stdlib.h>
+
+/*
+ * Recursive descent parser over the result buffer. The input is bounded by its size rather than a NUL so it works
+ * on binary values and array elements alike. Object keys are frozen and deduplicated, or symbols when asked for.
+ */
+
+/* same nesting limit as the json gem */
+#define JSON_MAX_DEPTH  (100)
+#define JSON_NUMBER_MAX (64)
+
+typedef struct JSON {
+    const char *cursor;
+    const char *end;
+    int options;
+    int depth;
+} JSON;
+
+static VALUE json_value(JSON *j);
+
+static inline void json_skip_whitespace(JSON *j) {
+    while (j->cursor < j->end && (*j->cursor == ' ' || *j->cursor == '\n' || *j->cursor == '\r' || *j->cursor == '\t'))
+        j->cursor++;
+}
+
+static inline int json_literal(JSON *j, const char *literal, size_t size) {
+    if ((size_t)(j->end - j->cursor) < size || memcmp(j->cursor, literal, size) != 0)
+        return 0;
+    j->cursor += size;
+    return 1;
+}
+
+static int json_hex4(const char *data, unsigned int *code) {
+    int n;
+    char c;
+
+    for (*code = 0, n = 0; n < 4; n++) {
+        c = data[n];
+        if (c >= '0' && c <= '9')
+            *code = *code << 4 | (c - '0');
+        else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+            *code = *code << 4 | ((c | 0x20) - 'a' + 10);
+        else
+            return 0;
+    }
+    return 1;
+}
+
+static char* json_utf8(char *buffer, unsigned int code) {
+    if (code < 0x80) {
+        *buffer++ = code;
+    }
+    else if (code < 0x800) {
+        *buffer++ = 0xc0 | code >> 6;
+        *buffer++ = 0x80 | (code & 0x3f);
+    }
+    else if (code < 0x10000) {
+        *buffer++ = 0xe0 | code >> 12;
+        *buffer++ = 0x80 | (code >> 6 & 0x3f);
+        *buffer++ = 0x80 | (code & 0x3f);
+    }
+    else {
+        *buffer++ = 0xf0 | code >> 18;
+        *buffer++ = 0x80 | (code >> 12 & 0x3f);
+        *buffer++ = 0x80 | (code >> 6 & 0x3f);
+        *buffer++ = 0x80 | (code & 0x3f);
+    }
+    return buffer;
+}
+
+/* unescapes into buffer, which never needs to be larger than the escaped text */
+static long json_unescape(const char *data, const char *end, char *buffer) {
+    char *ptr = buffer;
+    unsigned int code, low;
+
+    while (data < end) {
+        if (*data != '\\') {
+            *ptr++ = *data++;
+            continue;
+        }
+        if (++data >= end)
+            return -1;
+        switch (*data++) {
+            case '"':  *ptr++ = '"';  break;
+            case '\\': *ptr++ = '\\'; break;
+            case '/':  *ptr++ = '/';  break;
+            case 'b':  *ptr++ = '\b'; break;
+            case 'f':  *ptr++ = '\f'; break;
+            case 'n':  *ptr++ = '\n'; break;
+            case 'r':  *ptr++ = '\r'; break;
+            case 't':  *ptr++ = '\t'; break;
+            case 'u':
+                if (end - data < 4 || !json_hex4(data, &code))
+                    return -1;
+                data += 4;
+                /* surrogate pair, a lone surrogate becomes U+FFFD */
+                if (code >= 0xd800 && code <= 0xdbff) {
+                    if (end - data >= 6 && data[0] == '\\' && data[1] == 'u' && json_hex4(data + 2, &low)
+                        && low >= 0xdc00 && low <= 0xdfff) {
+                        code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                        data += 6;
+                    }
+                    else
+                        code = 0xfffd;
+                }
+                else if (code >= 0xdc00 && code <= 0xdfff)
+                    code = 0xfffd;
+                ptr = json_utf8(ptr, code);
+                break;
+            default:
+                return -1;
+        }
+    }
+
+    return ptr - buffer;
+}
+
+static VALUE json_key(JSON *j, const char *data, long size) {
+#ifdef HAVE_RB_ENC_INTERNED_STR
+    VALUE key = rb_enc_interned_str(data, size, rb_utf8_encoding());
+#else
+    VALUE key = rb_obj_freeze(rb_enc_str_new(data, size, rb_utf8_encoding()));
+#endif
+    return (j->options & JSON_SYMBOLIZE_KEYS) ? rb_str_intern(key) : key;
+}
+
+static VALUE json_string(JSON *j, int key) {
+    const char *start = ++j->cursor;
+    int escaped = 0;
+    long size;
+    char *buffer;
+    VALUE value, tmp;
+
+    while (j->cursor < j->end && *j->cursor != '"') {
+        if (*j->cursor == '\\') {
+            escaped = 1;
+            j->cursor++;
+        }
+        j->cursor++;
+    }
+    if (j->cursor >= j->end)
+        return Qundef;
+
+    if (!escaped) {
+        j->cursor++;
+        return key ? json_key(j, start, j->cursor - start - 1) : rb_enc_str_new(start, j->cursor - start - 1, rb_utf8_encoding());
+    }
+
+    buffer = ALLOCV_N(char, tmp, j->cursor - start);
+    if ((size = json_unescape(start, j->cursor, buffer)) < 0)
+        value = Qundef;
+    else
+        value = key ? json_key(j, buffer, size) : rb_enc_str_new(buffer, size, rb_utf8_encoding());
+    ALLOCV_END(tmp);
+
+    j->cursor++;
+    return value;
+}
+
+static VALUE json_number(JSON *j) {
+    const char *start = j->cursor;
+    char buffer[JSON_NUMBER_MAX + 1];
+    int integer = 1, digits = 0;
+    uint64_t value = 0;
+    size_t size;
+
+    if (j->cursor < j->end && *j->cursor == '-')
+        j->cursor++;
+    while (j->cursor < j->end && *j->cursor >= '0' && *j->cursor <= '9') {
+        value = value * 10 + (*j->cursor++ - '0');
+        digits++;
+    }
+    if (!digits)
+        return Qundef;
+
+    if (j->cursor < j->end && *j->cursor == '.') {
+        integer = 0;
+        for (j->cursor++; j->cursor < j->end && *j->cursor >= '0' && *j->cursor <= '9'; j->cursor++)
+            ;
+    }
+    if (j->cursor < j->end && (*j->cursor == 'e' || *j->cursor == 'E')) {
+        integer = 0;
+        j->cursor++;
+        if (j->cursor < j->end && (*j->cursor == '+' || *j->cursor == '-'))
+            j->cursor++;
+        for (; j->cursor < j->end && *j->cursor >= '0' && *j->cursor <= '9'; j->cursor++)
+            ;
+    }
+
+    /* anything up to 18 digits fits in an int64 */
+    if (integer && digits <= 18)
+        return LL2NUM(*start == '-' ? -(int64_t)value : (int64_t)value);
+
+    size = j->cursor - start;
+    if (size > JSON_NUMBER_MAX) {
+        VALUE text = rb_str_new(start, size);
+        return integer ? rb_str_to_inum(text, 10, 0) : rb_float_new(rb_cstr_to_dbl(RSTRING_PTR(text), 0));
+    }
+
+    memcpy(buffer, start, size);
+    buffer[size] = 0;
+    return integer ? rb_cstr2inum(buffer, 10) : rb_float_new(strtod(buffer, 0));
+}
+
+static VALUE json_array(JSON *j) {
+    VALUE value, list = rb_ary_new();
+
+    j->cursor++;
+    json_skip_whitespace(j);
+    if (j->cursor < j->end && *j->cursor == ']') {
+        j->cursor++;
+        return list;
+    }
+
+    while (1) {
+        if ((value = json_value(j)) == Qundef)
+            return Qundef;
+        rb_ary_push(list, value);
+
+        json_skip_whitespace(j);
+        if (j->cursor >= j->end)
+            return Qundef;
+        if (*j->cursor == ']') {
+            j->cursor++;
+            return list;
+        }
+        if (*j->cursor++ != ',')
+            return Qundef;
+    }
+}
+
+static VALUE json_object(JSON *j) {
+    VALUE key, value, hash = rb_hash_new();
+
+    j->cursor++;
+    json_skip_whitespace(j);
+    if (j->cursor < j->end && *j->cursor == '}') {
+        j->cursor++;
+        return hash;
+    }
+
+    while (1) {
+        json_skip_whitespace(j);
+        if (j->cursor >= j->end || *j->cursor != '"' || (key = json_string(j, 1)) == Qundef)
+            return Qundef;
+
+        json_skip_whitespace(j);
+        if (j->cursor >= j->end || *j->cursor++ != ':')
+            return Qundef;
+        if ((value = json_value(j)) == Qundef)
+            return Qundef;
+        rb_hash_aset(hash, key, value);
+
+        json_skip_whitespace(j);
+        if (j->cursor >= j->end)
+            return Qundef;
+        if (*j->cursor == '}') {
+            j->cursor++;
+            return hash;
+        }
+        if (*j->cursor++ != ',')
+            return Qundef;
+    }
+}
+
+static VALUE json_value(JSON *j) {
+    VALUE value;
+
+    json_skip_whitespace(j);
+    if (j->cursor >= j->end)
+        return Qundef;
+
+    switch (*j->cursor) {
+        case '{':
+        case '[':
+            if (++j->depth > JSON_MAX_DEPTH)
+                return Qundef;
+            value = *j->cursor == '{' ? json_object(j) : json_array(j);
+            j->depth--;
+            return value;
+        case '"':
+            return json_string(j, 0);
+        case 't':
+            return json_literal(j, "true", 4) ? Qtrue : Qundef;
+        case 'f':
+            return json_literal(j, "false", 5) ? Qfalse : Qundef;
+        case 'n':
+            return json_literal(j, "null", 4) ? Qnil : Qundef;
+        default:
+            return json_number(j);
+    }
+}
+
+VALUE json_parse(const char *data, size_t size, int options) {
+    VALUE value;
+    JSON j = {data, data + size, options, 0};
+
+    if ((value = json_value(&j)) == Qundef)
+        return Qundef;
+
+    json_skip_whitespace(&j);
+    return j.cursor == j.end ? value : Qundef;
+}
@@ -0,0 +1,12 @@
+// vim:ts=4:sts=4:sw=4:expandtab
+
+// (c) Bharanee Rathna 2012
+
+#pragma once
+
+#include "common.h"
+
+#define JSON_SYMBOLIZE_KEYS (1 << 0)
+
+/* parses size bytes of json text, returns Qundef if it is not valid json */
+DLL_PRIVATE VALUE json_parse(const char *data, size_t size, int options);
@@ -5,8 +5,12 @@
 #include "common.h"
 #include "adapter.h"
 #include "statement.h"
+#include "pipeline.h"
+#include "pool.h"
 #include "result.h"
 #include "datetime.h"
+#include "typecast.h"
+#include "types.h"
 
 VALUE mSwift, mDB;
 VALUE eSwiftError, eSwiftArgumentError, eSwiftRuntimeError, eSwiftConnectionError;
@@ -22,7 +26,10 @@ void Init_swift_db_postgres_ext() {
 
     init_swift_db_postgres_adapter();
     init_swift_db_postgres_statement();
+    init_swift_db_postgres_pipeline();
+    init_swift_db_postgres_pool();
     init_swift_db_postgres_result();
     init_swift_datetime();
     init_swift_db_postgres_typecast();
+    init_swift_db_postgres_types();
 }
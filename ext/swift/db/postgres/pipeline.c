@@ -0,0 +1,217 @@
+// vim:ts=4:sts=4:sw=4:expandtab
+
+// (c) Bharanee Rathna 2012
+
+#include "pipeline.h"
+#include "adapter.h"
+#include "bind.h"
+
+/* declaration */
+
+VALUE cDPP;
+
+VALUE db_postgres_result_allocate(VALUE);
+VALUE db_postgres_result_load(VALUE, PGresult*, Adapter*);
+int   db_postgres_statement_send(VALUE, VALUE);
+
+typedef struct Pipeline {
+    VALUE adapter;
+    long deferred;
+    int queued;
+    int synced;
+    int open;
+} Pipeline;
+
+/* definition */
+
+Pipeline* db_postgres_pipeline_handle(VALUE self) {
+    Pipeline *p;
+    Data_Get_Struct(self, Pipeline, p);
+    if (!p)
+        rb_raise(eSwiftRuntimeError, "Invalid postgres pipeline");
+    return p;
+}
+
+Pipeline* db_postgres_pipeline_handle_safe(VALUE self) {
+    Pipeline *p = db_postgres_pipeline_handle(self);
+    if (!p->open)
+        rb_raise(eSwiftRuntimeError, "postgres pipeline is closed");
+    return p;
+}
+
+void db_postgres_pipeline_mark(Pipeline *p) {
+    if (p && p->adapter)
+        rb_gc_mark(p->adapter);
+}
+
+VALUE db_postgres_pipeline_deallocate(Pipeline *p) {
+    if (p)
+        free(p);
+    return Qtrue;
+}
+
+VALUE db_postgres_pipeline_allocate(VALUE klass) {
+    Pipeline *p = (Pipeline*)malloc(sizeof(Pipeline));
+    if (!p)
+        rb_raise(rb_eNoMemError, "pipeline");
+
+    memset(p, 0, sizeof(Pipeline));
+    return Data_Wrap_Struct(klass, db_postgres_pipeline_mark, db_postgres_pipeline_deallocate, p);
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+
+VALUE db_postgres_pipeline_execute(int argc, VALUE *argv, VALUE self) {
+    Bind b;
+    int ok;
+    VALUE sql, bind;
+    Pipeline *p = db_postgres_pipeline_handle_safe(self);
+    Adapter *a  = db_postgres_adapter_handle_safe(p->adapter);
+
+    rb_scan_args(argc, argv, "10*", &sql, &bind);
+
+    if (rb_obj_is_kind_of(sql, cDPS))
+        ok = db_postgres_statement_send(sql, bind);
+    else {
+        if (!a->native)
+            sql = db_postgres_adapter_normalized_sql(a, sql);
+
+        db_postgres_bind_encode(&b, a, bind, a->binary_params, 0);
+
+        ok = PQsendQueryParams(a->connection, RSTRING_PTR(sql), b.n_args, b.types,
+            (const char* const *)b.data, b.size, b.format, a->binary);
+
+        RB_GC_GUARD(b.values);
+        RB_GC_GUARD(bind);
+        db_postgres_bind_free(&b);
+    }
+
+    if (!ok)
+        rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(a->connection));
+
+    p->queued++;
+    return self;
+}
+
+static VALUE db_postgres_pipeline_results(VALUE self) {
+    int n;
+    VALUE results, value;
+    PGresult *result, *rest, *error = 0;
+    Pipeline *p = db_postgres_pipeline_handle(self);
+    Adapter *a  = db_postgres_adapter_handle_safe(p->adapter);
+
+    /* transaction control waiting on the next statement goes out at the head of the pipeline */
+    p->deferred = db_postgres_adapter_deferred_send(a);
+    rb_yield(self);
+
+    if (!PQpipelineSync(a->connection))
+        rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(a->connection));
+
+    p->synced = 1;
+    db_postgres_adapter_flush(a);
+
+    /* a failed command aborts everything after it, its error says more than the aborted statements would */
+    for (n = 0; n < p->deferred; n++) {
+        while ((result = db_postgres_adapter_next_result(a))) {
+            if (!error && PQresultStatus(result) == PGRES_FATAL_ERROR)
+                error = result;
+            else
+                PQclear(result);
+        }
+    }
+    if (error)
+        db_postgres_check_result(error);
+
+    results = rb_ary_new();
+    for (n = 0; n < p->queued; n++) {
+        if (!(result = db_postgres_adapter_next_result(a)))
+            rb_raise(eSwiftConnectionError, "%s", PQerrorMessage(a->connection));
+
+        if (PQresultStatus(result) == PGRES_PIPELINE_ABORTED)
+            value = rb_exc_new2(eSwiftRuntimeError, "pipeline aborted, an earlier statement failed");
+        else
+            value = db_postgres_result_error(result);
+
+        if (NIL_P(value))
+            value = db_postgres_result_load(db_postgres_result_allocate(cDPR), result, a);
+        else
+            PQclear(result);
+
+        rb_ary_push(results, value);
+
+        /* each statement is terminated by a NULL result */
+        while ((rest = db_postgres_adapter_next_result(a)))
+            PQclear(rest);
+    }
+
+    return results;
+}
+
+/* discards anything left in the pipeline if the block raised, and switches the connection back to normal mode */
+static VALUE db_postgres_pipeline_close(VALUE self) {
+    ExecStatusType status;
+    PGresult *result;
+    Pipeline *p = db_postgres_pipeline_handle(self);
+    Adapter *a  = db_postgres_adapter_handle(p->adapter);
+
+    p->open = 0;
+    if (!a->connection || PQpipelineStatus(a->connection) == PQ_PIPELINE_OFF)
+        return Qnil;
+
+    PQsetnonblocking(a->connection, 0);
+    if (p->synced || PQpipelineSync(a->connection)) {
+        while (PQstatus(a->connection) == CONNECTION_OK) {
+            if (!(result = PQgetResult(a->connection)))
+                continue;
+            status = PQresultStatus(result);
+            PQclear(result);
+            if (status == PGRES_PIPELINE_SYNC)
+                break;
+        }
+    }
+
+    PQexitPipelineMode(a->connection);
+    return Qnil;
+}
+
+VALUE db_postgres_pipeline_run(VALUE adapter) {
+    VALUE self;
+    Pipeline *p;
+    Adapter *a = db_postgres_adapter_handle_safe(adapter);
+
+    if (!rb_block_given_p())
+        rb_raise(eSwiftArgumentError, "#pipeline requires a block");
+
+    if (!PQenterPipelineMode(a->connection))
+        rb_raise(eSwiftRuntimeError, "unable to enter pipeline mode: %s", PQerrorMessage(a->connection));
+
+    if (PQsetnonblocking(a->connection, 1) != 0) {
+        PQexitPipelineMode(a->connection);
+        rb_raise(eSwiftRuntimeError, "%s", PQerrorMessage(a->connection));
+    }
+
+    self       = db_postgres_pipeline_allocate(cDPP);
+    p          = db_postgres_pipeline_handle(self);
+    p->adapter = adapter;
+    p->open    = 1;
+
+    return rb_ensure(db_postgres_pipeline_results, self, db_postgres_pipeline_close, self);
+}
+
+#else
+
+VALUE db_postgres_pipeline_execute(int argc, VALUE *argv, VALUE self) {
+    rb_raise(rb_eNotImpError, "pipeline mode requires libpq 14 or later");
+}
+
+VALUE db_postgres_pipeline_run(VALUE adapter) {
+    rb_raise(rb_eNotImpError, "pipeline mode requires libpq 14 or later");
+}
+
+#endif
+
+void init_swift_db_postgres_pipeline() {
+    cDPP = rb_define_class_under(cDPA, "Pipeline", rb_cObject);
+    rb_undef_alloc_func(cDPP);
+    rb_define_method(cDPP, "execute", db_postgres_pipeline_execute, -1);
+}
@@ -0,0 +1,10 @@
+// vim:ts=4:sts=4:sw=4:expandtab
+
+// (c) Bharanee Rathna 2012
+
+#pragma once
+
+#include "common.h"
+
+DLL_PRIVATE VALUE db_postgres_pipeline_run(VALUE);
+void init_swift_db_postgres_pipeline();
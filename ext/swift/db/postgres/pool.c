@@ -0,0 +1,602 @@
+// vim:ts=4:sts=4:sw=4:expandtab
+
+// (c) Bharanee Rathna 2012
+
+#include "pool.h"
+#include "adapter.h"
+
+#include <time.h>
+
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+#include <ruby/fiber/scheduler.h>
+#endif
+
+/* declaration */
+
+VALUE cDPO;
+
+VALUE db_postgres_adapter_s_connect(VALUE, VALUE, VALUE);
+VALUE db_postgres_adapter_close(VALUE);
+
+/* an idle connection, reset is set while the result of the reset query sent on checkin is still unread */
+typedef struct PoolEntry {
+    VALUE adapter;
+    double since;
+    int reset;
+} PoolEntry;
+
+/*
+ * Lives on the stack of the waiting thread. Checkin hands the connection over directly and a slot freed by a
+ * discarded connection is reserved for the waiter, so a newcomer can't take either first and waiters are served FIFO.
+ */
+typedef struct PoolWaiter {
+    VALUE thread;
+    VALUE fiber;
+    VALUE scheduler;
+    PoolEntry entry;
+    int handed;
+    int slot;
+    int notified;
+    int queued;
+    struct PoolWaiter *next;
+} PoolWaiter;
+
+typedef struct Pool {
+    VALUE options;
+    VALUE reset;
+    VALUE rollback;
+    PoolEntry *idle;
+    PoolWaiter *head, *tail;
+    int min, max, size, idle_count, in_use, waiting, peak, open;
+    double timeout, health_check, created, changed;
+    /* adapter settings as connected, restored on checkin */
+    int native, binary, binary_params, typecast, chunk_size, settings;
+    size_t max_result_size;
+    size_t checkouts, waits, timeouts, resets, health_checks, discarded;
+    double wait_time, max_wait_time, busy_time;
+} Pool;
+
+typedef struct PoolSleep {
+    VALUE self;
+    PoolWaiter *waiter;
+    /* checkout timeout for this call, negative waits forever */
+    double timeout;
+    double deadline;
+} PoolSleep;
+
+/* definition */
+
+static double db_postgres_pool_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+Pool* db_postgres_pool_handle(VALUE self) {
+    Pool *p;
+    Data_Get_Struct(self, Pool, p);
+    if (!p)
+        rb_raise(eSwiftRuntimeError, "Invalid postgres pool");
+    return p;
+}
+
+Pool* db_postgres_pool_handle_safe(VALUE self) {
+    Pool *p = db_postgres_pool_handle(self);
+    if (!p->open)
+        rb_raise(eSwiftConnectionError, "postgres pool is closed");
+    return p;
+}
+
+void db_postgres_pool_mark(Pool *p) {
+    int n;
+    if (p) {
+        rb_gc_mark(p->options);
+        rb_gc_mark(p->reset);
+        rb_gc_mark(p->rollback);
+        for (n = 0; n < p->idle_count; n++)
+            rb_gc_mark(p->idle[n].adapter);
+    }
+}
+
+VALUE db_postgres_pool_deallocate(Pool *p) {
+    if (p) {
+        if (p->idle)
+            free(p->idle);
+        free(p);
+    }
+    return Qtrue;
+}
+
+VALUE db_postgres_pool_allocate(VALUE klass) {
+    Pool *p = (Pool*)malloc(sizeof(Pool));
+    if (!p)
+        rb_raise(rb_eNoMemError, "pool");
+
+    memset(p, 0, sizeof(Pool));
+    p->options  = Qnil;
+    p->reset    = Qnil;
+    p->rollback = Qnil;
+    return Data_Wrap_Struct(klass, db_postgres_pool_mark, db_postgres_pool_deallocate, p);
+}
+
+/* connection seconds spent checked out, the basis for utilization */
+static void db_postgres_pool_account(Pool *p) {
+    double now = db_postgres_pool_now();
+    p->busy_time += p->in_use * (now - p->changed);
+    p->changed    = now;
+}
+
+static void db_postgres_pool_wake(VALUE self, PoolWaiter *w) {
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+    if (!NIL_P(w->scheduler)) {
+        rb_fiber_scheduler_unblock(w->scheduler, self, w->fiber);
+        return;
+    }
+#endif
+    rb_thread_wakeup_alive(w->thread);
+}
+
+static PoolWaiter* db_postgres_pool_dequeue(Pool *p) {
+    PoolWaiter *w = p->head;
+    if (w) {
+        p->head   = w->next;
+        p->tail   = p->head ? p->tail : 0;
+        w->queued = 0;
+        p->waiting--;
+    }
+    return w;
+}
+
+static void db_postgres_pool_unlink(Pool *p, PoolWaiter *w) {
+    PoolWaiter *prev = 0, *curr;
+
+    for (curr = p->head; curr && curr != w; prev = curr, curr = curr->next)
+        ;
+    if (!curr)
+        return;
+
+    if (prev)
+        prev->next = w->next;
+    else
+        p->head = w->next;
+    if (p->tail == w)
+        p->tail = prev;
+
+    w->queued = 0;
+    p->waiting--;
+}
+
+/* a slot opened up, it is counted for the first waiter right away and the waiter connects once it runs */
+static void db_postgres_pool_notify(VALUE self, Pool *p) {
+    PoolWaiter *w = db_postgres_pool_dequeue(p);
+    if (w) {
+        w->slot = 1;
+        p->size++;
+        db_postgres_pool_wake(self, w);
+    }
+}
+
+static void db_postgres_pool_drop(Pool *p, VALUE adapter) {
+    db_postgres_adapter_handle(adapter)->pool = 0;
+    db_postgres_adapter_close(adapter);
+    p->size--;
+    p->discarded++;
+}
+
+static void db_postgres_pool_discard(VALUE self, Pool *p, VALUE adapter) {
+    db_postgres_pool_drop(p, adapter);
+    db_postgres_pool_notify(self, p);
+}
+
+/* hands the connection to the first waiter or parks it as idle */
+static void db_postgres_pool_release(VALUE self, Pool *p, PoolEntry entry) {
+    PoolWaiter *w;
+
+    if (!p->open) {
+        db_postgres_pool_discard(self, p, entry.adapter);
+        return;
+    }
+
+    if ((w = db_postgres_pool_dequeue(p))) {
+        w->entry  = entry;
+        w->handed = 1;
+        db_postgres_pool_wake(self, w);
+        return;
+    }
+
+    p->idle[p->idle_count++] = entry;
+}
+
+static VALUE db_postgres_pool_lend(Pool *p, VALUE adapter) {
+    db_postgres_adapter_handle(adapter)->checked_out = 1;
+
+    db_postgres_pool_account(p);
+    p->in_use++;
+    p->checkouts++;
+    if (p->in_use > p->peak)
+        p->peak = p->in_use;
+    return adapter;
+}
+
+static void db_postgres_pool_adopt(VALUE self, Pool *p, VALUE adapter) {
+    Adapter *a = db_postgres_adapter_handle(adapter);
+
+    a->pool = self;
+    if (!p->settings) {
+        p->native        = a->native;
+        p->binary        = a->binary;
+        p->binary_params = a->binary_params;
+        p->typecast      = a->typecast;
+        p->chunk_size    = a->chunk_size;
+        p->max_result_size = a->max_result_size;
+        p->settings      = 1;
+    }
+}
+
+static VALUE db_postgres_pool_connect(VALUE self) {
+    VALUE adapter = rb_class_new_instance(1, &db_postgres_pool_handle(self)->options, cDPA);
+    db_postgres_pool_adopt(self, db_postgres_pool_handle(self), adapter);
+    return adapter;
+}
+
+/* reads the reset result left from checkin and pings connections that sat idle for too long */
+static VALUE db_postgres_pool_check(VALUE ptr) {
+    int ok = 1;
+    PGresult *result;
+    PoolEntry *e = (PoolEntry *)ptr;
+    Adapter *a   = db_postgres_adapter_handle(e->adapter);
+    Pool *p      = db_postgres_pool_handle(a->pool);
+
+    if (e->reset) {
+        while ((result = db_postgres_adapter_next_result(a))) {
+            ok = ok && PQresultStatus(result) == PGRES_COMMAND_OK;
+            PQclear(result);
+        }
+        e->reset = 0;
+    }
+    if (ok && p->health_check >= 0 && db_postgres_pool_now() - e->since >= p->health_check) {
+        p->health_checks++;
+        result = db_postgres_adapter_exec_sql(a, "");
+        ok = result && PQresultStatus(result) == PGRES_EMPTY_QUERY;
+        PQclear(result);
+    }
+
+    return ok && PQstatus(a->connection) == CONNECTION_OK ? Qtrue : Qfalse;
+}
+
+/* returns the connection ready for use or nil when it had to be dropped, the caller then takes the freed slot */
+static VALUE db_postgres_pool_prepare(VALUE self, Pool *p, PoolEntry entry) {
+    int status;
+    VALUE ok = rb_protect(db_postgres_pool_check, (VALUE)&entry, &status);
+
+    if (status) {
+        db_postgres_pool_discard(self, p, entry.adapter);
+        rb_jump_tag(status);
+    }
+    if (!RTEST(ok)) {
+        db_postgres_pool_drop(p, entry.adapter);
+        return Qnil;
+    }
+    return db_postgres_pool_lend(p, entry.adapter);
+}
+
+/* connects for a slot already counted in size, the slot goes to the next waiter if that fails */
+static VALUE db_postgres_pool_open(VALUE self, Pool *p) {
+    int status;
+    VALUE adapter = rb_protect(db_postgres_pool_connect, self, &status);
+
+    if (status) {
+        p->size--;
+        db_postgres_pool_notify(self, p);
+        rb_jump_tag(status);
+    }
+    return db_postgres_pool_lend(p, adapter);
+}
+
+static VALUE db_postgres_pool_sleep(VALUE ptr) {
+    double remaining;
+    struct timeval tv;
+    PoolSleep *s  = (PoolSleep *)ptr;
+    PoolWaiter *w = s->waiter;
+
+    while (!w->handed && !w->slot && !w->notified) {
+        remaining = s->deadline - db_postgres_pool_now();
+        if (s->timeout >= 0 && remaining <= 0)
+            break;
+
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+        if (!NIL_P(w->scheduler)) {
+            rb_fiber_scheduler_block(w->scheduler, s->self, s->timeout < 0 ? Qnil : DBL2NUM(remaining));
+            continue;
+        }
+#endif
+        if (s->timeout < 0)
+            rb_thread_sleep_forever();
+        else {
+            tv.tv_sec  = (time_t)remaining;
+            tv.tv_usec = (long)((remaining - tv.tv_sec) * 1e6);
+            rb_thread_wait_for(tv);
+        }
+    }
+
+    return Qnil;
+}
+
+/* queues the caller and sleeps until a connection is handed over, a slot opens up or the timeout runs out */
+static int db_postgres_pool_wait(VALUE self, Pool *p, PoolWaiter *w, double timeout, double deadline) {
+    int status;
+    PoolSleep s = {self, w, timeout, deadline};
+
+    memset(w, 0, sizeof(PoolWaiter));
+    w->thread    = rb_thread_current();
+    w->fiber     = Qnil;
+    w->scheduler = db_postgres_adapter_scheduler();
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+    if (!NIL_P(w->scheduler))
+        w->fiber = rb_fiber_current();
+#endif
+
+    w->queued = 1;
+    if (p->tail)
+        p->tail->next = w;
+    else
+        p->head = w;
+    p->tail = w;
+    p->waiting++;
+
+    rb_protect(db_postgres_pool_sleep, (VALUE)&s, &status);
+    if (w->queued)
+        db_postgres_pool_unlink(p, w);
+
+    /* interrupted after being served, pass it on */
+    if (status) {
+        if (w->handed)
+            db_postgres_pool_release(self, p, w->entry);
+        else if (w->slot) {
+            p->size--;
+            db_postgres_pool_notify(self, p);
+        }
+        rb_jump_tag(status);
+    }
+
+    return w->handed || w->slot || w->notified;
+}
+
+VALUE db_postgres_pool_checkout(int argc, VALUE *argv, VALUE self) {
+    int waited = 0;
+    double start, timeout, deadline;
+    VALUE adapter, arg;
+    PoolWaiter w;
+    Pool *p = db_postgres_pool_handle_safe(self);
+
+    rb_scan_args(argc, argv, "01", &arg);
+    timeout  = NIL_P(arg) ? p->timeout : NUM2DBL(arg);
+    start    = db_postgres_pool_now();
+    deadline = start + timeout;
+
+    while (1) {
+        if (!p->open)
+            rb_raise(eSwiftConnectionError, "postgres pool is closed");
+
+        if (p->idle_count > 0) {
+            if (!NIL_P(adapter = db_postgres_pool_prepare(self, p, p->idle[--p->idle_count])))
+                break;
+            continue;
+        }
+
+        if (p->size < p->max) {
+            p->size++;
+            adapter = db_postgres_pool_open(self, p);
+            break;
+        }
+
+        waited = 1;
+        if (!db_postgres_pool_wait(self, p, &w, timeout, deadline)) {
+            p->waits++;
+            p->timeouts++;
+            rb_raise(eSwiftConnectionError, "timed out after %.3fs waiting for a postgres connection", timeout);
+        }
+
+        if (w.slot) {
+            if (!p->open) {
+                p->size--;
+                rb_raise(eSwiftConnectionError, "postgres pool is closed");
+            }
+            adapter = db_postgres_pool_open(self, p);
+            break;
+        }
+
+        /* a bad connection frees its slot, the loop takes it before anyone else can */
+        if (w.handed && !NIL_P(adapter = db_postgres_pool_prepare(self, p, w.entry)))
+            break;
+    }
+
+    if (waited) {
+        start = db_postgres_pool_now() - start;
+        p->waits++;
+        p->wait_time    += start;
+        p->max_wait_time = start > p->max_wait_time ? start : p->max_wait_time;
+    }
+    return adapter;
+}
+
+/* rolls back open transactions and sends the reset query, its result is read on the next checkout */
+VALUE db_postgres_pool_checkin(VALUE self, VALUE adapter) {
+    PGTransactionStatusType status;
+    VALUE sql = Qnil;
+    PoolEntry entry = {adapter, 0, 0};
+    Pool *p = db_postgres_pool_handle(self);
+    Adapter *a;
+
+    if (!rb_obj_is_kind_of(adapter, cDPA))
+        rb_raise(eSwiftArgumentError, "checkin needs a Swift::DB::Postgres connection");
+
+    a = db_postgres_adapter_handle(adapter);
+    if (a->pool != self || !a->checked_out)
+        rb_raise(eSwiftArgumentError, "connection is not checked out from this pool");
+
+    db_postgres_pool_account(p);
+    p->in_use--;
+    a->checked_out = 0;
+
+    status = a->connection ? PQtransactionStatus(a->connection) : PQTRANS_UNKNOWN;
+    if (status == PQTRANS_UNKNOWN || status == PQTRANS_ACTIVE || PQstatus(a->connection) != CONNECTION_OK) {
+        db_postgres_pool_discard(self, p, adapter);
+        return Qtrue;
+    }
+
+    a->native        = p->native;
+    a->binary        = p->binary;
+    a->binary_params = p->binary_params;
+    a->typecast      = p->typecast;
+    a->chunk_size    = p->chunk_size;
+    a->max_result_size = p->max_result_size;
+    a->t_nesting     = 0;
+    a->t_begin       = 0;
+    if (a->deferred)
+        rb_ary_clear(a->deferred);
+
+    sql = status == PQTRANS_INTRANS || status == PQTRANS_INERROR ? p->rollback : p->reset;
+    if (!NIL_P(sql)) {
+        if (!PQsendQuery(a->connection, CSTRING(sql))) {
+            db_postgres_pool_discard(self, p, adapter);
+            return Qtrue;
+        }
+        entry.reset = 1;
+        p->resets++;
+    }
+
+    entry.since = db_postgres_pool_now();
+    db_postgres_pool_release(self, p, entry);
+    return Qtrue;
+}
+
+VALUE db_postgres_pool_with(int argc, VALUE *argv, VALUE self) {
+    int status;
+    VALUE adapter, result;
+
+    adapter = db_postgres_pool_checkout(argc, argv, self);
+    result  = rb_protect(rb_yield, adapter, &status);
+    db_postgres_pool_checkin(self, adapter);
+
+    if (status)
+        rb_jump_tag(status);
+    return result;
+}
+
+VALUE db_postgres_pool_initialize(VALUE self, VALUE options) {
+    long n;
+    VALUE timeout, health_check, reset, connections;
+    Pool *p = db_postgres_pool_handle(self);
+
+    if (TYPE(options) != T_HASH)
+        rb_raise(eSwiftArgumentError, "options needs to be a hash");
+
+    p->min       = NUM2INT(rb_hash_lookup2(options, ID2SYM(rb_intern("min")), INT2NUM(1)));
+    p->max       = NUM2INT(rb_hash_lookup2(options, ID2SYM(rb_intern("max")), INT2NUM(5)));
+    timeout      = rb_hash_lookup2(options, ID2SYM(rb_intern("checkout_timeout")), DBL2NUM(5));
+    health_check = rb_hash_lookup2(options, ID2SYM(rb_intern("health_check")),     DBL2NUM(30));
+    reset        = rb_hash_lookup2(options, ID2SYM(rb_intern("reset")),            rb_str_new2("reset all"));
+
+    if (p->max < 1)
+        rb_raise(eSwiftArgumentError, "pool max needs to be at least 1");
+    if (p->min < 0 || p->min > p->max)
+        rb_raise(eSwiftArgumentError, "pool min needs to be between 0 and max");
+
+    p->timeout      = NIL_P(timeout) ? -1 : NUM2DBL(timeout);
+    p->health_check = NIL_P(health_check) ? -1 : NUM2DBL(health_check);
+    p->options      = rb_hash_dup(options);
+    p->reset        = RTEST(reset) ? rb_obj_freeze(rb_str_dup(TO_S(reset))) : Qnil;
+    p->rollback     = rb_obj_freeze(NIL_P(p->reset) ? rb_str_new2("rollback") : rb_sprintf("rollback; %s", CSTRING(p->reset)));
+
+    p->idle = (PoolEntry *)malloc(sizeof(PoolEntry) * p->max);
+    if (!p->idle)
+        rb_raise(rb_eNoMemError, "pool");
+
+    p->created = p->changed = db_postgres_pool_now();
+    p->open    = 1;
+
+    /* the minimum connections are opened concurrently */
+    connections = db_postgres_adapter_s_connect(cDPA, INT2NUM(p->min), p->options);
+    for (n = 0; n < RARRAY_LEN(connections); n++) {
+        PoolEntry entry = {rb_ary_entry(connections, n), p->created, 0};
+        db_postgres_pool_adopt(self, p, entry.adapter);
+        p->idle[p->idle_count++] = entry;
+        p->size++;
+    }
+
+    return self;
+}
+
+VALUE db_postgres_pool_close(VALUE self) {
+    PoolWaiter *w;
+    Pool *p = db_postgres_pool_handle(self);
+
+    if (!p->open)
+        return Qfalse;
+
+    p->open = 0;
+    while (p->idle_count > 0) {
+        db_postgres_adapter_handle(p->idle[--p->idle_count].adapter)->pool = 0;
+        db_postgres_adapter_close(p->idle[p->idle_count].adapter);
+        p->size--;
+    }
+
+    /* waiters raise once they wake up and see the pool closed */
+    while ((w = db_postgres_pool_dequeue(p))) {
+        w->notified = 1;
+        db_postgres_pool_wake(self, w);
+    }
+    return Qtrue;
+}
+
+VALUE db_postgres_pool_closed_q(VALUE self) {
+    return db_postgres_pool_handle(self)->open ? Qfalse : Qtrue;
+}
+
+VALUE db_postgres_pool_size(VALUE self) {
+    return INT2NUM(db_postgres_pool_handle(self)->size);
+}
+
+VALUE db_postgres_pool_stats(VALUE self) {
+    double elapsed;
+    VALUE stats = rb_hash_new();
+    Pool *p = db_postgres_pool_handle(self);
+
+    db_postgres_pool_account(p);
+    elapsed = p->changed - p->created;
+
+    rb_hash_aset(stats, ID2SYM(rb_intern("size")),          INT2NUM(p->size));
+    rb_hash_aset(stats, ID2SYM(rb_intern("min")),           INT2NUM(p->min));
+    rb_hash_aset(stats, ID2SYM(rb_intern("max")),           INT2NUM(p->max));
+    rb_hash_aset(stats, ID2SYM(rb_intern("idle")),          INT2NUM(p->idle_count));
+    rb_hash_aset(stats, ID2SYM(rb_intern("in_use")),        INT2NUM(p->in_use));
+    rb_hash_aset(stats, ID2SYM(rb_intern("peak_in_use")),   INT2NUM(p->peak));
+    rb_hash_aset(stats, ID2SYM(rb_intern("waiting")),       INT2NUM(p->waiting));
+    rb_hash_aset(stats, ID2SYM(rb_intern("checkouts")),     SIZET2NUM(p->checkouts));
+    rb_hash_aset(stats, ID2SYM(rb_intern("waits")),         SIZET2NUM(p->waits));
+    rb_hash_aset(stats, ID2SYM(rb_intern("timeouts")),      SIZET2NUM(p->timeouts));
+    rb_hash_aset(stats, ID2SYM(rb_intern("wait_time")),     DBL2NUM(p->wait_time));
+    rb_hash_aset(stats, ID2SYM(rb_intern("max_wait_time")), DBL2NUM(p->max_wait_time));
+    rb_hash_aset(stats, ID2SYM(rb_intern("busy_time")),     DBL2NUM(p->busy_time));
+    rb_hash_aset(stats, ID2SYM(rb_intern("utilization")),   DBL2NUM(elapsed > 0 ? p->busy_time / (elapsed * p->max) : 0));
+    rb_hash_aset(stats, ID2SYM(rb_intern("resets")),        SIZET2NUM(p->resets));
+    rb_hash_aset(stats, ID2SYM(rb_intern("health_checks")), SIZET2NUM(p->health_checks));
+    rb_hash_aset(stats, ID2SYM(rb_intern("discarded")),     SIZET2NUM(p->discarded));
+    return stats;
+}
+
+void init_swift_db_postgres_pool() {
+    cDPO = rb_define_class_under(cDPA, "Pool", rb_cObject);
+
+    rb_define_alloc_func(cDPO, db_postgres_pool_allocate);
+
+    rb_define_method(cDPO, "initialize", db_postgres_pool_initialize,  1);
+    rb_define_method(cDPO, "checkout",   db_postgres_pool_checkout,   -1);
+    rb_define_method(cDPO, "checkin",    db_postgres_pool_checkin,     1);
+    rb_define_method(cDPO, "with",       db_postgres_pool_with,       -1);
+    rb_define_method(cDPO, "size",       db_postgres_pool_size,        0);
+    rb_define_method(cDPO, "stats",      db_postgres_pool_stats,       0);
+    rb_define_method(cDPO, "close",      db_postgres_pool_close,       0);
+    rb_define_method(cDPO, "closed?",    db_postgres_pool_closed_q,    0);
+}
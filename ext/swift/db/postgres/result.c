@@ -3,18 +3,44 @@
 // (c) Bharanee Rathna 2012
 
 #include "result.h"
+#include "adapter.h"
+#include "arrow.h"
+#include "types.h"
 #include <stdlib.h>
+#include <strings.h>
 
 /* declaration */
 
+/*
+ * Resolved once per result so the row loop does not need to look up field names or types. There is no nullability,
+ * the row description doesn't carry it and a NOT NULL table column still comes back NULL through an outer join, so
+ * every cell goes through PQgetisnull.
+ */
+typedef struct Column {
+    VALUE field;
+    VALUE type;
+    typecast_decoder decode;
+    /* element decoder for array columns */
+    typecast_decoder element;
+    /* decoder registered for the type with #register_type */
+    VALUE callable;
+    int format;
+} Column;
+
 typedef struct Result {
     PGresult *result;
     VALUE fields;
     VALUE types;
     VALUE decoder;
+    VALUE typemap;
+    Column *columns;
+    int n_columns;
     size_t selected;
     size_t affected;
     size_t insert_id;
+    size_t copied;
+    /* libpq memory held by result, as last reported to the GC */
+    size_t memsize;
 } Result;
 
 VALUE cDPR;
@@ -35,13 +61,55 @@ void db_postgres_result_mark(Result *r) {
             rb_gc_mark(r->fields);
         if (r->types)
             rb_gc_mark(r->types);
+        if (r->decoder)
+            rb_gc_mark(r->decoder);
+        if (r->typemap)
+            rb_gc_mark(r->typemap);
+        for (int n = 0; n < r->n_columns; n++) {
+            if (r->columns[n].callable)
+                rb_gc_mark(r->columns[n].callable);
+        }
+    }
+}
+
+#ifndef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+#define rb_gc_adjust_memory_usage(diff)
+#endif
+
+/* estimate for libpq before 12, the tuple pointers and values with their NUL terminators */
+static size_t db_postgres_result_memory_size(PGresult *result) {
+#ifdef HAVE_PQRESULTMEMORYSIZE
+    return PQresultMemorySize(result);
+#else
+    int row, col, rows = PQntuples(result), cols = PQnfields(result);
+    size_t size = sizeof(char *) * 2 * (rows + 1) * (cols + 1);
+
+    for (row = 0; row < rows; row++) {
+        for (col = 0; col < cols; col++)
+            size += PQgetlength(result, row, col) + 1;
     }
+    return size;
+#endif
+}
+
+/*
+ * The GC only sees the Result struct, telling it about the libpq memory behind it gets large results collected
+ * before the process grows instead of whenever an unrelated allocation triggers a run.
+ */
+static void db_postgres_result_account(Result *r) {
+    size_t memsize = r->result ? db_postgres_result_memory_size(r->result) : 0;
+    rb_gc_adjust_memory_usage((ssize_t)memsize - (ssize_t)r->memsize);
+    r->memsize = memsize;
 }
 
 VALUE db_postgres_result_deallocate(Result *r) {
     if (r) {
         if (r->result)
             PQclear(r->result);
+        r->result = NULL;
+        db_postgres_result_account(r);
+        if (r->columns)
+            free(r->columns);
         free(r);
     }
     return Qtrue;
@@ -53,23 +121,119 @@ VALUE db_postgres_result_allocate(VALUE klass) {
     return Data_Wrap_Struct(klass, db_postgres_result_mark, db_postgres_result_deallocate, r);
 }
 
-VALUE db_postgres_result_load(VALUE self, PGresult *result, VALUE decoder) {
+static size_t db_postgres_result_insert_id_value(PGresult *result) {
+    VALUE id;
+    if (!PQfformat(result, 0))
+        return atol(PQgetvalue(result, 0, 0));
+
+    id = typecast_decode_binary(PQgetvalue(result, 0, 0), PQgetlength(result, 0, 0), PQftype(result, 0));
+    return FIXNUM_P(id) || TYPE(id) == T_BIGNUM ? NUM2SIZET(id) : 0;
+}
+
+/* user registered and discovered types resolve to a builtin decoder through the adapter type map */
+static void db_postgres_result_column_decoder(Column *column, PGresult *result, int n, int format, Adapter *a) {
+    TypeEntry *entry;
+    Oid oid    = PQftype(result, n);
+    int typmod = PQfmod(result, n);
+
+    column->format   = format;
+    column->callable = 0;
+    column->decode   = 0;
+    column->element  = 0;
+
+    if ((entry = a->types ? db_postgres_types_lookup(a->types, oid) : 0)) {
+        if (entry->decoder) {
+            column->callable = entry->decoder;
+            return;
+        }
+        if (entry->base && !(entry->text && column->format))
+            oid = entry->base;
+    }
+
+    column->decode  = typecast_decoder_for(oid, column->format, typmod, a->typecast);
+    column->element = typecast_array_decoder_for(oid, column->format, typmod, a->typecast);
+
+    if (!column->decode && !column->element && entry && entry->element && !(entry->text && column->format))
+        column->element = typecast_element_decoder_for(entry->element, column->format, typmod, a->typecast);
+}
+
+/* timestamptz text is in the session time zone, binary values are UTC and only read the same in a UTC session */
+static int db_postgres_result_binary_zone(Adapter *a) {
+    const char *zone;
+
+    if (a->typecast & TYPECAST_TIMESTAMP_EPOCH)
+        return 1;
+    if (!(zone = PQparameterStatus(a->connection, "TimeZone")))
+        return 0;
+    if (strncasecmp(zone, "Etc/", 4) == 0)
+        zone += 4;
+
+    return strcasecmp(zone, "UTC") == 0 || strcasecmp(zone, "UCT") == 0 || strcasecmp(zone, "GMT") == 0
+        || strcasecmp(zone, "Universal") == 0 || strcasecmp(zone, "Zulu") == 0;
+}
+
+/* varchar, bpchar and json are sent in binary as the same bytes as their text */
+static int db_postgres_result_binary_scalar(Adapter *a, Oid oid) {
+    if (oid == 1184)
+        return db_postgres_result_binary_zone(a);
+    return typecast_decoder_for(oid, 1, -1, a->typecast) || oid == 114 || oid == 1042 || oid == 1043;
+}
+
+/*
+ * True if values of the type decode from binary to what they would from text. Types without a binary decoder,
+ * registered callables and text only types like hstore need text results. Resolves the type the same way
+ * db_postgres_result_column_decoder does.
+ */
+int db_postgres_result_binary_type(Adapter *a, Oid oid) {
+    TypeEntry *entry;
+
+    if ((entry = a->types ? db_postgres_types_lookup(a->types, oid) : 0)) {
+        if (entry->decoder || entry->text)
+            return 0;
+        if (entry->base)
+            oid = entry->base;
+        else if (entry->element)
+            return db_postgres_result_binary_scalar(a, entry->element);
+    }
+
+    if (oid == 1185)
+        return db_postgres_result_binary_zone(a);
+    return typecast_array_decoder_for(oid, 1, -1, a->typecast) || db_postgres_result_binary_scalar(a, oid);
+}
+
+/*
+ * Rows collected under max_result_size are copied into a result of their own that has no command status, the
+ * count of a command that returns rows is the number of rows it returned.
+ */
+static size_t db_postgres_result_command_tuples(PGresult *result) {
+    if (*PQcmdStatus(result) == 0 && PQresultStatus(result) == PGRES_TUPLES_OK)
+        return PQntuples(result);
+    return atol(PQcmdTuples(result));
+}
+
+VALUE db_postgres_result_load(VALUE self, PGresult *result, Adapter *a) {
     size_t n, rows, cols;
-    const char *type, *data;
+    const char *data;
+    Column *column;
 
     Result *r    = db_postgres_result_handle(self);
     r->fields    = rb_ary_new();
     r->types     = rb_ary_new();
     r->result    = result;
-    r->affected  = atol(PQcmdTuples(result));
+    r->affected  = db_postgres_result_command_tuples(result);
     r->selected  = PQntuples(result);
+    db_postgres_result_account(r);
     r->insert_id = 0;
-    r->decoder   = decoder;
+    r->decoder   = a->decoder;
+    r->typemap   = a->types;
 
     rows = PQntuples(result);
     cols = PQnfields(result);
     if (rows > 0)
-        r->insert_id = PQgetisnull(result, 0, 0) ? 0 : atol(PQgetvalue(result, 0, 0));
+        r->insert_id = PQgetisnull(result, 0, 0) ? 0 : db_postgres_result_insert_id_value(result);
+
+    if (cols > 0 && !(r->columns = (Column *)malloc(sizeof(Column) * cols)))
+        rb_raise(rb_eNoMemError, "result columns");
 
     for (n = 0; n < cols; n++) {
         /* this must be a command execution result without field information */
@@ -77,86 +241,210 @@ VALUE db_postgres_result_load(VALUE self, PGresult *result, VALUE decoder) {
             break;
         rb_ary_push(r->fields, ID2SYM(rb_intern(data)));
         rb_ary_push(r->types, INT2NUM(PQftype(result, n)));
+
+        r->columns[n].field = rb_ary_entry(r->fields, n);
+        r->columns[n].type  = rb_ary_entry(r->types, n);
+        db_postgres_result_column_decoder(r->columns + n, result, n, PQfformat(result, n), a);
+        r->n_columns++;
+
+        /*
+         * Prepared statements only ask for binary when every column reads the same as text, a query that wasn't
+         * described can still end up with columns that don't. A custom decoder gets the binary value as is.
+         */
+        if (PQfformat(result, n) && !db_postgres_result_binary_type(a, PQftype(result, n))) {
+            column = r->columns + n;
+            if (column->decode || column->element || !(column->callable || r->decoder))
+                rb_raise(eSwiftRuntimeError, "binary results cannot decode column %s of type %d the way text does, "
+                    "use a prepared statement or text results", data, (int)PQftype(result, n));
+        }
     }
 
     return self;
 }
 
+/* COPY sends values in the format it was asked for, not the one the described statement reports */
+VALUE db_postgres_result_format(VALUE self, int format, Adapter *a) {
+    Result *r = db_postgres_result_handle(self);
+    for (int n = 0; n < r->n_columns; n++)
+        db_postgres_result_column_decoder(r->columns + n, r->result, n, format, a);
+    return self;
+}
+
+/* cvalue needs to be NUL terminated like PQgetvalue, some of the text decoders rely on it */
+VALUE db_postgres_result_decode_value(Result *r, int col, const char *cvalue, size_t csize) {
+    VALUE value = Qundef;
+    Column *column = r->columns + col;
+
+    if (column->decode)
+        value = column->decode(cvalue, csize);
+    else if (column->element)
+        value = typecast_decode_array(cvalue, csize, column->format, column->element);
+    else if (column->callable)
+        return rb_funcall(column->callable, rb_intern("call"), 1, rb_str_new(cvalue, csize));
+
+    /* nil is a decoded value in its own right, json null */
+    if (value == Qundef) {
+        if (r->decoder)
+            value = rb_funcall(r->decoder, rb_intern("call"), 3, column->field, column->type, rb_str_new(cvalue, csize));
+        else
+            value = rb_str_new(cvalue, csize);
+    }
+
+    return value;
+}
+
+VALUE db_postgres_result_decode(Result *r, int row, int col) {
+    return db_postgres_result_decode_value(r, col, PQgetvalue(r->result, row, col), PQgetlength(r->result, row, col));
+}
+
+/* streamed results swap in the next batch of rows, fields and types stay the same */
+VALUE db_postgres_result_stream(VALUE self, PGresult *result) {
+    Result *r = db_postgres_result_handle(self);
+    if (r->result)
+        PQclear(r->result);
+
+    r->result    = result;
+    r->selected += PQntuples(result);
+    r->affected  = atol(PQcmdTuples(result));
+    db_postgres_result_account(r);
+    return self;
+}
+
+#ifndef HAVE_RB_HASH_NEW_CAPA
+#define rb_hash_new_capa(capa) rb_hash_new()
+#endif
+
+#ifndef HAVE_RB_HASH_BULK_INSERT
+static void rb_hash_bulk_insert(long argc, const VALUE *argv, VALUE hash) {
+    long n;
+    for (n = 0; n < argc; n += 2)
+        rb_hash_aset(hash, argv[n], argv[n + 1]);
+}
+#endif
+
 VALUE db_postgres_result_each(VALUE self) {
     VALUE tuple;
-    int row, col;
+    int row, col, rows, cols;
     Result *r = db_postgres_result_handle(self);
 
     if (!r->result)
         return Qnil;
 
-    for (row = 0; row < PQntuples(r->result); row++) {
-        tuple = rb_hash_new();
-        for (col = 0; col < PQnfields(r->result); col++) {
-            if (PQgetisnull(r->result, row, col))
-                rb_hash_aset(tuple, rb_ary_entry(r->fields, col), Qnil);
-            else {
-                size_t csize = PQgetlength(r->result, row, col);
-                const char *cvalue = PQgetvalue(r->result, row, col);
-                VALUE value = typecast_decode(cvalue, csize, NUM2INT(rb_ary_entry(r->types, col)));
-                if (NIL_P(value)) {
-                    if (r->decoder) {
-                        value = rb_funcall(
-                            r->decoder,
-                            rb_intern("call"),
-                            3,
-                            rb_ary_entry(r->fields, col),
-                            rb_ary_entry(r->types, col),
-                            rb_str_new(cvalue, csize)
-                        );
-                    }
-                    else {
-                        value = rb_str_new(cvalue, csize);
-                    }
-                }
-
-                rb_hash_aset(tuple, rb_ary_entry(r->fields, col), value);
-            }
-        }
+    rows = PQntuples(r->result);
+    cols = r->n_columns;
+
+    /* key value pairs live on the stack so the GC can see them until they are inserted */
+    VALUE pairs[cols > 0 ? cols * 2 : 1];
+    for (col = 0; col < cols; col++)
+        pairs[col * 2] = r->columns[col].field;
+
+    for (row = 0; row < rows; row++) {
+        for (col = 0; col < cols; col++)
+            pairs[col * 2 + 1] = PQgetisnull(r->result, row, col) ? Qnil : db_postgres_result_decode(r, row, col);
+
+        tuple = rb_hash_new_capa(cols);
+        rb_hash_bulk_insert(cols * 2, pairs, tuple);
         rb_yield(tuple);
     }
     return Qtrue;
 }
 
+static VALUE db_postgres_result_row(Result *r, int row) {
+    int col;
+    VALUE tuple = rb_ary_new_capa(r->n_columns);
+
+    for (col = 0; col < r->n_columns; col++)
+        rb_ary_push(tuple, PQgetisnull(r->result, row, col) ? Qnil : db_postgres_result_decode(r, row, col));
+
+    return rb_obj_freeze(tuple);
+}
+
+VALUE db_postgres_result_each_row(VALUE self) {
+    int row, rows;
+    Result *r = db_postgres_result_handle(self);
+
+    RETURN_ENUMERATOR(self, 0, 0);
+
+    if (!r->result)
+        return Qnil;
+
+    rows = PQntuples(r->result);
+    for (row = 0; row < rows; row++)
+        rb_yield(db_postgres_result_row(r, row));
+
+    return Qtrue;
+}
+
+VALUE db_postgres_result_rows(VALUE self) {
+    int row, rows;
+    VALUE list;
+    Result *r = db_postgres_result_handle(self);
+
+    if (!r->result)
+        return rb_ary_new();
+
+    rows = PQntuples(r->result);
+    list = rb_ary_new_capa(rows);
+    for (row = 0; row < rows; row++)
+        rb_ary_push(list, db_postgres_result_row(r, row));
+
+    return list;
+}
+
+static int db_postgres_result_column_index(Result *r, VALUE name) {
+    int col;
+
+    if (FIXNUM_P(name)) {
+        col = NUM2INT(name);
+        if (col < 0)
+            col += r->n_columns;
+        if (col < 0 || col >= r->n_columns)
+            rb_raise(eSwiftArgumentError, "column index %d out of range", NUM2INT(name));
+        return col;
+    }
+
+    if (TYPE(name) == T_STRING)
+        name = rb_str_intern(name);
+
+    for (col = 0; col < r->n_columns; col++) {
+        if (r->columns[col].field == name)
+            return col;
+    }
+
+    rb_raise(eSwiftArgumentError, "unknown column %s", CSTRING(rb_inspect(name)));
+}
+
+VALUE db_postgres_result_column(VALUE self, VALUE name) {
+    int row, rows, col;
+    VALUE list;
+    Result *r = db_postgres_result_handle(self);
+
+    if (!r->result)
+        return rb_ary_new();
+
+    col  = db_postgres_result_column_index(r, name);
+    rows = PQntuples(r->result);
+    list = rb_ary_new_capa(rows);
+    for (row = 0; row < rows; row++)
+        rb_ary_push(list, PQgetisnull(r->result, row, col) ? Qnil : db_postgres_result_decode(r, row, col));
+
+    return list;
+}
+
 VALUE db_postgres_result_get(VALUE self, VALUE g_row, VALUE g_col) {
-    VALUE tuple;
     int row = NUM2INT(g_row), col = NUM2INT(g_col);
     Result *r = db_postgres_result_handle(self);
 
     if (!r->result)
         return Qnil;
 
-    if (row >= PQntuples(r->result) || col >= PQnfields(r->result) || row < 0 || col < 0)
+    if (row >= PQntuples(r->result) || col >= r->n_columns || row < 0 || col < 0)
         return Qnil;
 
     if (PQgetisnull(r->result, row, col))
         return Qnil;
 
-    size_t csize = PQgetlength(r->result, row, col);
-    const char *cvalue = PQgetvalue(r->result, row, col);
-    VALUE value = typecast_decode(cvalue, csize, NUM2INT(rb_ary_entry(r->types, col)));
-    if (NIL_P(value)) {
-        if (r->decoder) {
-            value = rb_funcall(
-                r->decoder,
-                rb_intern("call"),
-                3,
-                rb_ary_entry(r->fields, col),
-                rb_ary_entry(r->types, col),
-                rb_str_new(cvalue, csize)
-            );
-        }
-        else {
-            value = rb_str_new(cvalue, csize);
-        }
-    }
-
-    return value;
+    return db_postgres_result_decode(r, row, col);
 }
 
 VALUE db_postgres_result_selected_rows(VALUE self) {
@@ -164,6 +452,16 @@ VALUE db_postgres_result_selected_rows(VALUE self) {
     return SIZET2NUM(r->selected);
 }
 
+/* bytes moved by a COPY command, set by the adapter once the copy is done */
+VALUE db_postgres_result_copied(VALUE self, size_t bytes) {
+    db_postgres_result_handle(self)->copied = bytes;
+    return self;
+}
+
+VALUE db_postgres_result_copied_bytes(VALUE self) {
+    return SIZET2NUM(db_postgres_result_handle(self)->copied);
+}
+
 VALUE db_postgres_result_affected_rows(VALUE self) {
     Result *r = db_postgres_result_handle(self);
     return SIZET2NUM(r->selected > 0 ? 0 : r->affected);
@@ -176,7 +474,7 @@ VALUE db_postgres_result_fields(VALUE self) {
 
 VALUE db_postgres_result_types(VALUE self) {
     Result *r = db_postgres_result_handle(self);
-    return r->types ? typecast_description(r->types) : rb_ary_new();
+    return r->types && r->typemap ? db_postgres_types_description(r->typemap, r->types) : rb_ary_new();
 }
 
 VALUE db_postgres_result_insert_id(VALUE self) {
@@ -184,15 +482,33 @@ VALUE db_postgres_result_insert_id(VALUE self) {
     return SIZET2NUM(r->insert_id);
 }
 
+VALUE db_postgres_result_to_arrow(VALUE self, VALUE io) {
+    Result *r = db_postgres_result_handle(self);
+
+    if (!rb_respond_to(io, rb_intern("write")))
+        rb_raise(eSwiftArgumentError, "#to_arrow needs an IO object that responds to #write");
+
+    if (!r->result)
+        return Qnil;
+
+    return SIZET2NUM(db_postgres_arrow_write_result(r->result, io));
+}
+
 VALUE db_postgres_result_clear(VALUE self) {
     Result *r = db_postgres_result_handle(self);
     if (r->result) {
         PQclear(r->result);
         r->result = NULL;
+        db_postgres_result_account(r);
     }
     return Qtrue;
 }
 
+VALUE db_postgres_result_memsize(VALUE self) {
+    Result *r = db_postgres_result_handle(self);
+    return SIZET2NUM(r->memsize);
+}
+
 void init_swift_db_postgres_result() {
     rb_require("bigdecimal");
     rb_require("stringio");
@@ -203,11 +519,17 @@ void init_swift_db_postgres_result() {
     rb_include_module(cDPR, rb_mEnumerable);
     rb_define_alloc_func(cDPR, db_postgres_result_allocate);
     rb_define_method(cDPR, "each",          db_postgres_result_each,          0);
+    rb_define_method(cDPR, "each_row",      db_postgres_result_each_row,      0);
+    rb_define_method(cDPR, "rows",          db_postgres_result_rows,          0);
+    rb_define_method(cDPR, "column",        db_postgres_result_column,        1);
     rb_define_method(cDPR, "get",           db_postgres_result_get,           2);
     rb_define_method(cDPR, "selected_rows", db_postgres_result_selected_rows, 0);
     rb_define_method(cDPR, "affected_rows", db_postgres_result_affected_rows, 0);
+    rb_define_method(cDPR, "copied_bytes",  db_postgres_result_copied_bytes,  0);
     rb_define_method(cDPR, "fields",        db_postgres_result_fields,        0);
     rb_define_method(cDPR, "types",         db_postgres_result_types,         0);
     rb_define_method(cDPR, "insert_id",     db_postgres_result_insert_id,     0);
     rb_define_method(cDPR, "clear",         db_postgres_result_clear,         0);
+    rb_define_method(cDPR, "memsize",       db_postgres_result_memsize,       0);
+    rb_define_method(cDPR, "to_arrow",      db_postgres_result_to_arrow,      1);
 }
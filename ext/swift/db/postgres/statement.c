@@ -4,6 +4,7 @@
 
 #include "statement.h"
 #include "adapter.h"
+#include "bind.h"
 #include "typecast.h"
 #include "gvl.h"
 
@@ -12,11 +13,18 @@
 VALUE cDPS;
 
 VALUE    db_postgres_result_allocate(VALUE);
-VALUE    db_postgres_result_load(VALUE, PGresult*);
+VALUE    db_postgres_result_load(VALUE, PGresult*, Adapter*);
 Adapter* db_postgres_adapter_handle_safe(VALUE);
+int      db_postgres_result_binary_type(Adapter*, Oid);
 
+/* param_types and column_types share one allocation, both are set once the statement is described */
 typedef struct Statement {
     char id[128];
+    int binary;
+    int n_params;
+    Oid *param_types;
+    int n_columns;
+    Oid *column_types;
     VALUE adapter;
 } Statement;
 
@@ -43,8 +51,11 @@ void db_postgres_statement_mark(Statement *s) {
 }
 
 VALUE db_postgres_statement_deallocate(Statement *s) {
-    if (s)
+    if (s) {
+        if (s->param_types)
+            free(s->param_types);
         free(s);
+    }
     return Qtrue;
 }
 
@@ -61,27 +72,29 @@ VALUE db_postgres_statement_initialize(VALUE self, VALUE adapter, VALUE sql) {
 
     snprintf(s->id, 128, "s%s", CSTRING(rb_uuid_string()));
     s->adapter = adapter;
+    s->binary  = a->binary;
 
     if (!a->native)
-        sql = db_postgres_normalized_sql(sql);
+        sql = db_postgres_adapter_normalized_sql(a, sql);
 
-    result = PQprepare(a->connection, s->id, CSTRING(sql), 0, 0);
+    Query q = {.connection = a->connection, .command = CSTRING(sql), .name = s->id};
+    result  = db_postgres_adapter_exec(a, &q, QUERY_PREPARE);
     db_postgres_check_result(result);
     PQclear(result);
+    RB_GC_GUARD(sql);
     return self;
 }
 
 VALUE db_postgres_statement_release(VALUE self) {
     char command[256];
     PGresult *result;
-    PGconn *connection;
 
     Statement *s = db_postgres_statement_handle_safe(self);
-    connection   = db_postgres_adapter_handle_safe(s->adapter)->connection;
+    Adapter *a   = db_postgres_adapter_handle_safe(s->adapter);
 
-    if (connection && PQstatus(connection) == CONNECTION_OK) {
+    if (a->connection && PQstatus(a->connection) == CONNECTION_OK) {
         snprintf(command, 256, "deallocate %s", s->id);
-        result = PQexec(connection, command);
+        result = db_postgres_adapter_exec_sql(a, command);
         db_postgres_check_result(result);
         PQclear(result);
         return Qtrue;
@@ -92,16 +105,59 @@ VALUE db_postgres_statement_release(VALUE self) {
 
  GVL_NOLOCK_RETURN_TYPE nogvl_pq_exec_prepared(void *ptr) {
     Query *q = (Query *)ptr;
-    PGresult *r  = PQexecPrepared(q->connection, q->command, q->n_args, (const char * const *)q->data, q->size, q->format, 0);
+    PGresult *r  = PQexecPrepared(q->connection, q->command, q->n_args, (const char * const *)q->data, q->size, q->format, q->result_format);
     return (GVL_NOLOCK_RETURN_TYPE)r;
 }
 
+/* binary params need to match the server inferred parameter types exactly, binary results need the column types. */
+static void db_postgres_statement_describe(Statement *s, Adapter *a) {
+    int n;
+    PGresult *result;
+    Query q = {.connection = a->connection, .command = s->id};
+
+    if (s->param_types)
+        return;
+
+    result = db_postgres_adapter_exec(a, &q, QUERY_DESCRIBE);
+    db_postgres_check_result(result);
+
+    s->n_params    = PQnparams(result);
+    s->n_columns   = PQnfields(result);
+    s->param_types = (Oid *)malloc(sizeof(Oid) * (s->n_params + s->n_columns + 1));
+    if (!s->param_types) {
+        PQclear(result);
+        rb_raise(rb_eNoMemError, "statement param types");
+    }
+
+    s->column_types = s->param_types + s->n_params;
+    for (n = 0; n < s->n_params; n++)
+        s->param_types[n] = PQparamtype(result, n);
+    for (n = 0; n < s->n_columns; n++)
+        s->column_types[n] = PQftype(result, n);
+
+    PQclear(result);
+}
+
+/* binary results only when every column decodes the same as it would from text, text otherwise */
+static int db_postgres_statement_result_format(Statement *s, Adapter *a) {
+    int n;
+
+    if (!s->binary || !s->param_types)
+        return 0;
+
+    for (n = 0; n < s->n_columns; n++) {
+        if (!db_postgres_result_binary_type(a, s->column_types[n]))
+            return 0;
+    }
+    return 1;
+}
+
 VALUE db_postgres_statement_execute(int argc, VALUE *argv, VALUE self) {
+    Bind b;
+    Oid *targets = 0;
     PGresult *result;
     PGconn *connection;
-    char **bind_args_data = 0;
-    int n, *bind_args_size = 0, *bind_args_fmt = 0;
-    VALUE bind, data, typecast_bind;
+    VALUE bind;
 
     Statement *s = db_postgres_statement_handle_safe(self);
     Adapter *a   = db_postgres_adapter_handle_safe(s->adapter);
@@ -109,82 +165,77 @@ VALUE db_postgres_statement_execute(int argc, VALUE *argv, VALUE self) {
 
     rb_scan_args(argc, argv, "00*", &bind);
 
-    typecast_bind = rb_ary_new();
-    rb_gc_register_address(&typecast_bind);
-    rb_gc_register_address(&bind);
+    if (s->binary || (a->binary_params && RARRAY_LEN(bind) > 0))
+        db_postgres_statement_describe(s, a);
 
     if (RARRAY_LEN(bind) > 0) {
-        bind_args_size = (int *) malloc(sizeof(int) * RARRAY_LEN(bind));
-        if (!bind_args_size)
-            rb_raise(rb_eNoMemError, "bind args");
-        bind_args_fmt  = (int *) malloc(sizeof(int) * RARRAY_LEN(bind));
-        if (!bind_args_fmt) {
-            free(bind_args_size);
-            rb_raise(rb_eNoMemError, "bind args");
-        }
-        bind_args_data = (char **) malloc(sizeof(char *) * RARRAY_LEN(bind));
-        if (!bind_args_data) {
-            free(bind_args_size);
-            free(bind_args_fmt);
-            rb_raise(rb_eNoMemError, "bind args");
-        }
-
-        for (n = 0; n < RARRAY_LEN(bind); n++) {
-            data = rb_ary_entry(bind, n);
-            if (NIL_P(data)) {
-                bind_args_size[n] = 0;
-                bind_args_data[n] = 0;
-                bind_args_fmt[n]  = 0;
-            }
-            else {
-                if (rb_obj_is_kind_of(data, rb_cIO) || rb_obj_is_kind_of(data, cStringIO))
-                    bind_args_fmt[n] = 1;
-                else
-                    bind_args_fmt[n] = 0;
-
-                VALUE coerced = typecast_encode(data);
-                if (NIL_P(coerced)) {
-                    coerced = a->encoder
-                        ? rb_funcall(a->encoder, rb_intern("call"), 1, data)
-                        : typecast_to_str(data);
-                }
-
-                rb_ary_push(typecast_bind, coerced);
-                bind_args_size[n] = RSTRING_LEN(coerced);
-                bind_args_data[n] = RSTRING_PTR(coerced);
-            }
-        }
+        if (a->binary_params && s->n_params == RARRAY_LEN(bind))
+            targets = s->param_types;
+
+        db_postgres_bind_encode(&b, a, bind, targets != 0, targets);
 
         Query q = {
-            .connection = connection,
-            .command    = s->id,
-            .n_args     = RARRAY_LEN(bind),
-            .data       = bind_args_data,
-            .size       = bind_args_size,
-            .format     = bind_args_fmt
+            .connection    = connection,
+            .command       = s->id,
+            .n_args        = b.n_args,
+            .data          = b.data,
+            .size          = b.size,
+            .format        = b.format,
+            .result_format = db_postgres_statement_result_format(s, a),
+            .max_size      = a->max_result_size
         };
 
-        result = (PGresult *)GVL_NOLOCK(nogvl_pq_exec_prepared, &q, RUBY_UBF_IO, 0);
-        free(bind_args_fmt);
-        free(bind_args_size);
-        free(bind_args_data);
+        result = db_postgres_adapter_exec(a, &q, QUERY_PREPARED);
+        RB_GC_GUARD(b.values);
+        db_postgres_bind_free(&b);
     }
     else {
         Query q = {
-            .connection = connection,
-            .command    = s->id,
-            .n_args     = 0,
-            .data       = 0,
-            .size       = 0,
-            .format     = 0
+            .connection    = connection,
+            .command       = s->id,
+            .n_args        = 0,
+            .data          = 0,
+            .size          = 0,
+            .format        = 0,
+            .result_format = db_postgres_statement_result_format(s, a),
+            .max_size      = a->max_result_size
         };
-        result = (PGresult *)GVL_NOLOCK(nogvl_pq_exec_prepared, &q, RUBY_UBF_IO, 0);
+        result = db_postgres_adapter_exec(a, &q, QUERY_PREPARED);
     }
 
-    rb_gc_unregister_address(&typecast_bind);
-    rb_gc_unregister_address(&bind);
+    RB_GC_GUARD(bind);
     db_postgres_check_result(result);
-    return db_postgres_result_load(db_postgres_result_allocate(cDPR), result);
+    return db_postgres_result_load(db_postgres_result_allocate(cDPR), result, a);
+}
+
+/* queues the statement on a connection in pipeline mode */
+int db_postgres_statement_send(VALUE self, VALUE bind) {
+    Bind b;
+    int ok;
+    Oid *targets = 0;
+
+    Statement *s = db_postgres_statement_handle_safe(self);
+    Adapter *a   = db_postgres_adapter_handle_safe(s->adapter);
+
+    /* describing the statement is a synchronous call, only use param and column types that are already known */
+    if (a->binary_params && s->param_types && s->n_params == RARRAY_LEN(bind))
+        targets = s->param_types;
+
+    db_postgres_bind_encode(&b, a, bind, targets != 0, targets);
+
+    ok = PQsendQueryPrepared(a->connection, s->id, b.n_args, (const char * const *)b.data, b.size, b.format,
+        db_postgres_statement_result_format(s, a));
+
+    RB_GC_GUARD(b.values);
+    RB_GC_GUARD(bind);
+    db_postgres_bind_free(&b);
+    return ok;
+}
+
+VALUE db_postgres_statement_binary_set(VALUE self, VALUE flag) {
+    Statement *s = db_postgres_statement_handle_safe(self);
+    s->binary = RTEST(flag) ? 1 : 0;
+    return flag;
 }
 
 void init_swift_db_postgres_statement() {
@@ -193,6 +244,8 @@ void init_swift_db_postgres_statement() {
     rb_define_method(cDPS, "initialize", db_postgres_statement_initialize, 2);
     rb_define_method(cDPS, "execute",    db_postgres_statement_execute,   -1);
     rb_define_method(cDPS, "release",    db_postgres_statement_release,    0);
+
+    rb_define_method(cDPS, "binary_format=", db_postgres_statement_binary_set, 1);
 }
 
 
@@ -5,78 +5,18 @@
 #include "common.h"
 #include "typecast.h"
 #include "datetime.h"
+#include "bytea.h"
+#include "json.h"
+#include <math.h>
+#include <strings.h>
 
-const static struct {
-    int oid;
-    const char *type;
-} oid_types[] = {
-    {16, "boolean"},
-    {17, "bytea"},
-    {18, "char"},
-    {19, "name"},
-    {20, "bigint"},
-    {21, "smallint"},
-    {23, "integer"},
-    {25, "text"},
-    {114, "json"},
-    {142, "xml"},
-    {600, "point"},
-    {601, "lseg"},
-    {602, "path"},
-    {603, "box"},
-    {604, "polygon"},
-    {628, "line"},
-    {650, "cidr"},
-    {700, "real"},
-    {701, "double precision"},
-    {702, "abstime"},
-    {703, "reltime"},
-    {704, "tinterval"},
-    {718, "circle"},
-    {774, "macaddr8"},
-    {790, "money"},
-    {829, "macaddr"},
-    {869, "inet"},
-    {1007, "int array"},
-    {1009, "text array"},
-    {1042, "character"},
-    {1043, "character varying"},
-    {1082, "date"},
-    {1083, "time without time zone"},
-    {1114, "timestamp without time zone"},
-    {1184, "timestamp with time zone"},
-    {1186, "interval"},
-    {1266, "time with time zone"},
-    {1560, "bit"},
-    {1562, "bit varying"},
-    {1700, "numeric"},
-    {2277, "anyarray"},
-    {2283, "anyelement"},
-    {2776, "anynonarray"},
-    {2950, "uuid"},
-    {3500, "anyenum"},
-    {3614, "tsvector"},
-    {3615, "tsquery"},
-    {3642, "gtsvector"},
-    {3802, "jsonb"},
-    {3831, "anyrange"},
-    {3904, "int4range"},
-    {3906, "numrange"},
-    {3908, "tsrange"},
-    {3910, "tstzrange"},
-    {3912, "daterange"},
-    {3926, "int8range"}
-};
-
-#define date_parse(klass, data,len) rb_funcall(datetime_parse(klass, data, len), fto_date, 0)
-
-ID fnew, fto_date, fstrftime;
+ID fnew, fto_date, fstrftime, fjd, fto_time, fbigdecimal;
 VALUE cBigDecimal, cStringIO;
-VALUE dtformat;
-VALUE cDateTime;
+VALUE dtformat, sdecimal;
+VALUE cDateTime, cDate;
 
 #define TO_UTF8(value) rb_str_encode(value, rb_str_new2("UTF-8"), 0, Qnil)
-#define UTF8_STRING(value) strcmp(rb_enc_get(value)->name, "UTF-8") ? TO_UTF8(value) : value
+#define UTF8_STRING(value) (ENCODING_GET(value) == rb_utf8_encindex() || ENCODING_GET(value) == rb_usascii_encindex() ? value : TO_UTF8(value))
 
 VALUE typecast_to_str(VALUE value) {
     return UTF8_STRING(rb_funcall(value, rb_intern("to_s"), 0));
@@ -90,14 +30,18 @@ VALUE typecast_encode(VALUE value) {
             return rb_str_new2("1");
         case T_FALSE:
             return rb_str_new2("0");
-        case T_FLOAT:
         case T_BIGNUM:
-        case T_FIXNUM:
+            return rb_big2str(value, 10);
         case T_SYMBOL:
+            return UTF8_STRING(rb_sym2str(value));
+        case T_FLOAT:
+        case T_FIXNUM:
         case T_RATIONAL:
             return typecast_to_str(value);
         default:
-            if (rb_obj_is_kind_of(value, rb_cTime) || rb_obj_is_kind_of(value, cDateTime))
+            if (rb_obj_is_kind_of(value, cBigDecimal))
+                return rb_funcall(value, rb_intern("to_s"), 1, sdecimal);
+            else if (rb_obj_is_kind_of(value, rb_cTime) || rb_obj_is_kind_of(value, cDateTime))
                 return rb_funcall(value, fstrftime, 1, dtformat);
             else if (rb_obj_is_kind_of(value, rb_cIO) || rb_obj_is_kind_of(value, cStringIO))
                 return rb_funcall(value, rb_intern("read"), 0);
@@ -106,62 +50,979 @@ VALUE typecast_encode(VALUE value) {
     }
 }
 
-VALUE typecast_decode(const char *data, size_t size, int oid) {
-    VALUE value;
-    unsigned char *bytea;
-    size_t bytea_len;
+/* seconds since epoch and utc offset of a Time, or a DateTime converted to one. */
+static int typecast_time_parts(VALUE value, struct timespec *ts, long *offset) {
+    if (rb_obj_is_kind_of(value, cDateTime))
+        value = rb_funcall(value, fto_time, 0);
+    if (!rb_obj_is_kind_of(value, rb_cTime))
+        return 0;
+
+    *ts     = rb_time_timespec(value);
+    *offset = NUM2LONG(rb_time_utc_offset(value));
+    return 1;
+}
+
+static int typecast_days_since_epoch(VALUE value, int64_t *days) {
+    VALUE jd = rb_funcall(value, fjd, 0);
+    if (!FIXNUM_P(jd))
+        return 0;
+    *days = FIX2LONG(jd) - 2440588;
+    return 1;
+}
+
+static int typecast_encode_float(double value, char *buffer) {
+    int n, precision;
+
+    if (isnan(value))
+        return sprintf(buffer, "NaN");
+    if (isinf(value))
+        return sprintf(buffer, value < 0 ? "-Infinity" : "Infinity");
+
+    /* shortest representation that reads back as the same double */
+    for (precision = 15; precision < 17; precision++) {
+        n = sprintf(buffer, "%.*g", precision, value);
+        if (strtod(buffer, 0) == value)
+            break;
+    }
+    if (precision == 17)
+        n = sprintf(buffer, "%.17g", value);
+
+    if (!strpbrk(buffer, ".e"))
+        n += sprintf(buffer + n, ".0");
+    return n;
+}
+
+static int typecast_encode_time(struct timespec *ts, long offset, char *buffer) {
+    int year, month, day;
+    int64_t days, seconds = (int64_t)ts->tv_sec + offset;
+
+    days     = seconds >= 0 ? seconds / 86400 : -((-seconds + 86399) / 86400);
+    seconds -= days * 86400;
+    datetime_civil_from_days(days, &year, &month, &day);
+
+    return sprintf(buffer, "%04d-%02d-%02d %02d:%02d:%02d.%09ld %c%02ld%02ld",
+        year, month, day, (int)(seconds / 3600), (int)(seconds % 3600 / 60), (int)(seconds % 60), (long)ts->tv_nsec,
+        offset < 0 ? '-' : '+', labs(offset) / 3600, labs(offset) % 3600 / 60);
+}
+
+int typecast_encode_text(VALUE value, char *buffer) {
+    long offset;
+    int64_t days;
+    int year, month, day;
+    struct timespec ts;
+
+    switch (TYPE(value)) {
+        case T_FIXNUM:
+            return sprintf(buffer, "%ld", FIX2LONG(value));
+        case T_FLOAT:
+            return typecast_encode_float(RFLOAT_VALUE(value), buffer);
+        case T_DATA:
+            if (rb_obj_is_kind_of(value, rb_cTime) || rb_obj_is_kind_of(value, cDateTime)) {
+                if (typecast_time_parts(value, &ts, &offset))
+                    return typecast_encode_time(&ts, offset, buffer);
+            }
+            else if (rb_obj_is_kind_of(value, cDate)) {
+                if (typecast_days_since_epoch(value, &days)) {
+                    datetime_civil_from_days(days, &year, &month, &day);
+                    return sprintf(buffer, "%04d-%02d-%02d", year, month, day);
+                }
+            }
+            return -1;
+        default:
+            return -1;
+    }
+}
+
+/*
+ * Only values whose postgres type is not open to interpretation get an explicit type. Integers could be meant as int,
+ * bigint or numeric, floats as real, double precision or numeric and times as timestamp or timestamptz, typing them
+ * here would change how the server resolves operators against the column, so they go as text with an unknown type.
+ */
+Oid typecast_encode_oid(VALUE value) {
+    switch (TYPE(value)) {
+        case T_TRUE:
+        case T_FALSE:
+            return 16;
+        case T_DATA:
+            if (rb_obj_is_kind_of(value, cDate) && !rb_obj_is_kind_of(value, cDateTime))
+                return 1082;
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+int typecast_encode_binary(VALUE value, Oid oid, char *buffer) {
+    long offset;
+    int nlz = 0;
+    int64_t days, integer;
+    struct timespec ts;
+    union { float f; uint32_t i; } f4;
+    union { double f; uint64_t i; } f8;
+
     switch (oid) {
         case 16:
-            return (data && (data[0] =='t' || data[0] == '1')) ? Qtrue : Qfalse;
-        case 17:
-            bytea = PQunescapeBytea((const unsigned char*)data, &bytea_len);
-            value = rb_str_new((const char*)bytea, bytea_len);
-            PQfreemem(bytea);
-            return rb_funcall(cStringIO, fnew, 1, value);
-        case 20:
+            if (value != Qtrue && value != Qfalse)
+                return -1;
+            buffer[0] = value == Qtrue ? 1 : 0;
+            return 1;
         case 21:
         case 23:
-            return rb_cstr2inum(data, 10);
-        case 18:
-        case 19:
-        case 25:
-            return rb_enc_str_new(data, size, rb_utf8_encoding());
+        case 20:
+            if (!FIXNUM_P(value) && TYPE(value) != T_BIGNUM)
+                return -1;
+            if (TYPE(value) == T_BIGNUM && (rb_absint_size(value, &nlz) > 8 || (rb_absint_size(value, &nlz) == 8 && nlz == 0)))
+                return -1;
+            integer = NUM2LL(value);
+            if (oid == 21 && integer >= INT16_MIN && integer <= INT16_MAX) {
+                write_uint16(buffer, (uint16_t)integer);
+                return 2;
+            }
+            if (oid == 23 && integer >= INT32_MIN && integer <= INT32_MAX) {
+                write_uint32(buffer, (uint32_t)integer);
+                return 4;
+            }
+            if (oid == 20) {
+                write_uint64(buffer, (uint64_t)integer);
+                return 8;
+            }
+            return -1;
         case 700:
+            if (TYPE(value) != T_FLOAT && !FIXNUM_P(value))
+                return -1;
+            f4.f = (float)NUM2DBL(value);
+            write_uint32(buffer, f4.i);
+            return 4;
         case 701:
-            return rb_float_new(atof(data));
-        case 1700:
-            return rb_funcall(cBigDecimal, fnew, 1, rb_str_new(data, size));
+            if (TYPE(value) != T_FLOAT && !FIXNUM_P(value))
+                return -1;
+            f8.f = NUM2DBL(value);
+            write_uint64(buffer, f8.i);
+            return 8;
+        case 1082:
+            if (TYPE(value) != T_DATA || !rb_obj_is_kind_of(value, cDate) || !typecast_days_since_epoch(value, &days))
+                return -1;
+            write_uint32(buffer, (uint32_t)(int32_t)(days - POSTGRES_EPOCH_DAYS));
+            return 4;
         case 1114:
         case 1184:
-            return datetime_parse(cSwiftDateTime, data, size);
-        case 1082:
-            return date_parse(cSwiftDateTime, data, size);
+            if (TYPE(value) != T_DATA || !typecast_time_parts(value, &ts, &offset))
+                return -1;
+            /* timestamp without time zone keeps the wall clock time, same as the text format */
+            if (oid == 1114)
+                ts.tv_sec += offset;
+            write_uint64(buffer, (uint64_t)(((int64_t)ts.tv_sec * 1000000 + (ts.tv_nsec + 500) / 1000) - POSTGRES_EPOCH_USEC));
+            return 8;
         default:
-            return Qnil;
+            return -1;
+    }
+}
+
+static VALUE typecast_decode_bool(const char *data, size_t size) {
+    return (data && (data[0] =='t' || data[0] == '1')) ? Qtrue : Qfalse;
+}
+
+static VALUE typecast_decode_bytea_string(const char *data, size_t size) {
+    VALUE value;
+    unsigned char *bytea;
+    size_t bytea_len;
+
+    /* hex output decodes straight into the string, escape format still goes through libpq */
+    if (size >= 2 && data[0] == '\\' && data[1] == 'x' && size % 2 == 0) {
+        value = rb_str_new(0, (size - 2) / 2);
+        if (bytea_hex_decode(data + 2, size - 2, RSTRING_PTR(value)))
+            return value;
+    }
+
+    bytea = PQunescapeBytea((const unsigned char*)data, &bytea_len);
+    value = rb_str_new((const char*)bytea, bytea_len);
+    PQfreemem(bytea);
+    return value;
+}
+
+static VALUE typecast_decode_bytea(const char *data, size_t size) {
+    return rb_funcall(cStringIO, fnew, 1, typecast_decode_bytea_string(data, size));
+}
+
+/* json null is nil, invalid json is Qundef like any other value that can't be decoded */
+static VALUE typecast_decode_json(const char *data, size_t size) {
+    return json_parse(data, size, 0);
+}
+
+static VALUE typecast_decode_json_symbolize(const char *data, size_t size) {
+    return json_parse(data, size, JSON_SYMBOLIZE_KEYS);
+}
+
+static VALUE typecast_decode_integer(const char *data, size_t size) {
+    return rb_cstr2inum(data, 10);
+}
+
+static VALUE typecast_decode_text(const char *data, size_t size) {
+    return rb_enc_str_new(data, size, rb_utf8_encoding());
+}
+
+static VALUE typecast_decode_float(const char *data, size_t size) {
+    return rb_float_new(atof(data));
+}
+
+/* BigDecimal.new is gone from recent bigdecimal releases and the gem has no public C API, Kernel#BigDecimal it is */
+static VALUE typecast_decode_numeric(const char *data, size_t size) {
+    return rb_funcall(rb_mKernel, fbigdecimal, 1, rb_str_new(data, size));
+}
+
+/* NaN, Infinity and -Infinity */
+static int typecast_numeric_special(const char *data, size_t size) {
+    return size > 0 && (data[0] == 'N' || data[0] == 'I' || (data[0] == '-' && size > 1 && data[1] == 'I'));
+}
+
+/* scale 0 columns, NUL terminated text */
+static VALUE typecast_decode_numeric_integer(const char *data, size_t size) {
+    return typecast_numeric_special(data, size) ? typecast_decode_numeric(data, size) : rb_cstr2inum(data, 10);
+}
+
+static VALUE typecast_decode_numeric_auto(const char *data, size_t size) {
+    return memchr(data, '.', size) ? typecast_decode_numeric(data, size) : typecast_decode_numeric_integer(data, size);
+}
+
+static VALUE typecast_decode_numeric_float(const char *data, size_t size) {
+    return rb_float_new(strtod(data, NULL));
+}
+
+/* digits without the decimal point over 10**scale, Rational cannot hold NaN or infinity so those are Floats */
+static VALUE typecast_decode_numeric_rational(const char *data, size_t size) {
+    VALUE value, buffer;
+    char *digits;
+    const char *point;
+    size_t scale;
+
+    if (typecast_numeric_special(data, size))
+        return typecast_decode_numeric_float(data, size);
+
+    if (!(point = memchr(data, '.', size)))
+        return rb_rational_new1(rb_cstr2inum(data, 10));
+
+    scale  = size - (point - data) - 1;
+    digits = ALLOCV_N(char, buffer, size);
+    memcpy(digits, data, point - data);
+    memcpy(digits + (point - data), point + 1, scale);
+    digits[size - 1] = 0;
+
+    value = rb_rational_new(rb_cstr2inum(digits, 10), rb_int_positive_pow(10, scale));
+    ALLOCV_END(buffer);
+    return value;
+}
+
+/* ISO output is parsed in place, anything else goes through the slower DateTime parser */
+static VALUE typecast_decode_timestamp(const char *data, size_t size) {
+    int offset = 0;
+    int64_t usec;
+    VALUE datetime;
+
+    if (datetime_parse_usec(data, size, &usec, &offset))
+        return datetime_from_epoch_usec(cSwiftDateTime, usec, offset);
+
+    datetime = datetime_parse(cSwiftDateTime, data, size);
+    return NIL_P(datetime) ? Qundef : datetime;
+}
+
+static VALUE typecast_decode_timestamp_time(const char *data, size_t size) {
+    int zone, offset = 0;
+    int64_t usec;
+    VALUE datetime;
+
+    if ((zone = datetime_parse_usec(data, size, &usec, &offset)))
+        return datetime_time_from_epoch_usec(usec, offset, zone == 1);
+
+    datetime = datetime_parse(cSwiftDateTime, data, size);
+    return NIL_P(datetime) ? Qundef : rb_funcall(datetime, fto_time, 0);
+}
+
+static VALUE typecast_decode_timestamp_epoch(const char *data, size_t size) {
+    int64_t usec;
+    VALUE datetime;
+    struct timeval tv;
+
+    if (datetime_parse_usec(data, size, &usec, 0))
+        return LL2NUM(usec);
+
+    datetime = datetime_parse(cSwiftDateTime, data, size);
+    if (NIL_P(datetime))
+        return Qundef;
+
+    tv = rb_time_timeval(rb_funcall(datetime, fto_time, 0));
+    return LL2NUM((int64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+}
+
+static VALUE typecast_decode_date(const char *data, size_t size) {
+    int64_t usec;
+    VALUE datetime;
+
+    if (datetime_parse_usec(data, size, &usec, 0) == 1)
+        return datetime_date_from_days(usec / DAY_USEC - (usec % DAY_USEC < 0));
+
+    datetime = datetime_parse(cSwiftDateTime, data, size);
+    return NIL_P(datetime) ? Qundef : rb_funcall(datetime, fto_date, 0);
+}
+
+VALUE typecast_decode(const char *data, size_t size, int oid) {
+    VALUE value;
+    typecast_decoder decoder = typecast_decoder_for(oid, 0, -1, 0);
+    return decoder && (value = decoder(data, size)) != Qundef ? value : Qnil;
+}
+
+/* numeric is sent as base 10000 digits, rebuild the decimal string the text format would have given us. */
+size_t typecast_binary_numeric_size(const char *data, size_t size) {
+    int16_t ndigits, weight, dscale;
+
+    if (size < 8)
+        return 0;
+
+    ndigits = (int16_t)read_uint16(data);
+    weight  = (int16_t)read_uint16(data + 2);
+    dscale  = (int16_t)read_uint16(data + 6);
+
+    if (ndigits < 0 || size < 8 + (size_t)ndigits * 2)
+        return 0;
+
+    /* sign, leading zero, decimal point and room for -Infinity */
+    return (weight > 0 ? (size_t)(weight + 1) * 4 : 4) + (dscale > 0 ? dscale : 0) + 16;
+}
+
+size_t typecast_binary_numeric_text(const char *data, size_t size, char *buffer) {
+    char *ptr = buffer;
+    int16_t ndigits, weight, dscale, n, digit, d;
+    uint16_t sign;
+
+    if (!typecast_binary_numeric_size(data, size))
+        return 0;
+
+    ndigits = (int16_t)read_uint16(data);
+    weight  = (int16_t)read_uint16(data + 2);
+    sign    = read_uint16(data + 4);
+    dscale  = (int16_t)read_uint16(data + 6);
+
+    switch (sign) {
+        case NUMERIC_NAN:  memcpy(buffer, "NaN", 3);       return 3;
+        case NUMERIC_PINF: memcpy(buffer, "Infinity", 8);  return 8;
+        case NUMERIC_NINF: memcpy(buffer, "-Infinity", 9); return 9;
+    }
+
+    if (sign == NUMERIC_NEG)
+        *ptr++ = '-';
+
+    if (weight < 0)
+        *ptr++ = '0';
+
+    for (n = 0; n <= weight; n++) {
+        digit = n < ndigits ? (int16_t)read_uint16(data + 8 + n * 2) : 0;
+        for (d = 1000; d > 0; d /= 10) {
+            /* skip leading zeros of the first group */
+            if (n > 0 || digit >= d || d == 1)
+                *ptr++ = '0' + digit / d % 10;
+        }
+    }
+
+    if (dscale > 0) {
+        *ptr++ = '.';
+        for (n = weight + 1, d = 0; d < dscale; n++) {
+            digit = n >= 0 && n < ndigits ? (int16_t)read_uint16(data + 8 + n * 2) : 0;
+            *ptr++ = '0' + digit / 1000 % 10; if (++d == dscale) break;
+            *ptr++ = '0' + digit / 100  % 10; if (++d == dscale) break;
+            *ptr++ = '0' + digit / 10   % 10; if (++d == dscale) break;
+            *ptr++ = '0' + digit        % 10; ++d;
+        }
+    }
+
+    return ptr - buffer;
+}
+
+static int typecast_hex_digit(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+        return (c | 0x20) - 'a' + 10;
+    return -1;
+}
+
+static size_t typecast_binary_numeric_header(char *buffer, int ndigits, int weight, uint16_t sign, int dscale) {
+    write_uint16(buffer,     (uint16_t)ndigits);
+    write_uint16(buffer + 2, (uint16_t)weight);
+    write_uint16(buffer + 4, sign);
+    write_uint16(buffer + 6, (uint16_t)dscale);
+    return 8;
+}
+
+/*
+ * The inverse of typecast_binary_numeric_text, takes a decimal with an optional exponent and writes the base 10000
+ * binary format into buffer, which needs room for size + 16 bytes. Returns 0 if the text is not a number.
+ */
+size_t typecast_binary_numeric_from_text(const char *data, size_t size, char *buffer) {
+    const char *ptr = data, *end = data + size;
+    int negative = 0, length = 0, point = -1, start, count, pad, ndigits, weight, n, i, index;
+    long exponent = 0, scale, position;
+    char *digits;
+    uint16_t digit;
+    VALUE tmp;
+
+    if (size == 3 && memcmp(data, "NaN", 3) == 0)
+        return typecast_binary_numeric_header(buffer, 0, 0, NUMERIC_NAN, 0);
+    if ((size == 8 && memcmp(data, "Infinity", 8) == 0) || (size == 9 && memcmp(data, "+Infinity", 9) == 0))
+        return typecast_binary_numeric_header(buffer, 0, 0, NUMERIC_PINF, 0);
+    if (size == 9 && memcmp(data, "-Infinity", 9) == 0)
+        return typecast_binary_numeric_header(buffer, 0, 0, NUMERIC_NINF, 0);
+
+    if (ptr < end && (*ptr == '-' || *ptr == '+'))
+        negative = *ptr++ == '-';
+
+    digits = ALLOCV_N(char, tmp, size + 1);
+    for (; ptr < end; ptr++) {
+        if (*ptr >= '0' && *ptr <= '9')
+            digits[length++] = *ptr - '0';
+        else if (*ptr == '.' && point < 0)
+            point = length;
+        else
+            break;
+    }
+    if (point < 0)
+        point = length;
+
+    if (ptr < end && (*ptr == 'e' || *ptr == 'E')) {
+        int sign = 1, any = 0;
+        if (++ptr < end && (*ptr == '-' || *ptr == '+'))
+            sign = *ptr++ == '-' ? -1 : 1;
+        for (; ptr < end && *ptr >= '0' && *ptr <= '9' && exponent < 1000000; ptr++, any = 1)
+            exponent = exponent * 10 + (*ptr - '0');
+        if (!any)
+            length = 0;
+        exponent *= sign;
+    }
+
+    scale = (long)(length - point) - exponent;
+    if (!length || ptr != end || scale > 0x3fff) {
+        ALLOCV_END(tmp);
+        return 0;
+    }
+
+    /* leading and trailing zeros carry no digits, the decimal point moves with the leading ones */
+    for (start = 0; start < length && !digits[start]; start++)
+        ;
+    for (count = length - start; count > 0 && !digits[start + count - 1]; count--)
+        ;
+
+    if (!count) {
+        ALLOCV_END(tmp);
+        return typecast_binary_numeric_header(buffer, 0, 0, 0, scale > 0 ? (int)scale : 0);
+    }
+
+    /* pad on the left so the decimal point falls on a base 10000 digit boundary */
+    position = point + exponent - start;
+    pad      = (int)(((-position) % 4 + 4) % 4);
+    weight   = (int)((position + pad) / 4 - 1);
+    ndigits  = (pad + count + 3) / 4;
+
+    if (position + pad > 4L * 32767 || position < -4L * 32767) {
+        ALLOCV_END(tmp);
+        return 0;
     }
+
+    for (n = 0; n < ndigits; n++) {
+        for (digit = 0, i = 0; i < 4; i++) {
+            index = n * 4 + i - pad;
+            digit = digit * 10 + (index >= 0 && index < count ? digits[start + index] : 0);
+        }
+        write_uint16(buffer + 8 + n * 2, digit);
+    }
+
+    ALLOCV_END(tmp);
+    typecast_binary_numeric_header(buffer, ndigits, weight, negative ? NUMERIC_NEG : 0, scale > 0 ? (int)scale : 0);
+    return 8 + (size_t)ndigits * 2;
+}
+
+/* formats the value as text on the stack and hands it to one of the text decoders */
+static VALUE typecast_decode_binary_numeric_text(const char *data, size_t size, typecast_decoder decoder) {
+    VALUE value, buffer;
+    char *text;
+    size_t length = typecast_binary_numeric_size(data, size);
+
+    if (!length)
+        return Qundef;
+
+    text   = ALLOCV_N(char, buffer, length + 1);
+    length = typecast_binary_numeric_text(data, size, text);
+    text[length] = 0;
+
+    value = decoder(text, length);
+    ALLOCV_END(buffer);
+    return value;
+}
+
+static VALUE typecast_decode_binary_numeric(const char *data, size_t size) {
+    return typecast_decode_binary_numeric_text(data, size, typecast_decode_numeric);
+}
+
+/* integral values below 10000^4 are summed up directly from the base 10000 digits */
+static VALUE typecast_decode_binary_numeric_auto(const char *data, size_t size) {
+    int16_t ndigits, weight, n;
+    uint16_t sign;
+    int64_t value = 0;
+
+    if (size >= 8) {
+        ndigits = (int16_t)read_uint16(data);
+        weight  = (int16_t)read_uint16(data + 2);
+        sign    = read_uint16(data + 4);
+
+        if (read_uint16(data + 6) == 0 && (sign == 0 || sign == NUMERIC_NEG) && weight < 4 && ndigits <= weight + 1 &&
+            size >= 8 + (size_t)ndigits * 2) {
+            for (n = 0; n <= weight; n++)
+                value = value * 10000 + (n < ndigits ? (int16_t)read_uint16(data + 8 + n * 2) : 0);
+            return LL2NUM(sign == NUMERIC_NEG ? -value : value);
+        }
+    }
+
+    return typecast_decode_binary_numeric_text(data, size, typecast_decode_numeric_auto);
+}
+
+static VALUE typecast_decode_binary_numeric_float(const char *data, size_t size) {
+    return typecast_decode_binary_numeric_text(data, size, typecast_decode_numeric_float);
+}
+
+static VALUE typecast_decode_binary_numeric_rational(const char *data, size_t size) {
+    return typecast_decode_binary_numeric_text(data, size, typecast_decode_numeric_rational);
+}
+
+void typecast_binary_uuid_text(const char *data, char *buffer) {
+    static const char hex[] = "0123456789abcdef";
+    size_t n;
+
+    for (n = 0; n < 16; n++) {
+        if (n == 4 || n == 6 || n == 8 || n == 10)
+            *buffer++ = '-';
+        *buffer++ = hex[(unsigned char)data[n] >> 4];
+        *buffer++ = hex[(unsigned char)data[n] & 0x0f];
+    }
+}
+
+/* 32 hex digits with optional dashes and braces, the inverse of typecast_binary_uuid_text */
+int typecast_binary_uuid_from_text(const char *data, size_t size, char *buffer) {
+    int hi, lo, n = 0;
+    const char *end = data + size;
+
+    for (; data < end && n < 16; data++) {
+        if (*data == '-' || *data == '{' || *data == '}')
+            continue;
+        if (end - data < 2 || (hi = typecast_hex_digit(data[0])) < 0 || (lo = typecast_hex_digit(data[1])) < 0)
+            return 0;
+        buffer[n++] = (char)(hi << 4 | lo);
+        data++;
+    }
+    while (data < end && *data == '}')
+        data++;
+    return n == 16 && data == end;
+}
+
+static VALUE typecast_decode_binary_uuid(const char *data, size_t size) {
+    char uuid[36];
+
+    if (size != 16)
+        return Qundef;
+
+    typecast_binary_uuid_text(data, uuid);
+    return rb_str_new(uuid, sizeof(uuid));
+}
+
+#define INFINITY_STRING(value) ((value) == INT64_MAX ? rb_str_new2("infinity") : rb_str_new2("-infinity"))
+
+static int typecast_binary_timestamp(const char *data, size_t size, int64_t *usec) {
+    *usec = (int64_t)read_uint64(data);
+    return *usec != INT64_MAX && *usec != INT64_MIN;
+}
+
+static VALUE typecast_decode_binary_timestamp(const char *data, size_t size) {
+    int64_t usec;
+
+    if (size != 8)
+        return Qundef;
+    if (!typecast_binary_timestamp(data, size, &usec))
+        return INFINITY_STRING(usec);
+
+    return datetime_from_epoch_usec(cSwiftDateTime, usec + POSTGRES_EPOCH_USEC, 0);
+}
+
+static VALUE typecast_decode_binary_timestamp_time(const char *data, size_t size) {
+    int64_t usec;
+
+    if (size != 8)
+        return Qundef;
+    if (!typecast_binary_timestamp(data, size, &usec))
+        return INFINITY_STRING(usec);
+
+    return datetime_time_from_epoch_usec(usec + POSTGRES_EPOCH_USEC, 0, 1);
+}
+
+static VALUE typecast_decode_binary_timestamp_epoch(const char *data, size_t size) {
+    int64_t usec;
+
+    if (size != 8)
+        return Qundef;
+    if (!typecast_binary_timestamp(data, size, &usec))
+        return INFINITY_STRING(usec);
+
+    return LL2NUM(usec + POSTGRES_EPOCH_USEC);
+}
+
+static VALUE typecast_decode_binary_date(const char *data, size_t size) {
+    int32_t days;
+
+    if (size != 4)
+        return Qundef;
+
+    days = (int32_t)read_uint32(data);
+    if (days == INT32_MAX)
+        return rb_str_new2("infinity");
+    if (days == INT32_MIN)
+        return rb_str_new2("-infinity");
+
+    return datetime_date_from_days((int64_t)days + POSTGRES_EPOCH_DAYS);
+}
+
+static VALUE typecast_decode_binary_bool(const char *data, size_t size) {
+    return size > 0 && data[0] ? Qtrue : Qfalse;
+}
+
+static VALUE typecast_decode_binary_bytea_string(const char *data, size_t size) {
+    return rb_str_new(data, size);
+}
+
+static VALUE typecast_decode_binary_bytea(const char *data, size_t size) {
+    return rb_funcall(cStringIO, fnew, 1, rb_str_new(data, size));
+}
+
+/* jsonb is a version byte followed by the json text */
+static VALUE typecast_decode_binary_jsonb(const char *data, size_t size) {
+    return size > 0 && data[0] == 1 ? typecast_decode_json(data + 1, size - 1) : Qundef;
+}
+
+static VALUE typecast_decode_binary_jsonb_symbolize(const char *data, size_t size) {
+    return size > 0 && data[0] == 1 ? typecast_decode_json_symbolize(data + 1, size - 1) : Qundef;
+}
+
+static VALUE typecast_decode_binary_int8(const char *data, size_t size) {
+    return size == 8 ? LL2NUM((int64_t)read_uint64(data)) : Qundef;
+}
+
+static VALUE typecast_decode_binary_int2(const char *data, size_t size) {
+    return size == 2 ? INT2FIX((int16_t)read_uint16(data)) : Qundef;
 }
 
-VALUE typecast_description(VALUE types) {
-    VALUE strings = rb_ary_new();
-    for (size_t i = 0; i < RARRAY_LEN(types); i++) {
-        VALUE type = Qnil;
-        int oid = NUM2INT(rb_ary_entry(types, i));
-        for (size_t j = 0; j < sizeof(oid_types) / sizeof(oid_types[0]); j++) {
-            if (oid_types[j].oid == oid) {
-                type = rb_str_new2(oid_types[j].type);
-                break;
+static VALUE typecast_decode_binary_int4(const char *data, size_t size) {
+    return size == 4 ? INT2NUM((int32_t)read_uint32(data)) : Qundef;
+}
+
+static VALUE typecast_decode_binary_float4(const char *data, size_t size) {
+    union { uint32_t i; float f; } f4;
+    if (size != 4)
+        return Qundef;
+    f4.i = read_uint32(data);
+    return rb_float_new(f4.f);
+}
+
+static VALUE typecast_decode_binary_float8(const char *data, size_t size) {
+    union { uint64_t i; double f; } f8;
+    if (size != 8)
+        return Qundef;
+    f8.i = read_uint64(data);
+    return rb_float_new(f8.f);
+}
+
+VALUE typecast_decode_binary(const char *data, size_t size, int oid) {
+    VALUE value;
+    typecast_decoder decoder = typecast_decoder_for(oid, 1, -1, 0);
+    return decoder && (value = decoder(data, size)) != Qundef ? value : Qnil;
+}
+
+/* postgres allows at most 6 dimensions (MAXDIM) */
+#define ARRAY_MAX_DIMENSIONS (6)
+
+/*
+ * Text arrays look like {1,2,NULL}, {{1,2},{3,4}} or {"a \"b\"",c} with an optional [1:2]={...} bounds prefix.
+ * Elements are unescaped in place into a copy of the value and NUL terminated over their delimiter, so the text
+ * element decoders get the same input they would for a scalar column.
+ */
+static VALUE typecast_decode_array_text_list(char **cursor, char *end, int depth, typecast_decoder element) {
+    char c, *r = *cursor, *w, *start;
+    int quoted;
+    VALUE list, value;
+
+    if (depth > ARRAY_MAX_DIMENSIONS || r >= end || *r++ != '{')
+        return Qundef;
+
+    list = rb_ary_new();
+    while (r < end && *r == ' ')
+        r++;
+    if (r < end && *r == '}') {
+        *cursor = r + 1;
+        return list;
+    }
+
+    while (r < end) {
+        while (r < end && *r == ' ')
+            r++;
+        if (r >= end)
+            return Qundef;
+
+        if (*r == '{') {
+            if ((value = typecast_decode_array_text_list(&r, end, depth + 1, element)) == Qundef)
+                return Qundef;
+            while (r < end && *r == ' ')
+                r++;
+            c = r < end ? *r : 0;
+        }
+        else {
+            start = w = r;
+            if ((quoted = (*r == '"'))) {
+                for (r++; r < end && *r != '"'; r++) {
+                    if (*r == '\\' && r + 1 < end)
+                        r++;
+                    *w++ = *r;
+                }
+                if (r++ >= end)
+                    return Qundef;
+                while (r < end && *r == ' ')
+                    r++;
             }
+            else {
+                for (; r < end && *r != ',' && *r != '}'; r++) {
+                    if (*r == '\\' && r + 1 < end)
+                        r++;
+                    *w++ = *r;
+                }
+                while (w > start && w[-1] == ' ')
+                    w--;
+            }
+
+            /* w can catch up with r for unquoted elements, keep the delimiter before terminating */
+            c = r < end ? *r : 0;
+            *w = 0;
+            if (!quoted && w - start == 4 && strncasecmp(start, "NULL", 4) == 0)
+                value = Qnil;
+            else if ((value = element(start, w - start)) == Qundef)
+                value = rb_enc_str_new(start, w - start, rb_utf8_encoding());
+        }
+
+        rb_ary_push(list, value);
+        if (c == '}') {
+            *cursor = r + 1;
+            return list;
+        }
+        if (c != ',')
+            return Qundef;
+        r++;
+    }
+
+    return Qundef;
+}
+
+static VALUE typecast_decode_array_text(const char *data, size_t size, typecast_decoder element) {
+    char *text, *cursor, *end;
+    VALUE value, buffer;
+
+    text = ALLOCV_N(char, buffer, size + 1);
+    memcpy(text, data, size);
+    text[size] = 0;
+
+    cursor = text;
+    end    = text + size;
+    if (*cursor == '[') {
+        while (cursor < end && *cursor != '=')
+            cursor++;
+        cursor++;
+    }
+
+    value = typecast_decode_array_text_list(&cursor, end, 1, element);
+    ALLOCV_END(buffer);
+    return value;
+}
+
+/* binary arrays are ndim, has nulls, element oid, (size, lower bound) per dimension and length prefixed elements */
+static VALUE typecast_decode_array_binary_list(const char **cursor, const char *end, const int32_t *dims, int ndim,
+    typecast_decoder element) {
+
+    int32_t n, length;
+    VALUE value, list = rb_ary_new_capa(dims[0]);
+
+    for (n = 0; n < dims[0]; n++) {
+        if (ndim > 1) {
+            if ((value = typecast_decode_array_binary_list(cursor, end, dims + 1, ndim - 1, element)) == Qundef)
+                return Qundef;
+            rb_ary_push(list, value);
+            continue;
+        }
+
+        if (end - *cursor < 4)
+            return Qundef;
+        length = (int32_t)read_uint32(*cursor);
+        *cursor += 4;
+        if (length < 0) {
+            rb_ary_push(list, Qnil);
+            continue;
+        }
+        if (end - *cursor < length)
+            return Qundef;
+        if ((value = element(*cursor, length)) == Qundef)
+            value = rb_str_new(*cursor, length);
+        rb_ary_push(list, value);
+        *cursor += length;
+    }
+
+    return list;
+}
+
+static VALUE typecast_decode_array_binary(const char *data, size_t size, typecast_decoder element) {
+    int32_t n, ndim, dims[ARRAY_MAX_DIMENSIONS];
+    const char *cursor = data + 12, *end = data + size;
+
+    if (size < 12)
+        return Qundef;
+
+    ndim = (int32_t)read_uint32(data);
+    if (ndim == 0)
+        return rb_ary_new();
+    if (ndim < 0 || ndim > ARRAY_MAX_DIMENSIONS || size < 12 + (size_t)ndim * 8)
+        return Qundef;
+
+    for (n = 0; n < ndim; n++, cursor += 8) {
+        if ((dims[n] = (int32_t)read_uint32(cursor)) < 0)
+            return Qundef;
+    }
+
+    return typecast_decode_array_binary_list(&cursor, end, dims, ndim, element);
+}
+
+VALUE typecast_decode_array(const char *data, size_t size, int format, typecast_decoder element) {
+    return format ? typecast_decode_array_binary(data, size, element) : typecast_decode_array_text(data, size, element);
+}
+
+/* uuid text has no decoder of its own, elements without one stay strings */
+typecast_decoder typecast_element_decoder_for(int oid, int format, int typmod, int flags) {
+    typecast_decoder decoder = typecast_decoder_for(oid, format, typmod, flags);
+    return decoder ? decoder : typecast_decode_text;
+}
+
+/* element decoder for the supported array types, NULL for everything else */
+typecast_decoder typecast_array_decoder_for(int oid, int format, int typmod, int flags) {
+    int element;
+
+    switch (oid) {
+        case 1000: element = 16;   break;
+        case 1005: element = 21;   break;
+        case 1007: element = 23;   break;
+        case 1016: element = 20;   break;
+        case 1021: element = 700;  break;
+        case 1022: element = 701;  break;
+        case 1009:
+        case 1014:
+        case 1015: element = 25;   break;
+        case 1115: element = 1114; break;
+        case 1182: element = 1082; break;
+        case 1185: element = 1184; break;
+        case 1231: element = 1700; break;
+        case 2951: element = 2950; break;
+        /* json arrays stay strings unless json is parsed */
+        case 199:
+        case 3807:
+            if (!(flags & TYPECAST_JSON_PARSE))
+                return 0;
+            element = oid == 199 ? 114 : 3802;
+            break;
+        default:   return 0;
+    }
+
+    return typecast_element_decoder_for(element, format, typmod, flags);
+}
+
+/* numeric typmod is ((precision << 16) | scale) + VARHDRSZ, -1 when unconstrained */
+static typecast_decoder typecast_numeric_decoder_for(int format, int typmod, int flags) {
+    if (flags & TYPECAST_NUMERIC_FLOAT)
+        return format ? typecast_decode_binary_numeric_float : typecast_decode_numeric_float;
+    if (flags & TYPECAST_NUMERIC_RATIONAL)
+        return format ? typecast_decode_binary_numeric_rational : typecast_decode_numeric_rational;
+    if (flags & TYPECAST_NUMERIC_AUTO) {
+        if (format)
+            return typecast_decode_binary_numeric_auto;
+        return typmod >= 4 && ((typmod - 4) & 0xffff) == 0 ? typecast_decode_numeric_integer : typecast_decode_numeric_auto;
+    }
+    return format ? typecast_decode_binary_numeric : typecast_decode_numeric;
+}
+
+static typecast_decoder typecast_json_decoder_for(int oid, int format, int flags) {
+    if (!(flags & TYPECAST_JSON_PARSE))
+        return 0;
+    if (format && oid == 3802)
+        return flags & TYPECAST_JSON_SYMBOLIZE ? typecast_decode_binary_jsonb_symbolize : typecast_decode_binary_jsonb;
+    return flags & TYPECAST_JSON_SYMBOLIZE ? typecast_decode_json_symbolize : typecast_decode_json;
+}
+
+/* resolved once per result column, NULL if the type needs to go through the custom decoder */
+typecast_decoder typecast_decoder_for(int oid, int format, int typmod, int flags) {
+    if (format) {
+        switch (oid) {
+            case 16:   return typecast_decode_binary_bool;
+            case 17:   return flags & TYPECAST_BYTEA_STRING ? typecast_decode_binary_bytea_string : typecast_decode_binary_bytea;
+            case 20:   return typecast_decode_binary_int8;
+            case 21:   return typecast_decode_binary_int2;
+            case 23:   return typecast_decode_binary_int4;
+            case 18:
+            case 19:
+            case 25:   return typecast_decode_text;
+            case 700:  return typecast_decode_binary_float4;
+            case 701:  return typecast_decode_binary_float8;
+            case 1700: return typecast_numeric_decoder_for(format, typmod, flags);
+            case 1114:
+            case 1184:
+                if (flags & TYPECAST_TIMESTAMP_EPOCH)
+                    return typecast_decode_binary_timestamp_epoch;
+                if (flags & TYPECAST_TIMESTAMP_TIME)
+                    return typecast_decode_binary_timestamp_time;
+                return typecast_decode_binary_timestamp;
+            case 1082: return typecast_decode_binary_date;
+            case 2950: return typecast_decode_binary_uuid;
+            case 114:
+            case 3802: return typecast_json_decoder_for(oid, format, flags);
+            default:   return 0;
         }
-        rb_ary_push(strings, type);
     }
-    return strings;
+
+    switch (oid) {
+        case 16:   return typecast_decode_bool;
+        case 17:   return flags & TYPECAST_BYTEA_STRING ? typecast_decode_bytea_string : typecast_decode_bytea;
+        case 20:
+        case 21:
+        case 23:   return typecast_decode_integer;
+        case 18:
+        case 19:
+        case 25:   return typecast_decode_text;
+        case 700:
+        case 701:  return typecast_decode_float;
+        case 1700: return typecast_numeric_decoder_for(format, typmod, flags);
+        case 1114:
+        case 1184:
+            if (flags & TYPECAST_TIMESTAMP_EPOCH)
+                return typecast_decode_timestamp_epoch;
+            if (flags & TYPECAST_TIMESTAMP_TIME)
+                return typecast_decode_timestamp_time;
+            return typecast_decode_timestamp;
+        case 1082: return typecast_decode_date;
+        case 114:
+        case 3802: return typecast_json_decoder_for(oid, format, flags);
+        default:   return 0;
+    }
 }
 
-VALUE typecast_typemap(void) {
-    VALUE typemap = rb_hash_new();
-    for (size_t i = 0; i < sizeof(oid_types) / sizeof(oid_types[0]); i++)
-        rb_hash_aset(typemap, INT2FIX(oid_types[i].oid), rb_str_new2(oid_types[i].type));
-    return typemap;
+/* true if values of the type have a native decoder in at least one format */
+int typecast_decodable(int oid) {
+    int flags = TYPECAST_JSON_PARSE;
+    return typecast_decoder_for(oid, 0, -1, flags) || typecast_decoder_for(oid, 1, -1, flags)
+        || typecast_array_decoder_for(oid, 0, -1, flags);
 }
 
 void init_swift_db_postgres_typecast() {
@@ -172,10 +1033,16 @@ void init_swift_db_postgres_typecast() {
     cStringIO   = CONST_GET(rb_mKernel, "StringIO");
     cBigDecimal = CONST_GET(rb_mKernel, "BigDecimal");
     cDateTime   = CONST_GET(rb_mKernel, "DateTime");
+    cDate       = CONST_GET(rb_mKernel, "Date");
     fnew        = rb_intern("new");
     fto_date    = rb_intern("to_date");
+    fto_time    = rb_intern("to_time");
     fstrftime   = rb_intern("strftime");
+    fjd         = rb_intern("jd");
+    fbigdecimal = rb_intern("BigDecimal");
     dtformat    = rb_str_new2("%F %T.%N %z");
+    sdecimal    = rb_str_new2("F");
 
     rb_global_variable(&dtformat);
+    rb_global_variable(&sdecimal);
 }
@@ -6,9 +6,82 @@
 
 #include "common.h"
 
+/* decodes a single non-null value from a result, Qundef if it can't be decoded */
+typedef VALUE (*typecast_decoder)(const char *, size_t);
+
+/* encoded scalars fit in this many bytes */
+#define TYPECAST_SCALAR_SIZE (64)
+
+/* adapter options that pick between decoders */
+#define TYPECAST_TIMESTAMP_TIME   (1 << 0)
+#define TYPECAST_TIMESTAMP_EPOCH  (1 << 1)
+#define TYPECAST_NUMERIC_AUTO     (1 << 2)
+#define TYPECAST_NUMERIC_RATIONAL (1 << 3)
+#define TYPECAST_NUMERIC_FLOAT    (1 << 4)
+#define TYPECAST_BYTEA_STRING     (1 << 5)
+#define TYPECAST_JSON_PARSE       (1 << 6)
+#define TYPECAST_JSON_SYMBOLIZE   (1 << 7)
+
+#define DAY_USEC (86400000000LL)
+
+/* postgres binary formats count from 2000-01-01 */
+#define POSTGRES_EPOCH_DAYS (10957)
+#define POSTGRES_EPOCH_USEC (946684800000000LL)
+
+#define NUMERIC_NEG  0x4000
+#define NUMERIC_NAN  0xC000
+#define NUMERIC_PINF 0xD000
+#define NUMERIC_NINF 0xF000
+
+/* binary format values are in network byte order */
+static inline uint16_t read_uint16(const char *data) {
+    const unsigned char *p = (const unsigned char *)data;
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t read_uint32(const char *data) {
+    const unsigned char *p = (const unsigned char *)data;
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+static inline uint64_t read_uint64(const char *data) {
+    return (uint64_t)read_uint32(data) << 32 | read_uint32(data + 4);
+}
+
+static inline void write_uint16(char *data, uint16_t value) {
+    unsigned char *p = (unsigned char *)data;
+    p[0] = value >> 8;
+    p[1] = value;
+}
+
+static inline void write_uint32(char *data, uint32_t value) {
+    unsigned char *p = (unsigned char *)data;
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static inline void write_uint64(char *data, uint64_t value) {
+    write_uint32(data, (uint32_t)(value >> 32));
+    write_uint32(data + 4, (uint32_t)value);
+}
+
 DLL_PRIVATE VALUE typecast_to_str(VALUE);
 DLL_PRIVATE VALUE typecast_encode(VALUE);
+DLL_PRIVATE int   typecast_encode_text(VALUE, char *);
+DLL_PRIVATE int   typecast_encode_binary(VALUE, Oid, char *);
+DLL_PRIVATE Oid   typecast_encode_oid(VALUE);
 DLL_PRIVATE VALUE typecast_decode(const char *, size_t, int);
-DLL_PRIVATE VALUE typecast_description(VALUE types);
-DLL_PRIVATE VALUE typecast_typemap(void);
+DLL_PRIVATE VALUE typecast_decode_binary(const char *, size_t, int);
+DLL_PRIVATE typecast_decoder typecast_decoder_for(int, int, int, int);
+DLL_PRIVATE typecast_decoder typecast_array_decoder_for(int, int, int, int);
+DLL_PRIVATE typecast_decoder typecast_element_decoder_for(int, int, int, int);
+DLL_PRIVATE VALUE typecast_decode_array(const char *, size_t, int, typecast_decoder);
+DLL_PRIVATE int   typecast_decodable(int);
+DLL_PRIVATE size_t typecast_binary_numeric_size(const char *, size_t);
+DLL_PRIVATE size_t typecast_binary_numeric_text(const char *, size_t, char *);
+DLL_PRIVATE void   typecast_binary_uuid_text(const char *, char *);
+DLL_PRIVATE size_t typecast_binary_numeric_from_text(const char *, size_t, char *);
+DLL_PRIVATE int    typecast_binary_uuid_from_text(const char *, size_t, char *);
 DLL_PRIVATE void  init_swift_db_postgres_typecast();
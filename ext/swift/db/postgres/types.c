@@ -0,0 +1,395 @@
+// vim:ts=4:sts=4:sw=4:expandtab
+
+// (c) Bharanee Rathna 2012
+
+#include "types.h"
+#include "typecast.h"
+#include <stdlib.h>
+
+/*
+ * Per connection oid to type table, an open addressing hash with linear probing that is at most half full. Builtin
+ * types are seeded from the table below, everything else comes from pg_type when connecting and is shared between
+ * connections to the same database. Domains resolve to their base type, enums and string like extension types
+ * (citext, hstore) to text, arrays of those to their resolved element type. Array names are spelled the way
+ * format_type gives them for discovered types, integer[] and so on.
+ */
+
+const static struct {
+    int oid;
+    const char *type;
+} oid_types[] = {
+    {16, "boolean"},
+    {17, "bytea"},
+    {18, "char"},
+    {19, "name"},
+    {20, "bigint"},
+    {21, "smallint"},
+    {23, "integer"},
+    {25, "text"},
+    {114, "json"},
+    {142, "xml"},
+    {199, "json[]"},
+    {600, "point"},
+    {601, "lseg"},
+    {602, "path"},
+    {603, "box"},
+    {604, "polygon"},
+    {628, "line"},
+    {650, "cidr"},
+    {700, "real"},
+    {701, "double precision"},
+    {702, "abstime"},
+    {703, "reltime"},
+    {704, "tinterval"},
+    {718, "circle"},
+    {774, "macaddr8"},
+    {790, "money"},
+    {829, "macaddr"},
+    {869, "inet"},
+    {1000, "boolean[]"},
+    {1005, "smallint[]"},
+    {1007, "integer[]"},
+    {1009, "text[]"},
+    {1014, "character[]"},
+    {1015, "character varying[]"},
+    {1016, "bigint[]"},
+    {1021, "real[]"},
+    {1022, "double precision[]"},
+    {1042, "character"},
+    {1043, "character varying"},
+    {1082, "date"},
+    {1083, "time without time zone"},
+    {1114, "timestamp without time zone"},
+    {1184, "timestamp with time zone"},
+    {1115, "timestamp without time zone[]"},
+    {1182, "date[]"},
+    {1185, "timestamp with time zone[]"},
+    {1186, "interval"},
+    {1231, "numeric[]"},
+    {1266, "time with time zone"},
+    {1560, "bit"},
+    {1562, "bit varying"},
+    {1700, "numeric"},
+    {2277, "anyarray"},
+    {2283, "anyelement"},
+    {2776, "anynonarray"},
+    {2950, "uuid"},
+    {2951, "uuid[]"},
+    {3500, "anyenum"},
+    {3614, "tsvector"},
+    {3615, "tsquery"},
+    {3642, "gtsvector"},
+    {3802, "jsonb"},
+    {3807, "jsonb[]"},
+    {3831, "anyrange"},
+    {3904, "int4range"},
+    {3906, "numrange"},
+    {3908, "tsrange"},
+    {3910, "tstzrange"},
+    {3912, "daterange"},
+    {3926, "int8range"}
+};
+
+#define TYPES_MIN_CAPACITY (256)
+#define TYPES_MAX_DEPTH    (8)
+
+#define TYPES_SQL "select oid, format_type(oid, null), typtype, typbasetype, typelem, typcategory, typname " \
+                  "from pg_type where typtype in ('b', 'd', 'e', 'r', 'm')"
+
+typedef struct TypeMap {
+    TypeEntry *entries;
+    size_t size;
+    size_t capacity;
+} TypeMap;
+
+/* builtin types and discovered types keyed by host:port/db */
+static VALUE builtin, servers;
+
+static void db_postgres_types_mark(TypeMap *m) {
+    size_t n;
+    for (n = 0; n < m->capacity; n++) {
+        if (!m->entries[n].oid)
+            continue;
+        if (m->entries[n].name)
+            rb_gc_mark(m->entries[n].name);
+        if (m->entries[n].decoder)
+            rb_gc_mark(m->entries[n].decoder);
+    }
+}
+
+static void db_postgres_types_free(TypeMap *m) {
+    free(m->entries);
+    free(m);
+}
+
+static TypeMap* db_postgres_types_handle(VALUE map) {
+    TypeMap *m;
+    Data_Get_Struct(map, TypeMap, m);
+    return m;
+}
+
+static VALUE db_postgres_types_allocate(size_t capacity) {
+    TypeMap *m = (TypeMap *)malloc(sizeof(TypeMap));
+    if (!m)
+        rb_raise(rb_eNoMemError, "type map");
+
+    if (!(m->entries = (TypeEntry *)calloc(capacity, sizeof(TypeEntry)))) {
+        free(m);
+        rb_raise(rb_eNoMemError, "type map");
+    }
+
+    m->size     = 0;
+    m->capacity = capacity;
+    return Data_Wrap_Struct(rb_cObject, db_postgres_types_mark, db_postgres_types_free, m);
+}
+
+static VALUE db_postgres_types_copy(VALUE map) {
+    TypeMap *m = db_postgres_types_handle(map);
+    VALUE copy = db_postgres_types_allocate(m->capacity);
+    TypeMap *c = db_postgres_types_handle(copy);
+
+    memcpy(c->entries, m->entries, sizeof(TypeEntry) * m->capacity);
+    c->size = m->size;
+    return copy;
+}
+
+static inline size_t db_postgres_types_slot(TypeMap *m, Oid oid) {
+    return ((uint32_t)oid * 2654435761u) & (m->capacity - 1);
+}
+
+static TypeEntry* db_postgres_types_find(TypeMap *m, Oid oid) {
+    size_t n;
+    for (n = db_postgres_types_slot(m, oid); m->entries[n].oid; n = (n + 1) & (m->capacity - 1)) {
+        if (m->entries[n].oid == oid)
+            return m->entries + n;
+    }
+    return 0;
+}
+
+static void db_postgres_types_grow(TypeMap *m) {
+    size_t n, slot, capacity = m->capacity;
+    TypeEntry *entries = m->entries;
+
+    if (!(m->entries = (TypeEntry *)calloc(capacity * 2, sizeof(TypeEntry)))) {
+        m->entries = entries;
+        rb_raise(rb_eNoMemError, "type map");
+    }
+
+    m->capacity = capacity * 2;
+    for (n = 0; n < capacity; n++) {
+        if (!entries[n].oid)
+            continue;
+        for (slot = db_postgres_types_slot(m, entries[n].oid); m->entries[slot].oid; slot = (slot + 1) & (m->capacity - 1))
+            ;
+        m->entries[slot] = entries[n];
+    }
+    free(entries);
+}
+
+/* entries move when the table grows, do not hold on to them across inserts */
+static TypeEntry* db_postgres_types_insert(TypeMap *m, Oid oid) {
+    size_t n;
+    TypeEntry *entry;
+
+    if ((entry = db_postgres_types_find(m, oid)))
+        return entry;
+
+    if ((m->size + 1) * 2 > m->capacity)
+        db_postgres_types_grow(m);
+
+    for (n = db_postgres_types_slot(m, oid); m->entries[n].oid; n = (n + 1) & (m->capacity - 1))
+        ;
+
+    m->size++;
+    m->entries[n].oid = oid;
+    return m->entries + n;
+}
+
+TypeEntry* db_postgres_types_lookup(VALUE map, Oid oid) {
+    return db_postgres_types_find(db_postgres_types_handle(map), oid);
+}
+
+/* follows domains down to a builtin, 0 if there is none */
+static Oid db_postgres_types_resolve(TypeMap *m, Oid oid, Oid *element, int *text) {
+    int depth;
+    TypeEntry *entry;
+
+    for (depth = 0; depth < TYPES_MAX_DEPTH && oid; depth++) {
+        if (!(entry = db_postgres_types_find(m, oid)))
+            return 0;
+        if (entry->text)
+            *text = 1;
+        if (entry->base == entry->oid)
+            return oid;
+        if (!entry->base) {
+            if (element)
+                *element = entry->element;
+            return 0;
+        }
+        oid = entry->base;
+    }
+    return 0;
+}
+
+static VALUE db_postgres_types_discover(Adapter *a) {
+    size_t n, rows;
+    Oid element;
+    int text;
+    PGresult *result;
+    TypeEntry *entry;
+    const char *typname;
+    char typtype, typcategory;
+
+    VALUE map  = db_postgres_types_copy(builtin);
+    TypeMap *m = db_postgres_types_handle(map);
+    Query q    = {.connection = a->connection, .command = TYPES_SQL};
+
+    /* discovery is best effort, connections that cannot read pg_type still get the builtin types */
+    result = db_postgres_adapter_exec(a, &q, QUERY_SIMPLE);
+    if (PQresultStatus(result) != PGRES_TUPLES_OK) {
+        PQclear(result);
+        return map;
+    }
+
+    rows = PQntuples(result);
+    for (n = 0; n < rows; n++) {
+        entry = db_postgres_types_insert(m, (Oid)strtoul(PQgetvalue(result, n, 0), 0, 10));
+        if (!entry->name)
+            entry->name = rb_obj_freeze(rb_enc_str_new(PQgetvalue(result, n, 1), PQgetlength(result, n, 1), rb_utf8_encoding()));
+        if (entry->base)
+            continue;
+
+        typtype     = PQgetvalue(result, n, 2)[0];
+        typcategory = PQgetvalue(result, n, 5)[0];
+        typname     = PQgetvalue(result, n, 6);
+
+        if (typtype == 'd')
+            entry->base = (Oid)strtoul(PQgetvalue(result, n, 3), 0, 10);
+        else if (typtype == 'e' || typcategory == 'S')
+            entry->base = 25;
+        else if (strcmp(typname, "hstore") == 0) {
+            entry->base = 25;
+            entry->text = 1;
+        }
+        else if (typcategory == 'A')
+            entry->element = (Oid)strtoul(PQgetvalue(result, n, 4), 0, 10);
+    }
+    PQclear(result);
+
+    for (n = 0; n < m->capacity; n++) {
+        entry = m->entries + n;
+        if (!entry->oid || entry->base == entry->oid)
+            continue;
+
+        text    = entry->text;
+        element = entry->element;
+        if (entry->base)
+            entry->base = db_postgres_types_resolve(m, entry->base, &element, &text);
+        entry->element = element ? db_postgres_types_resolve(m, element, 0, &text) : 0;
+        entry->text    = text;
+    }
+
+    return map;
+}
+
+VALUE db_postgres_types_load(Adapter *a, int discover, int reload) {
+    VALUE key, map;
+
+    if (!discover)
+        return db_postgres_types_copy(builtin);
+
+    key = rb_sprintf("%s:%s/%s", PQhost(a->connection), PQport(a->connection), PQdb(a->connection));
+    if (reload || NIL_P(map = rb_hash_lookup(servers, key))) {
+        map = db_postgres_types_discover(a);
+        rb_hash_aset(servers, key, map);
+    }
+
+    return db_postgres_types_copy(map);
+}
+
+static Oid db_postgres_types_oid(TypeMap *m, VALUE type) {
+    size_t n;
+
+    if (FIXNUM_P(type))
+        return (Oid)NUM2UINT(type);
+
+    if (TYPE(type) == T_STRING || TYPE(type) == T_SYMBOL) {
+        type = TO_S(type);
+        for (n = 0; n < m->capacity; n++) {
+            if (m->entries[n].oid && m->entries[n].name && rb_str_equal(m->entries[n].name, type) == Qtrue)
+                return m->entries[n].oid;
+        }
+        rb_raise(eSwiftArgumentError, "unknown type %s", RSTRING_PTR(type));
+    }
+
+    rb_raise(eSwiftArgumentError, "type needs to be an oid or a type name");
+}
+
+VALUE db_postgres_types_register(VALUE map, VALUE type, VALUE decoder) {
+    Oid oid, base;
+    TypeEntry *entry, *native;
+    TypeMap *m = db_postgres_types_handle(map);
+
+    oid = db_postgres_types_oid(m, type);
+    if (rb_respond_to(decoder, rb_intern("call"))) {
+        entry = db_postgres_types_insert(m, oid);
+        entry->decoder = decoder;
+        return decoder;
+    }
+
+    base = db_postgres_types_oid(m, decoder);
+    if (!(native = db_postgres_types_find(m, base)) || (!native->base && !native->element))
+        rb_raise(eSwiftArgumentError, "no native decoder for type %s", CSTRING(decoder));
+
+    /* the insert may grow the table and move native */
+    entry          = db_postgres_types_insert(m, oid);
+    native         = db_postgres_types_find(m, base);
+    entry->base    = native->base;
+    entry->element = native->element;
+    entry->text    = native->text;
+    entry->decoder = 0;
+    return decoder;
+}
+
+VALUE db_postgres_types_description(VALUE map, VALUE oids) {
+    long n;
+    TypeEntry *entry;
+    VALUE names = rb_ary_new_capa(RARRAY_LEN(oids));
+    TypeMap *m  = db_postgres_types_handle(map);
+
+    for (n = 0; n < RARRAY_LEN(oids); n++) {
+        entry = db_postgres_types_find(m, (Oid)NUM2UINT(rb_ary_entry(oids, n)));
+        rb_ary_push(names, entry && entry->name ? entry->name : Qnil);
+    }
+    return names;
+}
+
+VALUE db_postgres_types_typemap(VALUE map) {
+    size_t n;
+    VALUE typemap = rb_hash_new();
+    TypeMap *m    = db_postgres_types_handle(map);
+
+    for (n = 0; n < m->capacity; n++) {
+        if (m->entries[n].oid && m->entries[n].name)
+            rb_hash_aset(typemap, UINT2NUM(m->entries[n].oid), m->entries[n].name);
+    }
+    return typemap;
+}
+
+void init_swift_db_postgres_types() {
+    size_t n;
+    TypeEntry *entry;
+    TypeMap *m;
+
+    builtin = db_postgres_types_allocate(TYPES_MIN_CAPACITY);
+    servers = rb_hash_new();
+    rb_global_variable(&builtin);
+    rb_global_variable(&servers);
+
+    m = db_postgres_types_handle(builtin);
+    for (n = 0; n < sizeof(oid_types) / sizeof(oid_types[0]); n++) {
+        entry       = db_postgres_types_insert(m, oid_types[n].oid);
+        entry->name = rb_obj_freeze(rb_str_new2(oid_types[n].type));
+        entry->base = typecast_decodable(oid_types[n].oid) ? oid_types[n].oid : 0;
+    }
+}
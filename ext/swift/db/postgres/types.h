@@ -0,0 +1,30 @@
+// vim:ts=4:sts=4:sw=4:expandtab
+
+// (c) Bharanee Rathna 2012
+
+#pragma once
+
+#include "common.h"
+#include "adapter.h"
+
+/*
+ * base is the builtin type whose decoder applies to values of this type, the type itself for builtins and 0 when
+ * there is no native decoder. element is the resolved base of the element type for arrays of non builtin types.
+ * text is set when the base decoder only understands the text format, hstore sends pairs in binary.
+ */
+typedef struct TypeEntry {
+    Oid oid;
+    Oid base;
+    Oid element;
+    int text;
+    VALUE name;
+    VALUE decoder;
+} TypeEntry;
+
+void init_swift_db_postgres_types();
+
+DLL_PRIVATE VALUE      db_postgres_types_load(Adapter *, int discover, int reload);
+DLL_PRIVATE TypeEntry* db_postgres_types_lookup(VALUE, Oid);
+DLL_PRIVATE VALUE      db_postgres_types_register(VALUE, VALUE type, VALUE decoder);
+DLL_PRIVATE VALUE      db_postgres_types_description(VALUE, VALUE oids);
+DLL_PRIVATE VALUE      db_postgres_types_typemap(VALUE);
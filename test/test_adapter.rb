@@ -1,4 +1,5 @@
 require 'helper'
+require 'tempfile'
 
 describe 'postgres adapter' do
   describe '#new' do
@@ -15,6 +16,19 @@ describe 'postgres adapter' do
     end
   end
 
+  describe '.connect' do
+    it 'should open connections concurrently' do
+      pool = Swift::DB::Postgres.connect(3, db: 'swift_test')
+      assert_equal 3, pool.size
+      assert_equal [1, 2, 3], pool.each_with_index.map {|conn, n| conn.execute('select ?::int as n', n + 1).first[:n]}
+      assert_equal 3, pool.map(&:fileno).uniq.size
+    end
+
+    it 'should raise connection error when any connection fails' do
+      assert_raises(Swift::ConnectionError) {Swift::DB::Postgres.connect(2, db: 'swift_test', encoding: 'not_awesome')}
+    end
+  end
+
   describe '#execute' do
     it 'should execute sql' do
       assert db.execute("select * from pg_tables")
@@ -33,6 +47,51 @@ describe 'postgres adapter' do
     end
   end
 
+  describe '#transaction' do
+    before do
+      db.execute('drop table if exists accounts')
+      db.execute('create table accounts(name text)')
+    end
+
+    it 'should commit and roll back nested transactions' do
+      db.transaction do
+        db.execute('insert into accounts values(?)', 'a')
+        assert_raises(RuntimeError) do
+          db.transaction {db.execute('insert into accounts values(?)', 'b'); raise 'inner'}
+        end
+        db.transaction {db.execute('insert into accounts values(?)', 'c')}
+      end
+
+      assert_equal %w(a c), db.execute('select name from accounts order by name').map {|row| row[:name]}
+    end
+
+    it 'should roll back failed statements to the savepoint' do
+      db.transaction do
+        assert_raises(Swift::RuntimeError) {db.transaction {db.execute('select * from missing_table')}}
+        db.execute('insert into accounts values(?)', 'a')
+      end
+
+      assert_equal 1, db.execute('select count(*) as n from accounts').first[:n]
+    end
+
+    it 'should not start a transaction without statements' do
+      assert_equal true,  db.begin
+      assert_equal '1',   db.begin
+      assert_equal true,  db.commit('1')
+      assert_equal true,  db.rollback
+      assert_equal false, db.rollback
+    end
+
+    it 'should track transactions ended with sql' do
+      db.begin
+      db.execute('insert into accounts values(?)', 'a')
+      db.execute('commit')
+
+      assert_equal false, db.commit
+      assert_equal 1, db.execute('select count(*) as n from accounts').first[:n]
+    end
+  end
+
   describe '#close' do
     it 'should close handle' do
       assert db.ping
@@ -96,6 +155,32 @@ describe 'postgres adapter' do
       assert_equal 9, db.execute('select count(*) as count from users').first[:count]
     end
 
+    it 'should write from files and pipes' do
+      assert db.execute('drop table if exists users')
+      assert db.execute('create table users(id serial primary key, name text)')
+
+      Tempfile.create('users') do |file|
+        file.write("foo\nbar\nbaz\n")
+        file.rewind
+        assert_equal 3, db.write('users', %w(name), file).affected_rows
+
+        file.rewind
+        file.gets
+        assert_equal 2, db.write('users', %w(name), file).affected_rows
+      end
+
+      reader, writer = IO.pipe
+      Thread.new { 1000.times {|n| writer.write("user #{n}\n")}; writer.close }
+      assert_equal 1000, db.write('users', %w(name), reader).affected_rows
+
+      reader, writer = IO.pipe
+      writer.write("header\nqux\nquux\n")
+      writer.close
+      reader.gets
+      assert_equal 2, db.write('users', %w(name), reader).affected_rows
+      assert_equal 1007, db.execute('select count(*) as count from users').first[:count]
+    end
+
     it 'should raise errors on invalid args' do
       assert_raises(Swift::RuntimeError) { db.write("foo") }
       assert_raises(Swift::RuntimeError) { db.write("users", "bar") }
@@ -103,6 +188,44 @@ describe 'postgres adapter' do
     end
   end
 
+  describe '#write_rows' do
+    before do
+      db.execute('drop table if exists events')
+      db.execute('create table events(id int, name text, price numeric(10,2), at timestamp, ok boolean, data bytea)')
+    end
+
+    it 'should copy rows in text and binary format' do
+      at = Time.utc(2012, 1, 2, 3, 4, 5)
+
+      %i(text binary).each do |format|
+        # each copy reads the StringIO to the end, so every pass needs fresh rows
+        rows = [[1, "tab\there\nnew \\ line", BigDecimal('12.50'), at, true, StringIO.new("\x00\xff")], [2, nil, nil, nil, false, nil]]
+        db.execute('truncate events')
+        assert_equal 2, db.write_rows('events', %w(id name price at ok data), rows, format).affected_rows
+
+        result = db.execute('select * from events order by id').to_a
+        assert_equal "tab\there\nnew \\ line", result[0][:name]
+        assert_equal BigDecimal('12.50'), result[0][:price]
+        assert_equal at, result[0][:at].to_time.utc
+        assert_equal [true, false], result.map {|row| row[:ok]}
+        assert_equal "\x00\xff".b, result[0][:data].read
+        assert_equal [nil, nil, nil, nil], result[1].values_at(:name, :price, :at, :data)
+      end
+    end
+
+    it 'should copy rows from an enumerator' do
+      assert_equal 100, db.write_rows('events', %w(id name), (1..100).lazy.map {|n| [n, "name #{n}"]}).affected_rows
+      assert_equal 5050, db.execute('select sum(id) as sum from events').first[:sum]
+    end
+
+    it 'should abort the copy on invalid rows' do
+      assert_raises(Swift::ArgumentError) { db.write_rows('events', %w(id name), [[1, 'a'], [2]]) }
+      assert_raises(Swift::ArgumentError) { db.write_rows('events', %w(id ok), [[1, 'maybe']], :binary) }
+      assert_raises(Swift::ArgumentError) { db.write_rows('events', %w(id), [[1]], :csv) }
+      assert_equal 0, db.execute('select count(*) as count from events').first[:count]
+    end
+  end
+
   describe '#read' do
     it 'should support #read' do
       assert db.execute('drop table if exists users')
@@ -117,9 +240,134 @@ describe 'postgres adapter' do
       db.read('users') {|row| rows << row}
       assert_equal ["1\tfoo\n", "2\tbar\n", "3\tbaz\n"], rows
     end
+
+    it 'should write to files and pipes' do
+      assert db.execute('drop table if exists users')
+      assert db.execute('create table users(id serial primary key, name text)')
+      assert db.execute('insert into users(name) select \'user \' || n from generate_series(1, 1000) as n')
+
+      Tempfile.create('users') do |file|
+        result = db.read('users', %w(name), file)
+        assert_equal 1000, result.affected_rows
+        assert_equal file.size, result.copied_bytes
+        assert_equal "user 1\n", file.tap(&:rewind).gets
+      end
+
+      reader, writer = IO.pipe
+      lines  = Thread.new { reader.readlines }
+      assert_equal 1000, db.read('users', writer).affected_rows
+      writer.close
+      assert_equal 1000, lines.value.size
+    end
+  end
+
+  describe '#read_rows' do
+    before do
+      db.execute('drop table if exists events')
+      db.execute('create table events(id int, name text, price numeric(10,2), tags text[])')
+      db.execute('insert into events values (?, ?, ?, ?), (?, ?, ?, ?)', 1, "a\tb\\c", '12.50', '{x,y}', 2, nil, nil, nil)
+    end
+
+    it 'should yield typed rows in text and binary format' do
+      %i(text binary).each do |format|
+        rows = []
+        assert_equal 2, db.read_rows('events', nil, format: format) {|row| rows << row}.affected_rows
+        assert_equal [[1, "a\tb\\c", BigDecimal('12.50'), %w(x y)], [2, nil, nil, nil]], rows.sort_by(&:first)
+      end
+    end
+
+    it 'should read selected fields, queries and batches' do
+      assert_equal [[1], [2]], db.read_rows('events', %w(id)).to_a.sort
+      assert_equal [['a'], [nil]], db.read_rows('select substr(name, 1, 1) from events order by id').to_a
+
+      batches = []
+      db.read_rows('select generate_series(1, 5)', batch: 2) {|rows| batches << rows}
+      assert_equal [[[1], [2]], [[3], [4]], [[5]]], batches
+    end
+
+    it 'should read quoted table names with spaces' do
+      db.execute('drop table if exists "order items"')
+      db.execute('create table "order items"(id int)')
+      db.execute('insert into "order items" values (1), (2)')
+
+      assert_equal [[1], [2]], db.read_rows('"order items"', %w(id)).to_a.sort
+      assert_equal [[2]], db.read_rows(' (select max(id) from "order items")').to_a
+    end
+
+    it 'should discard the rest of the copy when the block breaks' do
+      db.read_rows('select generate_series(1, 100000)') {|row| break}
+      assert_equal 1, db.execute('select 1 as one').first[:one]
+    end
+
+    it 'should raise errors on invalid args' do
+      assert_raises(Swift::ArgumentError) { db.read_rows('events', nil, format: :csv) {} }
+      assert_raises(Swift::ArgumentError) { db.read_rows('events', nil, batch: 0) {} }
+      assert_raises(Swift::ArgumentError) { db.read_rows('select 1', %w(id)) {} }
+    end
+  end
+
+  describe '#max_result_size' do
+    after do
+      db.max_result_size = nil
+    end
+
+    it 'should buffer results within the limit' do
+      db.max_result_size = 1_000_000
+      result = db.execute('select n from generate_series(1, ?) as n', 100)
+      assert_equal 100, result.selected_rows
+      assert_equal (1..100).to_a, result.map {|row| row[:n]}
+    end
+
+    it 'should cancel results over the limit and recover' do
+      db.max_result_size = 100_000
+      error = assert_raises(Swift::RuntimeError) { db.execute('select repeat(?, 1000) from generate_series(1, 1000000)', 'x') }
+      assert_match %r{max_result_size}, error.message
+      assert_equal 1, db.execute('select 1 as one').first[:one]
+    end
+
+    it 'should return errors like an unbounded execute' do
+      db.max_result_size = 100_000
+      assert_raises(Swift::RuntimeError) { db.execute('select * from missing_table') }
+      assert db.ping
+    end
+
+    it 'should report affected and selected rows like an unbounded execute' do
+      db.execute('drop table if exists accounts')
+      db.execute('create table accounts(name text)')
+      db.execute('insert into accounts values(?), (?)', 'a', 'b')
+
+      [nil, 100_000].each do |size|
+        db.max_result_size = size
+        assert_equal 2, db.execute('update accounts set name = name').affected_rows
+        result = db.execute('update accounts set name = name returning name')
+        assert_equal [2, 0], [result.selected_rows, result.affected_rows]
+      end
+    end
+
+    it 'should run inside a transaction' do
+      db.max_result_size = 100_000
+      db.transaction do
+        assert_equal 3, db.execute('select n from generate_series(1, ?) as n', 3).selected_rows
+        assert_equal 3, db.execute('select n from generate_series(1, 3) as n').selected_rows
+      end
+      assert_equal false, db.commit
+    end
   end
 
   describe '#native_bind_format' do
+    it 'should only rewrite ? outside literals, identifiers and comments' do
+      sql = %q{select '?' as "a?", $$?$$ as b, ? /* ? */ as c -- ?
+               , E'\\'?' as d, ?::int as e}
+      row = db.execute(sql, 'x', 5).first
+      assert_equal({a?: '?', b: '?', c: 'x', d: "'?", e: 5}, row)
+      assert_equal row, db.execute(sql, 'x', 5).first
+    end
+
+    it 'should leave the jsonb ? operator alone after an operand' do
+      assert_equal true,  db.execute(%q{select '{"a":1}'::jsonb ? ? as found}, 'a').first[:found]
+      assert_equal false, db.execute(%q{select ('{"a":1}'::jsonb) ? ? as found}, 'b').first[:found]
+    end
+
     it 'should not change the hstore ? operator' do
       assert db.execute('create extension if not exists hstore')
       assert db.execute('drop table if exists hstore_test')
@@ -137,4 +385,163 @@ describe 'postgres adapter' do
       end
     end
   end
+
+  describe '#binary_params' do
+    it 'should round trip native values in text and binary format' do
+      now = Time.at(Time.now.to_i, 250000, :usec)
+      assert db.execute('drop table if exists users')
+      assert db.execute(<<-SQL)
+        create table users (
+          id serial primary key,
+          name text,
+          age integer,
+          score float8,
+          big bigint,
+          active boolean,
+          born date,
+          created_at timestamp with time zone
+        )
+      SQL
+
+      [false, true].each do |binary|
+        db.binary_params = binary
+        sql = 'insert into users(name, age, score, big, active, born, created_at) values(?, ?, ?, ?, ?, ?, ?)'
+        assert db.execute(sql, 'a', 30, 0.1, 2**40, true, Date.new(2012, 1, 2), now)
+        assert db.prepare(sql).execute('b', 31, 1.5, 2**40, false, Date.new(2012, 1, 3), now)
+      end
+
+      rows = db.execute('select * from users order by id').to_a
+      assert_equal 4, rows.size
+      assert_equal [30, 31, 30, 31], rows.map {|row| row[:age]}
+      assert_equal [0.1, 1.5, 0.1, 1.5], rows.map {|row| row[:score]}
+      assert_equal [2**40], rows.map {|row| row[:big]}.uniq
+      assert_equal [true, false, true, false], rows.map {|row| row[:active]}
+      assert_equal [Date.new(2012, 1, 2), Date.new(2012, 1, 3)] * 2, rows.map {|row| row[:born]}
+      assert_equal [now.to_f], rows.map {|row| row[:created_at].to_time.to_f}.uniq
+    end
+
+    it 'should only type unambiguous values' do
+      db.binary_params = true
+      types = [1, 2**40, 1.5, Time.now, true, Date.today].map do |value|
+        db.execute('select pg_typeof(value)::text as type from (select ? as value) as t', value).first[:type]
+      end
+      assert_equal %w(text text text text boolean date), types
+    ensure
+      db.binary_params = false
+    end
+  end
+
+  describe '#stream' do
+    it 'should yield rows as they arrive' do
+      rows   = []
+      result = db.stream('select n as id, ? as name from generate_series(1, 10) as n', 'test') {|row| rows << row}
+
+      assert_equal 10, rows.size
+      assert_equal (1..10).to_a, rows.map {|row| row[:id]}
+      assert_equal ['test'], rows.map {|row| row[:name]}.uniq
+      assert_equal 10, result.selected_rows
+    end
+
+    it 'should discard the rest of the stream when the block breaks' do
+      rows = []
+      db.stream('select n from generate_series(1, 100000) as n') {|row| rows << row; break if rows.size == 2}
+      assert_equal 2, rows.size
+      assert_equal 1, db.execute('select 1 as n').first[:n]
+    end
+
+    it 'should raise on errors' do
+      assert_raises(Swift::RuntimeError) { db.stream('select * from no_such_table') {} }
+      assert_raises(Swift::ArgumentError) { db.stream('select 1') }
+    end
+  end
+
+  describe '#statement_cache' do
+    it 'should prepare and reuse statements' do
+      db.statement_cache = 2
+      assert db.execute('drop table if exists users')
+      assert db.execute('create table users(id serial primary key, name text)')
+
+      3.times {|n| assert db.execute('insert into users(name) values(?)', "user #{n}")}
+      assert_equal 3, db.execute('select count(*) as count from users where id > ?', 0).first[:count]
+
+      stats = db.statement_cache_stats
+      assert_equal 2, stats[:misses]
+      assert_equal 2, stats[:hits]
+      assert_equal 2, stats[:size]
+
+      db.execute('select * from users where id = ?', 1)
+      db.execute('select * from users where name = ?', 'user 1')
+      assert_equal 2, db.statement_cache_stats[:evictions]
+    end
+
+    it 'should recover from stale statements' do
+      db.statement_cache = 8
+      assert db.execute('drop table if exists users')
+      assert db.execute('create table users(id serial primary key, name text)')
+      assert db.execute('insert into users(name) values(?)', 'foo')
+      assert_equal 1, db.execute('select * from users where id = ?', 1).first[:id]
+
+      assert db.execute('alter table users add column age int')
+      assert_equal [:id, :name, :age], db.execute('select * from users where id = ?', 1).fields
+
+      assert db.execute('deallocate all')
+      assert_equal 1, db.execute('select * from users where id = ?', 1).first[:id]
+    end
+
+    it 'should deallocate statements evicted in a transaction once it is over' do
+      db.statement_cache = 1
+      prepared = 'select count(*) as count from pg_prepared_statements where name ~ ?'
+
+      db.transaction do
+        db.execute('select ? as x', 1)
+        db.execute('select ? as y', 1)
+        assert_raises(Swift::RuntimeError) { db.execute('select * from no_such_table') }
+      end
+
+      assert_equal 1, db.execute(prepared, '^c[0-9]+$').first[:count]
+    end
+  end
+
+  describe '#register_type' do
+    before do
+      db.execute('drop table if exists moods')
+      db.execute('drop domain if exists posint')
+      db.execute('drop type if exists mood')
+      db.execute(%q{create type mood as enum ('sad', 'happy')})
+      db.execute('create domain posint as integer check (value > 0)')
+      db.execute('create table moods(id posint, mood mood, history mood[])')
+      db.execute(%q{insert into moods values (1, 'happy', '{sad,happy}')})
+      db.reload_types
+    end
+
+    it 'should decode domains and enums using their base type' do
+      row = db.execute('select * from moods').first
+      assert_equal 1, row[:id]
+      assert_equal 'happy', row[:mood]
+      assert_equal %w(sad happy), row[:history]
+      assert_equal %w(posint mood mood[]), db.execute('select * from moods').types
+      assert_equal row, db.binary_format { db.execute('select * from moods').first }
+    end
+
+    it 'should use registered decoders' do
+      db.register_type('mood', proc {|value| value.to_sym})
+      db.register_type(db.typemap.key('posint'), 'bigint')
+      row = db.execute('select * from moods').first
+      assert_equal :happy, row[:mood]
+      assert_equal 1, row[:id]
+
+      other = Swift::DB::Postgres.new(db: 'swift_test')
+      assert_equal 'happy', other.execute('select mood from moods').first[:mood]
+
+      assert_raises(Swift::ArgumentError) { db.register_type('no_such_type', 'integer') }
+      assert_raises(Swift::ArgumentError) { db.register_type('mood', 'point') }
+    ensure
+      other.close if other
+    end
+
+    it 'should name builtin array types like format_type' do
+      assert_equal ['integer[]', 'text[]', 'timestamp with time zone[]'], db.execute(%q{select '{1}'::int[] as a, '{a}'::text[] as b, '{}'::timestamptz[] as c}).types
+      assert_equal 'integer[]', db.typemap[1007]
+    end
+  end
 end
@@ -0,0 +1,197 @@
+require 'helper'
+require 'stringio'
+require 'date'
+require 'json'
+
+describe 'postgres arrow export' do
+  # just enough of the ipc stream format to check what the writer produces without pulling in an arrow library
+  class ArrowIPC
+    TYPES = {2 => :int, 3 => :float, 4 => :binary, 5 => :utf8, 6 => :bool, 8 => :date32, 10 => :timestamp}
+
+    attr_reader :fields, :columns
+
+    def initialize data
+      @data, @fields, @kinds, pos = data.b, [], [], 0
+
+      while pos < @data.bytesize && (length = @data[pos + 4, 4].unpack1('l<')) > 0
+        message = pos + 8 + u32(pos + 8)
+        header  = ref(message, 2)
+        body    = pos + 8 + length
+
+        case scalar(message, 1, 'C')
+          when 1 then schema(header)
+          when 3 then batch(header, body)
+        end
+        pos = body + scalar(message, 3, 'q<')
+      end
+    end
+
+    private
+
+    def schema header
+      count, start = vector(header, 1)
+      @columns = Array.new(count) { [] }
+
+      count.times do |n|
+        field = start + n * 4 + u32(start + n * 4)
+        type  = ref(field, 3)
+        kind  = TYPES.fetch(scalar(field, 2, 'C'))
+
+        @kinds  << [kind, kind == :int ? scalar(type, 0, 'l<') : scalar(type, 0, 's<')]
+        @fields << [string(field, 0), name(kind, @kinds.last[1])]
+      end
+    end
+
+    def name kind, width
+      case kind
+        when :int   then :"int#{width}"
+        when :float then width == 1 ? :float32 : :float64
+        else kind
+      end
+    end
+
+    def batch header, body
+      rows = scalar(header, 0, 'q<')
+      count, start = vector(header, 2)
+      buffers = Array.new(count) {|n| @data[start + n * 16, 16].unpack('q<q<')}.map {|offset, size| @data[body + offset, size]}
+
+      @kinds.each_with_index do |(kind, width), col|
+        valid  = buffers.shift
+        values = buffers.shift
+        data   = buffers.shift if %i(utf8 binary).include?(kind)
+
+        rows.times do |row|
+          @columns[col] << (valid.empty? || valid.getbyte(row >> 3)[row & 7] == 1 ? value(kind, width, values, data, row) : nil)
+        end
+      end
+    end
+
+    def value kind, width, values, data, row
+      case kind
+        when :bool      then values.getbyte(row >> 3)[row & 7] == 1
+        when :int       then values[row * width / 8, width / 8].unpack1({16 => 's<', 32 => 'l<', 64 => 'q<'}[width])
+        when :float     then width == 1 ? values[row * 4, 4].unpack1('e') : values[row * 8, 8].unpack1('E')
+        when :date32    then Date.new(1970, 1, 1) + values[row * 4, 4].unpack1('l<')
+        when :timestamp then Time.at(Rational(values[row * 8, 8].unpack1('q<'), 1_000_000)).utc
+        else
+          from, to = values[row * 4, 8].unpack('l<l<')
+          kind == :utf8 ? data[from, to - from].force_encoding('utf-8') : data[from, to - from]
+      end
+    end
+
+    def u32 pos
+      @data[pos, 4].unpack1('L<')
+    end
+
+    # absolute position of a table field, nil when it was left out
+    def field table, n
+      vtable = table - @data[table, 4].unpack1('l<')
+      return if 4 + n * 2 >= @data[vtable, 2].unpack1('S<')
+      offset = @data[vtable + 4 + n * 2, 2].unpack1('S<')
+      table + offset unless offset.zero?
+    end
+
+    def scalar table, n, format
+      (pos = field(table, n)) ? @data[pos, 8].unpack1(format) : 0
+    end
+
+    def ref table, n
+      pos = field(table, n)
+      pos + u32(pos)
+    end
+
+    def vector table, n
+      pos = ref(table, n)
+      [u32(pos), pos + 4]
+    end
+
+    def string table, n
+      pos = ref(table, n)
+      @data[pos + 4, u32(pos)].force_encoding('utf-8')
+    end
+  end
+
+  before do
+    assert db.execute('drop table if exists users')
+    assert db.execute('create table users(id serial primary key, name text, active boolean, born date, seen timestamp)')
+    assert db.execute("insert into users(name, active, born, seen) values('foo', true, '2012-01-02', '2012-01-02 03:04:05.5'), ('bar', null, null, null)")
+  end
+
+  def stream
+    StringIO.new(''.b)
+  end
+
+  it 'should write a result as an arrow ipc stream' do
+    io = stream
+    assert_equal 2, db.execute('select * from users order by id').to_arrow(io)
+
+    data = io.string
+    assert_equal "\xFF\xFF\xFF\xFF".b, data[0, 4]
+    assert_equal "\xFF\xFF\xFF\xFF\x00\x00\x00\x00".b, data[-8, 8]
+    assert_equal 0, data.bytesize % 8
+  end
+
+  it 'should describe and encode the columns' do
+    io = stream
+    db.execute('select * from users order by id').to_arrow(io)
+    ipc = ArrowIPC.new(io.string)
+
+    assert_equal [%w(id int32), %w(name utf8), %w(active bool), %w(born date32), %w(seen timestamp)], ipc.fields.map {|name, type| [name, type.to_s]}
+    assert_equal [1, 2], ipc.columns[0]
+    assert_equal %w(foo bar), ipc.columns[1]
+    assert_equal [true, nil], ipc.columns[2]
+    assert_equal [Date.new(2012, 1, 2), nil], ipc.columns[3]
+    assert_equal [Time.utc(2012, 1, 2, 3, 4, Rational(11, 2)), nil], ipc.columns[4]
+  end
+
+  it 'should be readable by pyarrow' do
+    skip 'pyarrow is not installed' unless system('python3', '-c', 'import pyarrow', err: File::NULL)
+
+    io = stream
+    db.copy_to_arrow('select * from users order by id', io)
+
+    script = 'import sys, json, pyarrow as pa; t = pa.ipc.open_stream(sys.stdin.buffer.read()).read_all(); ' \
+             'print(json.dumps([[f.name, str(f.type), [None if v is None else str(v) for v in t.column(f.name).to_pylist()]] for f in t.schema]))'
+    table = JSON.parse(IO.popen(['python3', '-c', script], 'r+b') {|python| python.write(io.string); python.close_write; python.read})
+
+    assert_equal [
+      ['id',     'int32',         %w(1 2)],
+      ['name',   'string',        %w(foo bar)],
+      ['active', 'bool',          ['True', nil]],
+      ['born',   'date32[day]',   ['2012-01-02', nil]],
+      ['seen',   'timestamp[us]', ['2012-01-02 03:04:05.500000', nil]]
+    ], table
+  end
+
+  it 'should write the same stream using copy' do
+    result, copy = stream, stream
+
+    assert_equal 2, db.execute('select id, name, active, born from users order by id').to_arrow(result)
+    assert_equal 2, db.copy_to_arrow('select id, name, active, born from users order by id', copy)
+    assert_equal result.string, copy.string
+  end
+
+  it 'should write the same numeric and uuid text using copy' do
+    result, copy = stream, stream
+    sql = %q{select * from (values (12.50::numeric, 'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11'::uuid), (-0.0001, null),
+      (-1234567.890, '00000000-0000-0000-0000-000000000000'), (0, null), (1e20, null), ('NaN', null)) as t(amount, id)}
+
+    db.execute(sql).to_arrow(result)
+    db.copy_to_arrow(sql, copy)
+
+    expected = [
+      %w(12.50 -0.0001 -1234567.890 0 100000000000000000000 NaN),
+      ['a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11', nil, '00000000-0000-0000-0000-000000000000', nil, nil, nil]
+    ]
+    assert_equal expected, ArrowIPC.new(result.string).columns
+    assert_equal expected, ArrowIPC.new(copy.string).columns
+  end
+
+  it 'should leave the connection usable when the io fails' do
+    io = Object.new
+    def io.write(data) raise IOError, 'closed' end
+
+    assert_raises(IOError) { db.copy_to_arrow('select * from generate_series(1, 100000)', io) }
+    assert_equal 2, db.execute('select count(*) as count from users').first[:count]
+  end
+end
@@ -33,3 +33,102 @@ describe 'async operations' do
     assert_equal [3, 2, 1], rows
   end
 end
+
+describe 'fiber scheduler' do
+  # just enough of a scheduler to run queries in fibers, io waits and sleeps go through IO.select
+  class SelectScheduler
+    def initialize
+      @readable, @writable, @sleeping, @ready = {}, {}, {}, []
+      @wakeup = IO.pipe
+    end
+
+    def io_wait io, events, timeout
+      @readable[io] = Fiber.current if events & IO::READABLE != 0
+      @writable[io] = Fiber.current if events & IO::WRITABLE != 0
+      Fiber.yield
+    end
+
+    def kernel_sleep duration = nil
+      @sleeping[Fiber.current] = now + duration if duration
+      Fiber.yield
+    end
+
+    def block blocker, timeout = nil
+      Fiber.yield
+      true
+    end
+
+    def unblock blocker, fiber
+      @ready << fiber
+      @wakeup.last.write('.')
+    end
+
+    def fiber &block
+      Fiber.new(blocking: false, &block).tap(&:resume)
+    end
+
+    def close
+      run
+    end
+
+    def run
+      while @readable.any? || @writable.any? || @sleeping.any? || @ready.any?
+        # a killed fiber never comes back for its io
+        [@readable, @writable].each {|waiting| waiting.delete_if {|_, fiber| !fiber.alive?}}
+        @sleeping.delete_if {|fiber, _| !fiber.alive?}
+        timeout = @sleeping.empty? ? nil : [@sleeping.values.min - now, 0].max
+        readable, writable = IO.select(@readable.keys + [@wakeup.first], @writable.keys, [], timeout)
+
+        resume = (readable || []).map {|io| @readable.delete(io)} + (writable || []).map {|io| @writable.delete(io)}
+        @wakeup.first.read_nonblock(64, exception: false) if readable&.include?(@wakeup.first)
+        @sleeping.select {|_, at| at <= now}.each_key {|fiber| resume << fiber; @sleeping.delete(fiber)}
+        resume.concat(@ready.slice!(0..))
+
+        resume.compact.uniq.each {|fiber| fiber.resume if fiber.alive?}
+      end
+    end
+
+    def now
+      Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+  end
+
+  def schedule &block
+    Thread.new do
+      Fiber.set_scheduler(SelectScheduler.new)
+      block.call
+    end.join
+  end
+
+  it 'should overlap queries on separate connections' do
+    pool = 2.times.map {Swift::DB::Postgres.new(db: 'swift_test')}
+    rows = []
+
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    schedule do
+      pool.each_with_index do |db, n|
+        Fiber.schedule { rows << db.execute("select pg_sleep(0.5), #{n} as n").first[:n] }
+      end
+    end
+
+    assert_equal [0, 1], rows.sort
+    assert_operator Process.clock_gettime(Process::CLOCK_MONOTONIC) - started, :<, 0.9
+  ensure
+    pool.each(&:close)
+  end
+
+  it 'should leave the connection usable when a waiting fiber is killed' do
+    row = nil
+
+    schedule do
+      fiber = Fiber.schedule { db.execute('select pg_sleep(10)') }
+      Fiber.schedule do
+        sleep 0.1
+        fiber.kill
+        row = db.execute('select 1 as one').first
+      end
+    end
+
+    assert_equal({one: 1}, row)
+  end
+end
@@ -0,0 +1,60 @@
+require 'helper'
+
+describe 'postgres pipeline' do
+  before do
+    assert db.execute('drop table if exists users')
+    assert db.execute('create table users(id serial primary key, name text)')
+  end
+
+  it 'should return results in order' do
+    statement = db.prepare('select count(*) as count from users where name = ?')
+
+    results = db.pipeline do |p|
+      p.execute('insert into users(name) values(?)', 'foo')
+      p.execute('insert into users(name) values(?), (?)', 'bar', 'bar')
+      p.execute(statement, 'bar')
+      p.execute('select name from users order by id')
+    end
+
+    assert_equal 4, results.size
+    assert_equal [1, 2], results.take(2).map(&:affected_rows)
+    assert_equal 2, results[2].first[:count]
+    assert_equal %w(foo bar bar), results[3].map {|row| row[:name]}
+  end
+
+  it 'should report errors per statement' do
+    results = db.pipeline do |p|
+      p.execute('insert into users(name) values(?)', 'foo')
+      p.execute('select * from no_such_table')
+      p.execute('select 1')
+    end
+
+    assert_kind_of Swift::DB::Postgres::Result, results[0]
+    assert_kind_of Swift::RuntimeError, results[1]
+    assert_kind_of Swift::RuntimeError, results[2]
+    assert_equal 0, db.execute('select count(*) as count from users').first[:count]
+  end
+
+  it 'should leave the connection usable when the block raises' do
+    assert_raises(RuntimeError) do
+      db.pipeline do |p|
+        p.execute('select 1')
+        raise 'oops'
+      end
+    end
+
+    assert_equal 1, db.execute('select 1 as n').first[:n]
+  end
+
+  it 'should run inside a transaction started before the pipeline' do
+    assert_raises(RuntimeError) do
+      db.transaction do
+        results = db.pipeline {|p| p.execute('insert into users(name) values(?)', 'foo')}
+        assert_equal 1, results.first.affected_rows
+        raise 'rollback'
+      end
+    end
+
+    assert_equal 0, db.execute('select count(*) as count from users').first[:count]
+  end
+end
@@ -0,0 +1,105 @@
+require 'helper'
+
+describe 'connection pool' do
+  def pool options = {}
+    @pool ||= Swift::DB::Postgres::Pool.new({db: 'swift_test', min: 1, max: 2}.merge(options))
+  end
+
+  after do
+    @pool.close if @pool
+  end
+
+  it 'should open the minimum connections upfront' do
+    assert_equal 1, pool.size
+    assert_equal 1, pool.stats[:idle]
+  end
+
+  it 'should check out and check in connections' do
+    db = pool.checkout
+    assert_kind_of Swift::DB::Postgres, db
+    assert_equal 1, pool.stats[:in_use]
+
+    pool.checkin(db)
+    assert_equal 0, pool.stats[:in_use]
+    assert_raises(Swift::ArgumentError) {pool.checkin(db)}
+    assert_raises(Swift::ArgumentError) {pool.checkin(Swift::DB::Postgres.new(db: 'swift_test'))}
+  end
+
+  it 'should grow up to max and time out waiting' do
+    held = 2.times.map {pool.checkout}
+    assert_equal 2, pool.size
+
+    assert_raises(Swift::ConnectionError) {pool.checkout(0.05)}
+    assert_equal 1, pool.stats[:timeouts]
+    held.each {|db| pool.checkin(db)}
+  end
+
+  it 'should time out a checkout by its own timeout when the pool waits forever' do
+    held = pool(max: 1, checkout_timeout: nil).checkout
+    assert_raises(Swift::ConnectionError) {pool.checkout(0.05)}
+    pool.checkin(held)
+  end
+
+  it 'should keep the slot of a discarded connection for the first waiter' do
+    held   = pool(max: 1).checkout
+    thread = Thread.new {pool.with {|db| db.execute('select 1 as one').first[:one]}}
+    sleep 0.05
+
+    held.close
+    pool.checkin(held)
+    assert_raises(Swift::ConnectionError) {pool.checkout(0)}
+    assert_equal 1, thread.value
+  end
+
+  it 'should serve waiting threads in order' do
+    order   = []
+    held    = 2.times.map {pool.checkout}
+    threads = 3.times.map {|n| thread = Thread.new {pool.with {order << n}}; sleep 0.05; thread}
+
+    assert_equal 3, pool.stats[:waiting]
+    held.each {|db| pool.checkin(db); sleep 0.05}
+    threads.each(&:join)
+
+    assert_equal [0, 1, 2], order
+    assert_equal 3, pool.stats[:waits]
+  end
+
+  it 'should roll back open transactions and reset the session on checkin' do
+    pool(max: 1).with do |db|
+      db.execute("set application_name to 'dirty'")
+      db.timestamp_format = :epoch
+      db.begin
+      db.execute('create temporary table pool_reset(id int)')
+    end
+
+    pool.with do |db|
+      assert_nil db.execute("select to_regclass('pool_reset')::text as name").first[:name]
+      assert_equal '', db.execute('show application_name').first[:application_name]
+      assert_equal :datetime, db.timestamp_format
+    end
+  end
+
+  it 'should replace connections that were closed while checked out' do
+    pool.with(&:close)
+    assert_equal 0, pool.size
+    assert pool.with {|db| db.execute('select 1 as one').first[:one]}
+    assert_equal 1, pool.stats[:discarded]
+  end
+
+  it 'should health check idle connections' do
+    pool(reset: nil, health_check: 0).with {}
+    pool.with {}
+    assert pool.stats[:health_checks] > 0
+  end
+
+  it 'should raise in waiters when closed' do
+    db     = pool(max: 1).checkout
+    thread = Thread.new {pool.checkout(5) rescue $!}
+    sleep 0.05
+
+    pool.close
+    assert_kind_of Swift::ConnectionError, thread.value
+    pool.checkin(db)
+    assert_equal 0, pool.size
+  end
+end
@@ -77,6 +77,28 @@ describe 'postgres statement' do
     assert_kind_of IPAddr, tuple[:ip]
   end
 
+  it 'should recover from encoder errors and nested queries' do
+    db.encoder = proc do |value|
+      case value
+        when Hash   then raise ArgumentError, 'no hashes'
+        when Symbol then db.execute('select ?::text as name', value.to_s).first[:name]
+        else nil
+      end
+    end
+
+    assert_raises(ArgumentError) { db.execute('select ?::int as a, ?::text as b', 1, {}) }
+    assert_equal({a: 1, b: 'x', c: 'y'}, db.execute('select ?::int as a, ?::text as b, ?::text as c', 1, :x, 'y').first)
+    assert_equal({a: 2, b: '#<Object'}, db.execute('select ?::int as a, left(?::text, 8) as b', 2, Object.new).first)
+  end
+
+  it 'should report result memory' do
+    result = db.execute('select repeat(?, 1000) as data from generate_series(1, 100)', 'x')
+    assert_operator result.memsize, :>, 100_000
+
+    result.clear
+    assert_equal 0, result.memsize
+  end
+
   it 'should allow fetching result by row and column' do
     assert db.execute('drop table if exists users')
     assert db.execute(<<-SQL)
@@ -120,4 +142,218 @@ describe 'postgres statement' do
     assert_nil result.get(1, 4)
     assert_nil result.get(2, 0)
   end
+
+  it 'should decode binary results' do
+    assert db.execute('drop table if exists users')
+    assert db.execute(<<-SQL)
+      create table users (
+        id serial primary key,
+        name text,
+        active boolean,
+        score float8,
+        balance numeric(12,2),
+        uid uuid,
+        born date,
+        created_at timestamp
+      )
+    SQL
+
+    assert db.execute(<<-SQL, 'a', true, 1.5, '-1234.50', '01234567-89ab-cdef-0123-456789abcdef', '2012-01-02', '2012-01-02 03:04:05.25')
+      insert into users(name, active, score, balance, uid, born, created_at) values(?, ?, ?, ?, ?, ?, ?)
+    SQL
+
+    text   = db.execute('select * from users').first
+    binary = db.binary_format { db.execute('select * from users').first }
+
+    assert_equal text, binary
+    assert_equal 1, binary[:id]
+    assert_equal 'a', binary[:name]
+    assert_equal true, binary[:active]
+    assert_equal 1.5, binary[:score]
+    assert_equal BigDecimal('-1234.50'), binary[:balance]
+    assert_equal '01234567-89ab-cdef-0123-456789abcdef', binary[:uid]
+    assert_equal Date.new(2012, 1, 2), binary[:born]
+    assert_equal 5.25, binary[:created_at].sec + binary[:created_at].sec_fraction
+
+    statement = db.prepare('select * from users where id = ?')
+    statement.binary_format = true
+    assert_equal binary, statement.execute(1).first
+  end
+
+  it 'should decode wide results consistently across #each and #get' do
+    columns = (1..40).map {|n| "#{n}::int as c#{n}, 'v#{n}'::text as t#{n}, null::int as n#{n}"}
+    result  = db.execute("select #{columns.join(', ')} from generate_series(1, 3)")
+
+    rows = result.to_a
+    assert_equal 3, rows.size
+    rows.each_with_index do |row, r|
+      assert_equal 120, row.size
+      assert_equal result.fields, row.keys
+      row.values.each_with_index {|value, c| assert_equal value, result.get(r, c)}
+    end
+
+    assert_equal 40,    rows.last[:c40]
+    assert_equal 'v40', rows.last[:t40]
+    assert_nil   rows.last[:n40]
+  end
+
+  it 'should fetch rows as arrays and single columns' do
+    result = db.execute("select n as id, 'v' || n as name, null::int as age from generate_series(1, 3) as n")
+
+    rows = []
+    result.each_row {|row| rows << row}
+    assert_equal [[1, 'v1', nil], [2, 'v2', nil], [3, 'v3', nil]], rows
+    assert rows.all?(&:frozen?)
+    assert_equal rows, result.rows
+    assert_equal rows, result.each_row.to_a
+
+    assert_equal [1, 2, 3],          result.column(:id)
+    assert_equal %w(v1 v2 v3),       result.column('name')
+    assert_equal [nil, nil, nil],    result.column(2)
+    assert_equal %w(v1 v2 v3),       result.column(-2)
+    assert_raises(Swift::ArgumentError) { result.column(:missing) }
+    assert_raises(Swift::ArgumentError) { result.column(3) }
+  end
+
+  it 'should fall back to text for columns binary results cannot decode the same way' do
+    db.execute("set time zone 'Asia/Kolkata'")
+    sql  = "select '1 day 02:03:04'::interval as span, '10.0.0.1'::inet as host, '2012-01-02 03:04:05+05:30'::timestamptz as at, ?::int as n"
+    text = db.execute(sql, 1).first.transform_values(&:to_s)
+
+    statement = db.prepare(sql)
+    statement.binary_format = true
+    assert_equal text, statement.execute(1).first.transform_values(&:to_s)
+
+    db.statement_cache = 8
+    assert_equal text, db.binary_format { db.execute(sql, 1).first.transform_values(&:to_s) }
+
+    db.statement_cache = 0
+    error = assert_raises(Swift::RuntimeError) { db.binary_format { db.execute(sql, 1) } }
+    assert_match %r{column span}, error.message
+    assert_equal 1, db.execute('select 1 as n').first[:n]
+  end
+
+  it 'should decode timestamps as time or epoch microseconds' do
+    sql = "select '2012-01-02 03:04:05.25'::timestamp as ts, '2012-01-02 03:04:05.123456+05:30'::timestamptz as tz, '2012-01-02'::date as d"
+    # binary timestamptz only reads the same as text in a utc session
+    db.execute("set time zone 'UTC'")
+
+    row = db.execute(sql).first
+    assert_kind_of Swift::DateTime, row[:ts]
+    assert_equal Date.new(2012, 1, 2), row[:d]
+
+    db.timestamp_format = :time
+    assert_equal :time, db.timestamp_format
+    row = db.execute(sql).first
+    assert_equal Time.utc(2012, 1, 2, 3, 4, 5.25), row[:ts]
+    assert_equal Time.utc(2012, 1, 1, 21, 34, Rational(5123456, 1000000)), row[:tz]
+    assert_equal Date.new(2012, 1, 2), row[:d]
+    assert_equal row, db.binary_format { db.execute(sql).first }
+
+    db.timestamp_format = :epoch
+    row = db.execute(sql).first
+    assert_equal 1325473445250000, row[:ts]
+    assert_equal 1325453645123456, row[:tz]
+    assert_equal row, db.binary_format { db.execute(sql).first }
+
+    assert_raises(Swift::ArgumentError) { db.timestamp_format = :bogus }
+  end
+
+  it 'should decode numerics using the numeric format' do
+    sql = "select 42::numeric(12, 0) as id, 42::numeric as n, '-1234.50'::numeric(12, 2) as amount, 'NaN'::numeric as nan"
+
+    row = db.execute(sql).first
+    assert_equal BigDecimal('42'), row[:id]
+    assert_equal BigDecimal('-1234.50'), row[:amount]
+
+    db.numeric_format = :auto
+    assert_equal :auto, db.numeric_format
+    row = db.execute(sql).first
+    assert_equal 42, row[:id]
+    assert_kind_of Integer, row[:n]
+    assert_equal BigDecimal('-1234.50'), row[:amount]
+    assert row[:nan].nan?
+    assert_equal row.values_at(:id, :n, :amount), db.binary_format { db.execute(sql).first.values_at(:id, :n, :amount) }
+
+    db.numeric_format = :rational
+    row = db.execute(sql).first
+    assert_equal Rational(-2469, 2), row[:amount]
+    assert_equal Rational(42), row[:id]
+    assert_equal row.values_at(:id, :n, :amount), db.binary_format { db.execute(sql).first.values_at(:id, :n, :amount) }
+
+    db.numeric_format = :float
+    row = db.execute(sql).first
+    assert_equal(-1234.5, row[:amount])
+    assert row[:nan].nan?
+
+    assert_raises(Swift::ArgumentError) { db.numeric_format = :bogus }
+  end
+
+  it 'should decode bytea as io or string' do
+    data = (0..255).map(&:chr).join * 3
+    sql  = 'select ?::bytea as short, ?::bytea as long'
+    bind = proc { [StringIO.new("\x00\xff"), StringIO.new(data)] }
+
+    row = db.execute(sql, *bind.call).first
+    assert_kind_of StringIO, row[:long]
+    assert_equal data.b, row[:long].read
+
+    db.bytea_format = :string
+    assert_equal :string, db.bytea_format
+    row = db.execute(sql, *bind.call).first
+    assert_equal "\x00\xff".b, row[:short]
+    assert_equal data.b, row[:long]
+    assert_equal Encoding::BINARY, row[:long].encoding
+    assert_equal row, db.binary_format { db.execute(sql, *bind.call).first }
+
+    assert_raises(Swift::ArgumentError) { db.bytea_format = :bogus }
+  end
+
+  it 'should decode arrays' do
+    sql = %q{select '{1,2,NULL}'::int[] as ids, '{{a,"b,c"},{"d \\"e\\"",NULL}}'::text[] as tags, '{}'::bigint[] as empty,
+                    '{1.5,NaN}'::numeric[] as amounts, '{t,f}'::bool[] as flags, '{2012-01-02}'::date[] as dates}
+
+    row = db.execute(sql).first
+    assert_equal [1, 2, nil], row[:ids]
+    assert_equal [['a', 'b,c'], ['d "e"', nil]], row[:tags]
+    assert_equal [], row[:empty]
+    assert_equal BigDecimal('1.5'), row[:amounts].first
+    assert row[:amounts].last.nan?
+    assert_equal [true, false], row[:flags]
+    assert_equal [Date.new(2012, 1, 2)], row[:dates]
+    assert_equal row.reject {|k, _| k == :amounts}, db.binary_format { db.execute(sql).first.reject {|k, _| k == :amounts} }
+
+    db.timestamp_format = :epoch
+    assert_equal [1325473445000000, nil], db.execute(%q{select '{"2012-01-02 03:04:05",NULL}'::timestamp[] as ts}).first[:ts]
+  end
+
+  it 'should parse json using the json format' do
+    sql = %q{select '{"a": [1, 2.5, null, true], "b": {"c": "d\\u00e9"}}'::json as doc, '[{"k": 1}, {"k": 2}]'::jsonb as list}
+
+    assert_kind_of String, db.execute(sql).first[:doc]
+
+    db.json_format = :parse
+    assert_equal :parse, db.json_format
+    row = db.execute(sql).first
+    assert_equal({'a' => [1, 2.5, nil, true], 'b' => {'c' => "d\u00e9"}}, row[:doc])
+    assert row[:list][0].keys.first.frozen?
+    assert_same row[:list][0].keys.first, row[:list][1].keys.first
+    assert_equal row, db.binary_format { db.execute(sql).first }
+
+    db.json_format = :symbolize
+    row = db.execute(sql).first
+    assert_equal [{k: 1}, {k: 2}], row[:list]
+    assert_equal [[{k: 1}], nil], db.execute(%q{select array['[{"k": 1}]'::jsonb, null] as docs}).first[:docs]
+
+    assert_raises(Swift::ArgumentError) { db.json_format = :bogus }
+  end
+
+  it 'should parse json null as nil and keep json it cannot parse as text' do
+    deep = '[' * 101 + ']' * 101
+    sql  = %Q{select 'null'::json as doc, 'null'::jsonb as bdoc, array['null', '1', '#{deep}']::json[] as docs, '#{deep}'::json as deep}
+
+    db.json_format = :parse
+    assert_equal({doc: nil, bdoc: nil, docs: [nil, 1, deep], deep: deep}, db.execute(sql).first)
+    assert_equal({doc: nil, bdoc: nil, docs: [nil, 1, deep], deep: deep}, db.binary_format { db.execute(sql).first })
+  end
 end